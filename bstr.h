@@ -43,29 +43,370 @@
 #include <ctype.h>
 #include <stddef.h>
 #include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+
+/* Scatter-gather output is available wherever writev is */
+#if !defined(BSTR_NO_WRITEV) && (defined(__unix__) || defined(__APPLE__))
+#define BSTR_HAVE_WRITEV 1
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+/* Read-only file mappings, see bstr_map_file() */
+#if !defined(BSTR_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define BSTR_HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+/*
+ * Access hints need madvise or posix_madvise, which glibc hides under
+ * -std=c99 unless _DEFAULT_SOURCE or _POSIX_C_SOURCE >= 200112L is
+ * defined before the first system header. Define BSTR_NO_MADVISE to
+ * map files without them.
+ */
+#if !defined(BSTR_NO_MADVISE) && (defined(MADV_SEQUENTIAL) || defined(POSIX_MADV_SEQUENTIAL))
+#define BSTR_HAVE_MADVISE 1
+#endif
+#endif
+
+/* The intern pool needs POSIX threads and the GCC atomic builtins */
+#if !defined(BSTR_NO_INTERN) && defined(__GNUC__) && (defined(__unix__) || defined(__APPLE__))
+#define BSTR_HAVE_INTERN 1
+#include <pthread.h>
+#endif
+
+/* Copy-on-write sharing needs the GCC atomic builtins for its refcount */
+#if !defined(BSTR_NO_SHARE) && defined(__GNUC__)
+#define BSTR_HAVE_SHARE 1
+#endif
+
+/*
+ * SSE2/AVX2 kernels are compiled with per-function target attributes and
+ * picked at run time from CPUID, so the header needs no special flags.
+ * Define BSTR_NO_SIMD to build the scalar code only.
+ */
+#if !defined(BSTR_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BSTR_X86_SIMD 1
+#include <immintrin.h>
+#define BSTR__SSE2 __attribute__((target("sse2")))
+#define BSTR__AVX2 __attribute__((target("avx2")))
+#endif
 
 /* Constants for return values */
 #define BSTR_OK 0
 #define BSTR_ERR -1
 
+/*
+ * Type of lengths, offsets and capacities. It is int by default, which
+ * caps strings just under 2 GiB. Define BSTR_LARGE_STRINGS before
+ * including this header to make it ptrdiff_t, which is 64 bits on 64-bit
+ * targets. It stays signed so that functions returning a length or
+ * position can still return BSTR_ERR.
+ */
+#ifdef BSTR_LARGE_STRINGS
+typedef ptrdiff_t bstr_len_t;
+#define BSTR_LEN_MAX PTRDIFF_MAX
+#else
+typedef int bstr_len_t;
+#define BSTR_LEN_MAX INT_MAX
+#endif
+
+/* Instruction set levels, see bstr_set_simd_level() */
+#define BSTR_SIMD_NONE 0
+#define BSTR_SIMD_SSE2 1
+#define BSTR_SIMD_AVX2 2
+
+/*
+ * Minimum inline capacity of a bstr. The header and the character buffer
+ * are carved from one block, so every string starts out with at least this
+ * many bytes (including the terminating NUL) directly after its header.
+ */
+#ifndef BSTR_SSO_SIZE
+#define BSTR_SSO_SIZE 24
+#endif
+
+/*
+ * Allocator hooks used for every bstr header, buffer and list. The sizes
+ * handed to realloc and free are the ones the block was allocated with, so
+ * allocators do not need to track them.
+ */
+struct bstr_allocator {
+	void *	(*alloc)(void *ctx, size_t size);
+	void *	(*realloc)(void *ctx, void *ptr, size_t old_size, size_t new_size);
+	void	(*free)(void *ctx, void *ptr, size_t size);
+	void *	ctx;
+};
+
 /* Structure representing a bstr */
 typedef struct tagbstr {
-	int		mlen;   /* Maximum length (allocated buffer size) */
-	int		slen;   /* Current length of the string */
+	bstr_len_t	mlen;   /* Maximum length (allocated buffer size) */
+	bstr_len_t	slen;   /* Current length of the string */
 	unsigned char * data;   /* Pointer to the character data */
+	const struct bstr_allocator *ator;      /* Allocator owning this string */
+	uint64_t	hash;   /* bstr_hash() of the contents, see BSTR__F_HASHED */
+	bstr_len_t	icap;   /* Capacity of the inline buffer */
+	unsigned int	flags;  /* BSTR__F_* */
+	unsigned char	ibuf[];         /* Inline buffer allocated with the header */
 } *bstr;
 
+#define BSTR__HDR_SIZE offsetof(struct tagbstr, ibuf)
+
 typedef struct bstr_list {
 	int	qty;
 	int	mlen;
 	bstr *	entry;
+	const struct bstr_allocator *ator;
 } bstr_list;
 
+/*
+ * Non-owning window onto bytes that live elsewhere, usually inside a bstr.
+ * A view is not NUL terminated and is only valid while its source is
+ * neither modified nor destroyed. Views are small and passed by value.
+ */
+typedef struct bstr_view {
+	const unsigned char *	data;
+	bstr_len_t		slen;
+} bstr_view;
+
+/*
+ * Packed list: the bytes of every entry sit back to back in blob, each
+ * followed by a NUL, and entry i starts at blob + ofs[i]. The header,
+ * offsets and blob share one allocation sized exactly up front.
+ */
+struct bstr_packed_list {
+	int				qty;
+	bstr_len_t			blen;   /* Bytes in blob, NULs included */
+	const struct bstr_allocator *	ator;
+	unsigned char *			blob;
+	bstr_len_t			ofs[];  /* qty + 1 offsets, the last being blen */
+};
+
+/* Tokens of bstr_split_view, allocated as a single block. */
+struct bstr_view_list {
+	int				qty;
+	const struct bstr_allocator *	ator;
+	bstr_view			entry[];
+};
+
+/*
+ * Open-addressing hash map in the Swiss table style: one control byte per
+ * slot holds 7 bits of the key's hash, and lookups test 16 control bytes
+ * at a time. The map owns copies of its keys; values are opaque.
+ */
+struct bstr_map_slot {
+	bstr	key;
+	void *	value;
+};
+
+struct bstr_map {
+	struct bstr_map_slot *		slots;
+	unsigned char *			ctrl;   /* cap bytes, after the slots */
+	int				cap;    /* Power of two, at least 16 */
+	int				size;
+	int				growth; /* Inserts left before a rehash */
+	const struct bstr_allocator *	ator;
+};
+
+/* A bstr_map without values. */
+struct bstr_set {
+	struct bstr_map	map;
+};
+
+/*
+ * Rope: a balanced tree (an implicit treap) of chunks ordered by position,
+ * each node caching the byte count of its subtree. Appends and prepends
+ * fill the tail and head chunks outside the tree, which only enter it
+ * once full, so small pieces cost O(1). Inserts split the tree at the
+ * offset and merge the new chunks in, O(log n) plus the bytes copied.
+ */
+#ifndef BSTR_ROPE_CHUNK
+#define BSTR_ROPE_CHUNK 4096
+#endif
+
+struct bstr_rope_node {
+	struct bstr_rope_node *	left;
+	struct bstr_rope_node *	right;
+	bstr_len_t		size;   /* Bytes in this subtree */
+	unsigned int		prio;   /* Heap order, random */
+	int			off;    /* Bytes live in data[off, off + len) */
+	int			len;
+	int			cap;
+	unsigned char		data[];
+};
+
+struct bstr_rope {
+	struct bstr_rope_node *		root;
+	struct bstr_rope_node *		head;   /* Filled back to front by prepends */
+	struct bstr_rope_node *		tail;   /* Filled by appends */
+	bstr_len_t			len;
+	unsigned int			seed;
+	bstr				flat;   /* Cached bstr_rope_flatten result */
+	const struct bstr_allocator *	ator;
+};
+
+/*
+ * Gap buffer: the text lives in buf->data around a hole,
+ * [0, gap_start) before it and [gap_end, buf->mlen) after it. Edits move
+ * the hole to the edit point first, so a run of edits near one spot
+ * only shifts the bytes between consecutive edit points.
+ */
+struct bstr_gap {
+	bstr		buf;
+	bstr_len_t	gap_start;
+	bstr_len_t	gap_end;
+};
+
+#ifdef BSTR_HAVE_INTERN
+/*
+ * Intern pool. Canonical strings are read-only and live until the pool
+ * is destroyed. The pool is split into shards by hash, each an
+ * open-addressing table of string pointers guarded by its own mutex for
+ * inserts. Lookups take no lock: they load the table and slot pointers
+ * with acquire semantics, and tables replaced by growth are retired
+ * rather than freed so that concurrent readers stay safe.
+ */
+#ifndef BSTR_INTERN_SHARDS
+#define BSTR_INTERN_SHARDS 16
+#endif
+#if BSTR_INTERN_SHARDS < 1 || BSTR_INTERN_SHARDS > 64 || (BSTR_INTERN_SHARDS & (BSTR_INTERN_SHARDS - 1))
+#error "BSTR_INTERN_SHARDS must be a power of two no larger than 64"
+#endif
+
+/* log2(BSTR_INTERN_SHARDS); shards are picked by the top bits of the hash */
+#define BSTR__INTERN_SHARD_BITS \
+	(BSTR_INTERN_SHARDS >= 64 ? 6 : BSTR_INTERN_SHARDS >= 32 ? 5 : BSTR_INTERN_SHARDS >= 16 ? 4 : \
+	 BSTR_INTERN_SHARDS >= 8 ? 3 : BSTR_INTERN_SHARDS >= 4 ? 2 : BSTR_INTERN_SHARDS >= 2 ? 1 : 0)
+
+struct bstr_intern_table {
+	struct bstr_intern_table *	retired;        /* Older tables of the shard */
+	int				cap;            /* Power of two */
+	bstr				slots[];
+};
+
+struct bstr_intern_shard {
+	pthread_mutex_t			lock;
+	struct bstr_intern_table *	table;
+	size_t				count;
+	size_t				bytes;          /* String blocks */
+	size_t				table_bytes;    /* Current and retired tables */
+};
+
+struct bstr_intern {
+	const struct bstr_allocator *	ator;
+	struct bstr_intern_shard	shards[BSTR_INTERN_SHARDS];
+};
+
+struct bstr_intern_stats {
+	size_t	strings;        /* Distinct strings held */
+	size_t	string_bytes;   /* Memory held by the strings themselves */
+	size_t	table_bytes;    /* The pool itself and its tables, retired ones included */
+};
+#endif /* BSTR_HAVE_INTERN */
+
+/* Bump allocator whose strings are released together by bstr_arena_reset. */
+struct bstr_arena_chunk {
+	struct bstr_arena_chunk *	next;
+	size_t				size;
+	size_t				used;
+};
+
+struct bstr_arena {
+	struct bstr_allocator		allocator;      /* Pass &arena->allocator to the _with functions */
+	struct bstr_arena_chunk *	head;
+	size_t				chunk_size;
+	unsigned char *			last;   /* Most recent allocation, for in-place growth */
+};
+
+/*
+ * Thread-local free-list pool. Blocks of up to 2^BSTR_POOL_MAX_SHIFT bytes
+ * are rounded up to a power-of-two size class and recycled; each thread
+ * keeps at most BSTR_POOL_DEPTH idle blocks per class.
+ */
+#ifndef BSTR_POOL_MAX_SHIFT
+#define BSTR_POOL_MAX_SHIFT 16
+#endif
+#ifndef BSTR_POOL_DEPTH
+#define BSTR_POOL_DEPTH 64
+#endif
+#define BSTR__POOL_MIN_SHIFT 4
+#define BSTR__POOL_CLASSES (BSTR_POOL_MAX_SHIFT - BSTR__POOL_MIN_SHIFT + 1)
+
+struct bstr_pool_stats {
+	unsigned long long	hits;           /* Allocations served from a free list */
+	unsigned long long	misses;         /* Allocations that went to malloc */
+	unsigned long long	recycled;       /* Blocks returned to a free list */
+	unsigned long long	released;       /* Blocks handed back to free */
+	size_t			cached_bytes;   /* Bytes currently sitting in free lists */
+};
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+#define BSTR_TLS _Thread_local
+#elif defined(__GNUC__)
+#define BSTR_TLS __thread
+#elif defined(_MSC_VER)
+#define BSTR_TLS __declspec(thread)
+#endif
+
 struct gen_bstr_list {
 	struct bstr_list *	bl;     // Pointer to the list of bstrings
 	bstr			b;      // The original bstring being split
 };
 
+/*
+ * A needle preprocessed for repeated Two-Way searches: the critical
+ * factorisation, the period and a last-occurrence shift table.
+ */
+struct bstr_pattern {
+	bstr		needle;         /* Private copy of the needle */
+	bstr_len_t	ms;             /* Last index of the left half of the factorisation */
+	bstr_len_t	p;              /* Period used to shift after a full match of the right half */
+	bstr_len_t	mem0;           /* Prefix known to match after a period shift (0 if aperiodic) */
+	size_t		byteset[32 / sizeof(size_t)];   /* Bytes present in the needle */
+	bstr_len_t	shift[256];     /* 1 + last index of each byte in the needle */
+	const struct bstr_allocator *	ator;   /* Allocator owning this block */
+};
+
+/*
+ * A compiled set of bytes. bits is the exact 256-bit membership set. When
+ * the set's low nibbles fall into at most eight distinct groups, lo and hi
+ * also encode it as nibble tables for a pshufb classifier: c is a member
+ * iff lo[c & 15] & hi[c >> 4] is non-zero.
+ */
+struct bstr_charset {
+	unsigned char	bits[32];
+	unsigned char	lo[16];
+	unsigned char	hi[16];
+	int		nibble;         /* lo/hi are usable */
+};
+
+#define bstr_charset_has(cs, c) \
+	(((cs)->bits[(unsigned char)(c) >> 3] >> ((unsigned char)(c) & 7)) & 1)
+
+/*
+ * Aho-Corasick automaton over a list of needles. Bytes that occur in no
+ * needle share class 0, so each state's row only has nclasses entries.
+ * Rows hold the offset of the next state's row, bitwise inverted when that
+ * state ends at least one needle.
+ */
+struct bstr_ac {
+	int		qty;            /* Number of needles */
+	int		nstates;
+	int		nclasses;
+	unsigned char	cls[256];       /* Byte to class */
+	int *		delta;          /* nstates * nclasses transitions */
+	int *		term;           /* First needle ending at a state, or -1 */
+	int *		dict;           /* Nearest suffix state ending a needle, or -1 */
+	int *		dup;            /* Next needle with identical bytes, or -1 */
+	int *		nlen;           /* Needle lengths */
+	size_t		delta_size;     /* Bytes allocated for delta */
+	size_t		term_size;      /* Bytes allocated for term and dict */
+	const struct bstr_allocator *	ator;
+};
+
 
 #define bdataofse(b, o, e) \
 	(((b) == (void *)0 || (b)->data == (void *)0) \
@@ -103,122 +444,461 @@ static inline const char *bstr_data(const bstr s)
 
 
 /* Function prototypes */
-static inline int snap_up_size(int i);
-static inline void block_copy(void *dst, const void *src, int len);
+static inline bstr_len_t snap_up_size(bstr_len_t i);
+static inline void block_copy(void *dst, const void *src, bstr_len_t len);
+static inline const struct bstr_allocator *bstr_set_allocator(const struct bstr_allocator *a);
+static inline const struct bstr_allocator *bstr_get_allocator(void);
 static inline bstr bstr_copy(const bstr b);
-static inline bstr blk_to_bstr(const void *blk, int len);
+static inline bstr bstr_copy_with(const struct bstr_allocator *a, const bstr b);
+static inline bstr bstr_share(bstr b);
+static inline bstr blk_to_bstr(const void *blk, bstr_len_t len);
+static inline bstr blk_to_bstr_with(const struct bstr_allocator *a, const void *blk, bstr_len_t len);
 static inline bstr bstr_from_cstr(const char *str);
+static inline bstr bstr_from_cstr_with(const struct bstr_allocator *a, const char *str);
+#ifdef BSTR_HAVE_MMAP
+static inline bstr bstr_map_file(const char *path);
+#endif
 static inline int bstr_destroy(bstr b);
-static inline int bstr_alloc(bstr b, int olen);
+static inline int bstr_alloc(bstr b, bstr_len_t olen);
+static inline int bstr_touch(bstr b);
 static inline int bstr_assign(bstr a, const bstr b);
 static inline void bstr_append(bstr dest, const char *src);
 static inline int bstr_append_char(bstr str, unsigned char c);
 static inline int bstr_concat(bstr b0, const bstr b1);
-static inline int bstr_insert(bstr b1, int pos, const bstr b2, unsigned char fill);
-static inline bstr bstr_mid(const bstr b, int left, int len);
-static inline int bstr_rchr(const bstr b, int c, int pos);
+static inline int bstr_insert(bstr b1, bstr_len_t pos, const bstr b2, unsigned char fill);
+static inline bstr bstr_mid(const bstr b, bstr_len_t left, bstr_len_t len);
+static inline bstr_len_t bstr_rchr(const bstr b, int c, bstr_len_t pos);
 static inline int bstr_cmp(const bstr b0, const bstr b1);
-static inline int bstr_find(const bstr b1, int pos, const bstr b2);
-static inline int bstr_trunc(bstr b, int n);
+static inline int bstr_eq(const bstr b0, const bstr b1);
+static inline uint64_t bstr_hash_blk(const void *blk, bstr_len_t len, uint64_t seed);
+static inline uint64_t bstr_hash_seeded(const bstr b, uint64_t seed);
+static inline uint64_t bstr_hash(const bstr b);
+static inline bstr_len_t bstr_find(const bstr b1, bstr_len_t pos, const bstr b2);
+static inline struct bstr_pattern *bstr_pattern_compile(const bstr needle);
+static inline int bstr_pattern_destroy(struct bstr_pattern *pat);
+static inline bstr_len_t bstr_pattern_find(const struct bstr_pattern *pat, const bstr haystack, bstr_len_t pos);
+static inline bstr_len_t bstr_pattern_find_all(const struct bstr_pattern *pat, const bstr haystack, bstr_len_t pos, int (*callback)(void *parm, bstr_len_t ofs, bstr_len_t len), void *parm);
+static inline bstr_len_t bstr_pattern_count(const struct bstr_pattern *pat, const bstr haystack, bstr_len_t pos);
+static inline int bstr_pattern_split_cb(const bstr str, const struct bstr_pattern *pat, bstr_len_t pos, int (*callback)(void *parm, bstr_len_t ofs, bstr_len_t len), void *parm);
+static inline struct bstr_ac *bstr_ac_compile(const struct bstr_list *needles);
+static inline int bstr_ac_destroy(struct bstr_ac *ac);
+static inline bstr_len_t bstr_ac_search(const struct bstr_ac *ac, const bstr haystack, bstr_len_t pos, int (*callback)(void *parm, int idx, bstr_len_t ofs), void *parm);
+static inline int bstr_simd_level(void);
+static inline int bstr_set_simd_level(int level);
+static inline int bstr_trunc(bstr b, bstr_len_t n);
 static inline int bstr_icmp(const bstr b0, const bstr b1);
+static inline int bstr_incmp(const bstr b0, const bstr b1, bstr_len_t n);
 static inline int bstr_tolower(bstr b);
-static inline int bstr_assign_mid(bstr dest, const bstr src, int start, int len);
+static inline int bstr_toupper(bstr b);
+static inline int bstr_assign_mid(bstr dest, const bstr src, bstr_len_t start, bstr_len_t len);
 static inline int bstr_format(bstr b, const char *fmt, ...);
 static inline int bstr_vformat(bstr b, const char *fmt, va_list args);
-static inline int bstr_ncmp(const bstr b0, const bstr b1, int n);
-static inline int bstr_spn(const bstr b, const bstr accept);
-static inline int bstr_cspn(const bstr b, const bstr reject);
+static inline int bstr_appendf(bstr b, const char *fmt, ...);
+static inline int bstr_vappendf(bstr b, const char *fmt, va_list args);
+static inline int bstr_append_u64(bstr b, uint64_t v);
+static inline int bstr_append_i64(bstr b, int64_t v);
+static inline int bstr_append_hex(bstr b, uint64_t v);
+static inline int bstr_append_double(bstr b, double v);
+static inline int bstr_append_fixed(bstr b, double v, int prec);
+static inline int bstr_ncmp(const bstr b0, const bstr b1, bstr_len_t n);
+static inline bstr_len_t bstr_spn(const bstr b, const bstr accept);
+static inline bstr_len_t bstr_cspn(const bstr b, const bstr reject);
+static inline int bstr_charset_init(struct bstr_charset *cs, const bstr set);
+static inline int bstr_charset_init_blk(struct bstr_charset *cs, const void *blk, bstr_len_t len);
+static inline bstr_len_t bstr_charset_spn(const struct bstr_charset *cs, const bstr b, bstr_len_t pos);
+static inline bstr_len_t bstr_charset_cspn(const struct bstr_charset *cs, const bstr b, bstr_len_t pos);
 static inline int bstr_list_alloc_min(struct bstr_list *list, int msz);
 static inline int bstr_list_alloc(struct bstr_list *list, int msz);
-static inline int bstr_list_callback(void *parm, int ofs, int len);
+static inline int bstr_list_callback(void *parm, bstr_len_t ofs, bstr_len_t len);
 static inline struct bstr_list *bstr_list_create(void);
+static inline struct bstr_list *bstr_list_create_with(const struct bstr_allocator *a);
 static inline int bstr_list_destroy(struct bstr_list *list);
-static inline int bstr_split_cb(const bstr str, unsigned char split_char, int pos, int (*callback)(void *parm, int ofs, int len), void *parm);
+static inline int bstr_split_cb(const bstr str, unsigned char split_char, bstr_len_t pos, int (*callback)(void *parm, bstr_len_t ofs, bstr_len_t len), void *parm);
+static inline bstr_len_t bstr_split_offsets(const bstr str, unsigned char split_char, bstr_len_t pos, bstr_len_t *ofs, int max);
 static inline struct bstr_list *bstr_split(const bstr str, unsigned char split_char);
-static inline int bstr_splits_cb(const bstr str, const bstr split_str, int pos, int (*callback)(void *parm, int ofs, int len), void *parm);
+static inline int bstr_splits_cb(const bstr str, const bstr split_str, bstr_len_t pos, int (*callback)(void *parm, bstr_len_t ofs, bstr_len_t len), void *parm);
+static inline int bstr_charset_split_cb(const bstr str, const struct bstr_charset *cs, bstr_len_t pos, int (*callback)(void *parm, bstr_len_t ofs, bstr_len_t len), void *parm);
 static inline struct bstr_list *bstr_splits(const bstr str, const bstr split_str);
-static inline int bstr_split_str_cb(const bstr str, const bstr split_str, int pos, int (*callback)(void *parm, int ofs, int len), void *parm);
+static inline int bstr_split_str_cb(const bstr str, const bstr split_str, bstr_len_t pos, int (*callback)(void *parm, bstr_len_t ofs, bstr_len_t len), void *parm);
 static inline struct bstr_list *bstr_split_str(const bstr str, const bstr split_str);
 static inline bstr bstr_join(const struct bstr_list *list, const bstr sep);
+static inline int bstr_join_into(bstr dest, const struct bstr_list *list, const bstr sep);
+#ifdef BSTR_HAVE_WRITEV
+static inline int bstr_list_writev(int fd, const struct bstr_list *list, const bstr sep);
+#endif
+static inline bstr_view bstr_view_of(const bstr b);
+static inline bstr_view bstr_view_mid(const bstr b, bstr_len_t left, bstr_len_t len);
+static inline bstr_view bstr_view_blk(const void *blk, bstr_len_t len);
+static inline bstr bstr_from_view(bstr_view v);
+static inline int bstr_view_cmp(bstr_view v0, bstr_view v1);
+static inline bstr_len_t bstr_view_find(bstr_view v1, bstr_len_t pos, bstr_view v2);
+static inline bstr_len_t bstr_view_spn(bstr_view v, bstr_view accept);
+static inline bstr_len_t bstr_view_cspn(bstr_view v, bstr_view reject);
+static inline int bstr_view_to_long(bstr_view v, long *out);
+static inline int bstr_view_to_double(bstr_view v, double *out);
+static inline struct bstr_view_list *bstr_split_view(const bstr str, unsigned char split_char);
+static inline int bstr_view_list_destroy(struct bstr_view_list *list);
+static inline struct bstr_map *bstr_map_create(void);
+static inline struct bstr_map *bstr_map_create_with(const struct bstr_allocator *a);
+static inline int bstr_map_destroy(struct bstr_map *m);
+static inline int bstr_map_put(struct bstr_map *m, const bstr key, void *value);
+static inline int bstr_map_put_blk(struct bstr_map *m, const void *blk, bstr_len_t len, void *value);
+static inline int bstr_map_put_view(struct bstr_map *m, bstr_view key, void *value);
+static inline void **bstr_map_get(const struct bstr_map *m, const bstr key);
+static inline void **bstr_map_get_blk(const struct bstr_map *m, const void *blk, bstr_len_t len);
+static inline void **bstr_map_get_view(const struct bstr_map *m, bstr_view key);
+static inline int bstr_map_remove(struct bstr_map *m, const bstr key);
+static inline int bstr_map_remove_blk(struct bstr_map *m, const void *blk, bstr_len_t len);
+static inline int bstr_map_remove_view(struct bstr_map *m, bstr_view key);
+static inline int bstr_map_foreach(const struct bstr_map *m, int (*callback)(void *parm, const bstr key, void *value), void *parm);
+static inline struct bstr_set *bstr_set_create(void);
+static inline struct bstr_set *bstr_set_create_with(const struct bstr_allocator *a);
+static inline int bstr_set_destroy(struct bstr_set *s);
+static inline int bstr_set_add(struct bstr_set *s, const bstr key);
+static inline int bstr_set_has(const struct bstr_set *s, const bstr key);
+static inline int bstr_set_has_blk(const struct bstr_set *s, const void *blk, bstr_len_t len);
+static inline int bstr_set_remove(struct bstr_set *s, const bstr key);
+#ifdef BSTR_HAVE_INTERN
+static inline struct bstr_intern *bstr_intern_create(void);
+static inline int bstr_intern_destroy(struct bstr_intern *in);
+static inline bstr bstr_intern_blk(struct bstr_intern *in, const void *blk, bstr_len_t len);
+static inline bstr bstr_intern_cstr(struct bstr_intern *in, const char *str);
+static inline bstr bstr_intern(struct bstr_intern *in, const bstr b);
+static inline void bstr_intern_stats(struct bstr_intern *in, struct bstr_intern_stats *stats);
+#endif
+static inline struct bstr_rope *bstr_rope_create(void);
+static inline int bstr_rope_destroy(struct bstr_rope *r);
+static inline bstr_len_t bstr_rope_len(const struct bstr_rope *r);
+static inline int bstr_rope_append_blk(struct bstr_rope *r, const void *blk, bstr_len_t len);
+static inline int bstr_rope_append(struct bstr_rope *r, const bstr b);
+static inline int bstr_rope_prepend_blk(struct bstr_rope *r, const void *blk, bstr_len_t len);
+static inline int bstr_rope_prepend(struct bstr_rope *r, const bstr b);
+static inline int bstr_rope_insert_blk(struct bstr_rope *r, bstr_len_t pos, const void *blk, bstr_len_t len);
+static inline int bstr_rope_insert(struct bstr_rope *r, bstr_len_t pos, const bstr b);
+static inline int bstr_rope_chunks(const struct bstr_rope *r, int (*callback)(void *parm, const void *blk, bstr_len_t len), void *parm);
+static inline bstr bstr_rope_flatten(struct bstr_rope *r);
+#ifdef BSTR_HAVE_WRITEV
+static inline int bstr_rope_write(int fd, const struct bstr_rope *r);
+#endif
+static inline struct bstr_gap *bstr_gap_create(const bstr b);
+static inline int bstr_gap_destroy(struct bstr_gap *g);
+static inline bstr_len_t bstr_gap_len(const struct bstr_gap *g);
+static inline int bstr_gap_insert_blk(struct bstr_gap *g, bstr_len_t pos, const void *blk, bstr_len_t len);
+static inline int bstr_gap_insert(struct bstr_gap *g, bstr_len_t pos, const bstr b);
+static inline int bstr_gap_delete(struct bstr_gap *g, bstr_len_t pos, bstr_len_t len);
+static inline bstr bstr_gap_str(struct bstr_gap *g);
+static inline bstr bstr_gap_release(struct bstr_gap *g);
+static inline struct bstr_packed_list *bstr_packed_split(const bstr str, unsigned char split_char);
+static inline struct bstr_packed_list *bstr_packed_from_list(const struct bstr_list *list);
+static inline struct bstr_list *bstr_packed_to_list(const struct bstr_packed_list *pl);
+static inline bstr_view bstr_packed_view(const struct bstr_packed_list *pl, int i);
+static inline int bstr_packed_destroy(struct bstr_packed_list *pl);
+static inline void bstr_arena_init(struct bstr_arena *arena, size_t chunk_size);
+static inline void bstr_arena_reset(struct bstr_arena *arena);
+static inline void bstr_arena_destroy(struct bstr_arena *arena);
+static inline void bstr_pool_stats(struct bstr_pool_stats *stats);
+static inline void bstr_pool_trim(void);
 
 /* Helper macros */
 #define downcase(c) (tolower((unsigned char)(c)))
+#define upcase(c) (toupper((unsigned char)(c)))
 #define bstr_chr(b, c) bstr_rchr((b), (c), 0)
 #define bstr_len(b) ((b) ? (b)->slen : -1)
+#define bstr__is_inline(b) ((b)->data == (b)->ibuf)
+
+#define BSTR__F_HASHED 0x1      /* hash is valid */
+#define BSTR__F_RDONLY 0x2      /* Shared, must not change or be destroyed */
+#define BSTR__F_SHARED 0x4      /* data is in a refcounted bstr__shared block */
+#define BSTR__F_MAPPED 0x8      /* data is a file mapping, see bstr_map_file() */
+
+/*
+ * Buffer behind strings made by bstr_share(). Every string pointing into
+ * it holds one reference and has mlen == cap. The last reference frees
+ * it; a string holding the only reference may write it in place.
+ */
+struct bstr__shared {
+	int				refs;
+	bstr_len_t			cap;
+	const struct bstr_allocator *	ator;
+	unsigned char			data[];
+};
+
+#define bstr__shared_of(b) ((struct bstr__shared *)(void *)((b)->data - offsetof(struct bstr__shared, data)))
+
+#ifdef BSTR_HAVE_SHARE
+#define bstr__refs_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define bstr__refs_inc(p) __atomic_fetch_add((p), 1, __ATOMIC_RELAXED)
+#define bstr__refs_dec(p) __atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+#else
+/* bstr_share() deep-copies here, so no string is ever marked shared */
+#define bstr__refs_load(p) (*(p))
+#define bstr__refs_inc(p) ((*(p))++)
+#define bstr__refs_dec(p) (--*(p))
+#endif
+
+static inline int bstr__unshare(bstr b, bstr_len_t len);
+
+/*
+ * Called by every function that changes the contents of b before it
+ * writes anything, to drop state derived from the old contents. Fails
+ * for read-only strings, and gives a string sharing its buffer with
+ * others a private copy. bstr_touch() is the public form for code that
+ * writes data or slen directly.
+ */
+static inline int bstr__mutate(bstr b)
+{
+	if (b->flags & BSTR__F_RDONLY)
+		return BSTR_ERR;
+	if ((b->flags & BSTR__F_SHARED) && bstr__refs_load(&bstr__shared_of(b)->refs) > 1 &&
+	    bstr__unshare(b, b->mlen) != BSTR_OK)
+		return BSTR_ERR;
+	b->flags &= ~BSTR__F_HASHED;
+	return BSTR_OK;
+}
+
+/*
+ * Call before writing b->data or b->slen directly. Forgets the hash
+ * bstr_hash() remembered for the old contents and, if b shares its
+ * buffer with copies made by bstr_share(), gives b a private one so the
+ * copies keep their contents. Fails for read-only strings.
+ */
+static inline int bstr_touch(bstr b)
+{
+	if (!b || !b->data || b->slen < 0)
+		return BSTR_ERR;
+	return bstr__mutate(b);
+}
 
 /* Compute the snapped size for a given requested size. */
-static inline int snap_up_size(int i)
+static inline bstr_len_t snap_up_size(bstr_len_t i)
 {
 	if (i < 8) {
 		i = 8;
 	} else {
-		unsigned int j = (unsigned int)i;
+		uint64_t j = (uint64_t)i;
 		j |= (j >> 1);
 		j |= (j >> 2);
 		j |= (j >> 4);
 		j |= (j >> 8);
-#if (UINT_MAX != 0xffff)
 		j |= (j >> 16);
-#if (UINT_MAX > 0xffffffffUL)
 		j |= (j >> 32);
-#endif
-#endif
 		j++;
-		if ((int)j >= i)
-			i = (int)j;
+		if (j <= (uint64_t)BSTR_LEN_MAX)
+			i = (bstr_len_t)j;
 	}
 	return i;
 }
 
 /* Just a length-safe wrapper for memmove. */
-static inline void block_copy(void *dst, const void *src, int len)
+static inline void block_copy(void *dst, const void *src, bstr_len_t len)
 {
 	if (len > 0)
 		memmove(dst, src, len);
 }
 
+static void *bstr__libc_alloc(void *ctx, size_t size)
+{
+	(void)ctx;
+	return malloc(size);
+}
+
+static void *bstr__libc_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size)
+{
+	(void)ctx;
+	(void)old_size;
+	return realloc(ptr, new_size);
+}
+
+static void bstr__libc_free(void *ctx, void *ptr, size_t size)
+{
+	(void)ctx;
+	(void)size;
+	free(ptr);
+}
+
+static const struct bstr_allocator bstr_libc_allocator = {
+	bstr__libc_alloc, bstr__libc_realloc, bstr__libc_free, NULL
+};
+
+/*
+ * Allocator used by every function that creates a bstr or list without
+ * taking one explicitly. Like the rest of this header it is per
+ * translation unit.
+ */
+static const struct bstr_allocator *bstr__default_allocator = &bstr_libc_allocator;
+
+/* Install a default allocator (NULL restores malloc) and return the old one. */
+static inline const struct bstr_allocator *bstr_set_allocator(const struct bstr_allocator *a)
+{
+	const struct bstr_allocator *old = bstr__default_allocator;
+
+	bstr__default_allocator = a ? a : &bstr_libc_allocator;
+	return old;
+}
+
+static inline const struct bstr_allocator *bstr_get_allocator(void)
+{
+	return bstr__default_allocator;
+}
+
+#define bstr__malloc(a, n) ((a)->alloc((a)->ctx, (n)))
+#define bstr__realloc(a, p, o, n) ((a)->realloc((a)->ctx, (p), (o), (n)))
+#define bstr__free(a, p, n) ((a)->free((a)->ctx, (p), (n)))
+
+/*
+ * Allocate a header with room for at least len bytes of data. The header
+ * and buffer share a single block whose total size is snapped up, and the
+ * inline capacity is whatever remains after the header. If the snapped
+ * block cannot be had, fall back to the exact size.
+ */
+static inline bstr bstr__new(const struct bstr_allocator *a, bstr_len_t len)
+{
+	if (len < BSTR_SSO_SIZE)
+		len = BSTR_SSO_SIZE;
+	if (len > BSTR_LEN_MAX - (bstr_len_t)BSTR__HDR_SIZE) return NULL;
+
+	bstr_len_t need = (bstr_len_t)BSTR__HDR_SIZE + len;
+	bstr_len_t i = snap_up_size(need);
+	bstr b = bstr__malloc(a, i);
+	if (!b) {
+		i = need;
+		b = bstr__malloc(a, i);
+		if (!b) return NULL;
+	}
+
+	b->data = b->ibuf;
+	b->ator = a;
+	b->icap = i - (bstr_len_t)BSTR__HDR_SIZE;
+	b->mlen = b->icap;
+	b->slen = 0;
+	b->flags = 0;
+	return b;
+}
+
 static inline bstr bstr_copy(const bstr b)
 {
-	if (!b || b->slen < 0 || !b->data) return NULL;
+	return bstr_copy_with(bstr__default_allocator, b);
+}
 
-	bstr b0 = malloc(sizeof(struct tagbstr));
-	if (!b0) return NULL;
+/* Drop b's reference to its shared buffer, freeing it if it was the last. */
+static inline void bstr__shared_release(bstr b)
+{
+	struct bstr__shared *s = bstr__shared_of(b);
 
-	int i = b->slen;
-	int j = snap_up_size(i + 1);
-	b0->data = malloc(j);
-	if (!b0->data) {
-		j = i + 1;
-		b0->data = malloc(j);
-		if (!b0->data) {
-			free(b0);
-			return NULL;
+	if (bstr__refs_dec(&s->refs) == 0)
+		bstr__free(s->ator, s, offsetof(struct bstr__shared, data) + (size_t)s->cap);
+}
+
+/* Move a shared string into a private buffer of at least len bytes. */
+static inline int bstr__unshare(bstr b, bstr_len_t len)
+{
+	unsigned char *x;
+	bstr_len_t mlen;
+
+	if (len <= b->slen)
+		len = b->slen + 1;
+	if (len <= b->icap) {
+		x = b->ibuf;
+		mlen = b->icap;
+	} else {
+		mlen = snap_up_size(len);
+		x = bstr__malloc(b->ator, mlen);
+		if (!x) {
+			mlen = len;
+			x = bstr__malloc(b->ator, mlen);
+			if (!x) return BSTR_ERR;
 		}
 	}
 
-	b0->mlen = j;
+	memcpy(x, b->data, b->slen);
+	x[b->slen] = '\0';
+	bstr__shared_release(b);
+	b->data = x;
+	b->mlen = mlen;
+	b->flags &= ~BSTR__F_SHARED;
+	return BSTR_OK;
+}
+
+/* A new header, allocated from a, on b's shared buffer. */
+static inline bstr bstr__share_header(const struct bstr_allocator *a, const bstr b)
+{
+	bstr h = bstr__new(a, 0);
+	if (!h) return NULL;
+
+	bstr__refs_inc(&bstr__shared_of(b)->refs);
+	h->data = b->data;
+	h->mlen = b->mlen;
+	h->slen = b->slen;
+	h->hash = b->hash;
+	h->flags = BSTR__F_SHARED | (b->flags & BSTR__F_HASHED);
+	return h;
+}
+
+/*
+ * A copy of b that shares its buffer instead of duplicating it. The
+ * first call moves b into a refcounted buffer; from then on this and
+ * bstr_copy() of b or of any of its copies are O(1). Whichever string
+ * is changed first gets a private buffer, so the others never see the
+ * change; direct writes to data must be preceded by bstr_touch() for
+ * this to hold. Copies may be used and destroyed from different threads.
+ */
+static inline bstr bstr_share(bstr b)
+{
+	if (!b || b->slen < 0 || !b->data || b->mlen < b->slen) return NULL;
+
+#ifdef BSTR_HAVE_SHARE
+	if (!(b->flags & (BSTR__F_SHARED | BSTR__F_RDONLY))) {
+		size_t hdr = offsetof(struct bstr__shared, data);
+		struct bstr__shared *s = bstr__malloc(b->ator, hdr + (size_t)b->slen + 1);
+		if (!s) return NULL;
+
+		s->refs = 1;
+		s->cap = b->slen + 1;
+		s->ator = b->ator;
+		memcpy(s->data, b->data, b->slen);
+		s->data[b->slen] = '\0';
+		if (!bstr__is_inline(b))
+			bstr__free(b->ator, b->data, b->mlen);
+		b->data = s->data;
+		b->mlen = s->cap;
+		b->flags |= BSTR__F_SHARED;
+	}
+	if (b->flags & BSTR__F_SHARED)
+		return bstr__share_header(b->ator, b);
+#endif
+	return bstr_copy_with(b->ator, b);
+}
+
+static inline bstr bstr_copy_with(const struct bstr_allocator *a, const bstr b)
+{
+	if (!a || !b || b->slen < 0 || !b->data) return NULL;
+	if (b->flags & BSTR__F_SHARED) return bstr__share_header(a, b);
+
+	bstr_len_t i = b->slen;
+	bstr b0 = bstr__new(a, i + 1);
+	if (!b0) return NULL;
+
 	b0->slen = i;
 	if (i) memcpy(b0->data, b->data, i);
 	b0->data[b0->slen] = '\0';
+	b0->hash = b->hash;
+	b0->flags = b->flags & BSTR__F_HASHED;
 	return b0;
 }
 
-static inline bstr blk_to_bstr(const void *blk, int len)
+static inline bstr blk_to_bstr(const void *blk, bstr_len_t len)
+{
+	return blk_to_bstr_with(bstr__default_allocator, blk, len);
+}
+
+static inline bstr blk_to_bstr_with(const struct bstr_allocator *a, const void *blk, bstr_len_t len)
 {
-	if (!blk || len < 0) return NULL;
+	if (!a || !blk || len < 0) return NULL;
 
-	bstr b = malloc(sizeof(struct tagbstr));
+	bstr b = bstr__new(a, len + (2 - (len != 0)));
 	if (!b) return NULL;
 
 	b->slen = len;
-	int i = len + (2 - (len != 0));
-	i = snap_up_size(i);
-	b->mlen = i;
-	b->data = malloc(b->mlen);
-	if (!b->data) {
-		free(b);
-		return NULL;
-	}
 	if (len > 0) memcpy(b->data, blk, len);
 	b->data[len] = '\0';
 	return b;
@@ -226,64 +906,179 @@ static inline bstr blk_to_bstr(const void *blk, int len)
 
 static inline bstr bstr_from_cstr(const char *str)
 {
-	if (!str) return NULL;
+	return bstr_from_cstr_with(bstr__default_allocator, str);
+}
+
+static inline bstr bstr_from_cstr_with(const struct bstr_allocator *a, const char *str)
+{
+	if (!a || !str) return NULL;
 
 	size_t j = strlen(str);
-	int i = snap_up_size((int)(j + (2 - (j != 0))));
-	if (i <= (int)j) return NULL;
+	if (j > (size_t)BSTR_LEN_MAX - 2) return NULL;
 
-	bstr b = malloc(sizeof(struct tagbstr));
+	bstr b = bstr__new(a, (bstr_len_t)(j + (2 - (j != 0))));
 	if (!b) return NULL;
 
-	b->slen = (int)j;
-	b->mlen = i;
-	b->data = malloc(b->mlen);
-	if (!b->data) {
-		free(b);
+	b->slen = (bstr_len_t)j;
+	memcpy(b->data, str, j + 1);
+	return b;
+}
+
+#ifdef BSTR_HAVE_MMAP
+#if defined(MAP_ANONYMOUS)
+#define BSTR__MAP_ANON MAP_ANONYMOUS
+#elif defined(MAP_ANON)
+#define BSTR__MAP_ANON MAP_ANON
+#endif
+
+/* n bytes of read-only zero pages. */
+static inline void *bstr__map_zero(size_t n)
+{
+#ifdef BSTR__MAP_ANON
+	return mmap(NULL, n, PROT_READ, MAP_PRIVATE | BSTR__MAP_ANON, -1, 0);
+#else
+	/* Strict ISO builds on glibc hide MAP_ANONYMOUS */
+	int fd = open("/dev/zero", O_RDONLY);
+	if (fd < 0) return MAP_FAILED;
+	void *p = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	return p;
+#endif
+}
+
+/*
+ * A read-only string over the contents of the regular file at path,
+ * mapped rather than read so no byte is copied up front. The mapping is
+ * followed by at least one zero byte, so data is NUL-terminated like any
+ * other bstr. Every function that does not change its argument works on
+ * it; the others fail, and bstr_copy() gives a private, mutable copy.
+ * bstr_destroy() unmaps it. Truncating the file while it is mapped
+ * makes reads past the new end fault with SIGBUS. Where
+ * BSTR_HAVE_MADVISE is defined, the mapping is also advised to be read
+ * sequentially, read ahead, and backed by huge pages if possible.
+ */
+static inline bstr bstr_map_file(const char *path)
+{
+	if (!path) return NULL;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 0 ||
+	    (uint64_t)st.st_size > (uint64_t)BSTR_LEN_MAX - 1) {
+		close(fd);
 		return NULL;
 	}
-	memcpy(b->data, str, j + 1);
+
+	/*
+	 * Reserve the file size plus a byte of zero pages, then map the file
+	 * over the front. The tail of the last file page is zero-filled by
+	 * the kernel, and a file that ends on a page boundary still has the
+	 * reserved zero page after it.
+	 */
+	bstr_len_t len = (bstr_len_t)st.st_size;
+	unsigned char *p = bstr__map_zero((size_t)len + 1);
+	if (p == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	if (len > 0 && mmap(p, (size_t)len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(p, (size_t)len + 1);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	/* Advisory only, failures are ignored */
+#ifdef BSTR_HAVE_MADVISE
+#ifdef MADV_SEQUENTIAL
+	madvise(p, (size_t)len, MADV_SEQUENTIAL);
+	madvise(p, (size_t)len, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+	madvise(p, (size_t)len, MADV_HUGEPAGE);
+#endif
+#else
+	posix_madvise(p, (size_t)len, POSIX_MADV_SEQUENTIAL);
+	posix_madvise(p, (size_t)len, POSIX_MADV_WILLNEED);
+#endif
+#endif /* BSTR_HAVE_MADVISE */
+
+	bstr b = bstr__new(bstr__default_allocator, 0);
+	if (!b) {
+		munmap(p, (size_t)len + 1);
+		return NULL;
+	}
+	b->data = p;
+	b->mlen = len + 1;
+	b->slen = len;
+	b->flags = BSTR__F_RDONLY | BSTR__F_MAPPED;
 	return b;
 }
+#endif /* BSTR_HAVE_MMAP */
 
 static inline int bstr_destroy(bstr b)
 {
-	if (!b || b->slen < 0 || b->mlen <= 0 || b->mlen < b->slen || !b->data)
+	if (!b || b->slen < 0 || b->mlen <= 0 || b->mlen < b->slen || !b->data ||
+	    (b->flags & (BSTR__F_RDONLY | BSTR__F_MAPPED)) == BSTR__F_RDONLY)
 		return BSTR_ERR;
-	free(b->data);
+	if (b->flags & BSTR__F_SHARED)
+		bstr__shared_release(b);
+#ifdef BSTR_HAVE_MMAP
+	else if (b->flags & BSTR__F_MAPPED)
+		munmap(b->data, (size_t)b->mlen);
+#endif
+	else if (!bstr__is_inline(b))
+		bstr__free(b->ator, b->data, b->mlen);
 	b->slen = -1;
 	b->mlen = -__LINE__;
 	b->data = NULL;
-	free(b);
+	bstr__free(b->ator, b, BSTR__HDR_SIZE + b->icap);
 	return BSTR_OK;
 }
 
-static inline int bstr_alloc(bstr b, int olen)
+static inline int bstr_alloc(bstr b, bstr_len_t olen)
 {
 	if (!b || !b->data || b->slen < 0 || b->mlen <= 0 || b->mlen < b->slen || olen <= 0)
 		return BSTR_ERR;
 
+	if ((b->flags & BSTR__F_SHARED) &&
+	    (olen >= b->mlen || bstr__refs_load(&bstr__shared_of(b)->refs) > 1))
+		return (b->flags & BSTR__F_RDONLY) ? BSTR_ERR : bstr__unshare(b, olen);
 	if (olen < b->mlen) return BSTR_OK;
+	if (b->flags & BSTR__F_RDONLY) return BSTR_ERR;
 
-	int len = snap_up_size(olen);
+	bstr_len_t len = snap_up_size(olen);
 	if (len <= b->mlen) return BSTR_OK;
 
 	unsigned char *x;
 
-	if (7 * b->mlen < 8 * b->slen) {
+	if (bstr__is_inline(b)) {
+		/*
+		 * The header address is the caller's handle and cannot move,
+		 * so growing past the inline buffer spills to a heap block.
+		 */
+		x = bstr__malloc(b->ator, len);
+		if (!x) {
+			len = olen;
+			x = bstr__malloc(b->ator, len);
+			if (!x) return BSTR_ERR;
+		}
+		memcpy(x, b->data, b->slen);
+	} else if (7 * b->mlen < 8 * b->slen) {
 retry:
-		x = realloc(b->data, len);
+		x = bstr__realloc(b->ator, b->data, b->mlen, len);
 		if (!x) {
 			len = olen;
-			x = realloc(b->data, len);
+			x = bstr__realloc(b->ator, b->data, b->mlen, len);
 			if (!x) return BSTR_ERR;
 		}
 	} else {
-		x = malloc(len);
+		x = bstr__malloc(b->ator, len);
 		if (!x) goto retry;
 
 		if (b->slen) memcpy(x, b->data, b->slen);
-		free(b->data);
+		bstr__free(b->ator, b->data, b->mlen);
 	}
 
 	b->data = x;
@@ -296,6 +1091,7 @@ retry:
 static inline int bstr_assign(bstr a, const bstr b)
 {
 	if (!b || !b->data || b->slen < 0) return BSTR_ERR;
+	if (!a || bstr__mutate(a) != BSTR_OK) return BSTR_ERR;
 	if (b->slen != 0) {
 		if (bstr_alloc(a, b->slen) != BSTR_OK) return BSTR_ERR;
 		memmove(a->data, b->data, b->slen);
@@ -308,9 +1104,9 @@ static inline int bstr_assign(bstr a, const bstr b)
 }
 
 
-static int bstr_catblk(bstr b, const void *s, int len)
+static int bstr_catblk(bstr b, const void *s, bstr_len_t len)
 {
-	int nl;
+	bstr_len_t nl;
 
 	if (!b || !b->data ||
 	    b->slen < 0 || b->mlen < b->slen ||
@@ -319,6 +1115,8 @@ static int bstr_catblk(bstr b, const void *s, int len)
 	if (0 > (nl = b->slen + len))
 		/* Overflow? */
 		return BSTR_ERR;
+	if (bstr__mutate(b) != BSTR_OK)
+		return BSTR_ERR;
 	if (b->mlen <= nl && 0 > bstr_alloc(b, nl + 1))
 		return BSTR_ERR;
 	block_copy(&b->data[b->slen], s, len);
@@ -330,12 +1128,14 @@ static int bstr_catblk(bstr b, const void *s, int len)
 static inline int bstr_catcstr(bstr b, const char *s)
 {
 	char *d;
-	int i, l;
+	bstr_len_t i, l;
 
 	if (b == NULL || b->data == NULL ||
 	    b->slen < 0 || b->mlen < b->slen
 	    || b->mlen <= 0 || s == NULL)
 		return BSTR_ERR;
+	if (bstr__mutate(b) != BSTR_OK)
+		return BSTR_ERR;
 	/* Optimistically concatenate directly */
 	l = b->mlen - b->slen;
 	d = (char *)&b->data[b->slen];
@@ -354,12 +1154,13 @@ static inline int bstr_catcstr(bstr b, const char *s)
 
 static int bstr_conchar(bstr b, char c)
 {
-	int d;
+	bstr_len_t d;
 
 	if (!b)
 		return BSTR_ERR;
 	d = b->slen;
-	if ((d | (b->mlen - d)) < 0 || bstr_alloc(b, d + 2) != BSTR_OK)
+	if ((d | (b->mlen - d)) < 0 || bstr__mutate(b) != BSTR_OK ||
+	    bstr_alloc(b, d + 2) != BSTR_OK)
 		return BSTR_ERR;
 	b->data[d] = (unsigned char)c;
 	b->data[d + 1] = (unsigned char)'\0';
@@ -381,13 +1182,14 @@ static inline int bstr_concat(bstr b0, const bstr b1)
 {
 	if (!b0 || !b1 || !b0->data || !b1->data) return BSTR_ERR;
 
-	int d = b0->slen;
-	int len = b1->slen;
+	bstr_len_t d = b0->slen;
+	bstr_len_t len = b1->slen;
 	if ((d | (b0->mlen - d) | len | (d + len)) < 0) return BSTR_ERR;
+	if (bstr__mutate(b0) != BSTR_OK) return BSTR_ERR;
 
+	bstr aux = b1;
 	if (b0->mlen <= d + len + 1) {
 		ptrdiff_t pd = b1->data - b0->data;
-		bstr aux = b1;
 		if (0 <= pd && pd < b0->mlen) {
 			aux = bstr_copy(b1);
 			if (!aux) return BSTR_ERR;
@@ -397,9 +1199,10 @@ static inline int bstr_concat(bstr b0, const bstr b1)
 			return BSTR_ERR;
 		}
 	}
-	block_copy(&b0->data[d], &b1->data[0], len);
+	block_copy(&b0->data[d], &aux->data[0], len);
 	b0->data[d + len] = '\0';
 	b0->slen = d + len;
+	if (aux != b1) bstr_destroy(aux);
 	return BSTR_OK;
 }
 
@@ -409,9 +1212,10 @@ static inline int bstr_concat(bstr b0, const bstr b1)
 
 
 
-static inline int bstr_insert(bstr b1, int pos, const bstr b2, unsigned char fill)
+static inline int bstr_insert(bstr b1, bstr_len_t pos, const bstr b2, unsigned char fill)
 {
 	if (pos < 0 || !b1 || !b2 || b1->slen < 0 || b2->slen < 0 || b1->mlen < b1->slen || b1->mlen <= 0) return BSTR_ERR;
+	if (bstr__mutate(b1) != BSTR_OK) return BSTR_ERR;
 
 	ptrdiff_t pd = b2->data - b1->data;
 	bstr aux = b2;
@@ -420,8 +1224,8 @@ static inline int bstr_insert(bstr b1, int pos, const bstr b2, unsigned char fil
 		if (!aux) return BSTR_ERR;
 	}
 
-	int d = b1->slen + aux->slen;
-	int l = pos + aux->slen;
+	bstr_len_t d = b1->slen + aux->slen;
+	bstr_len_t l = pos + aux->slen;
 	if ((d | l) < 0) {
 		if (aux != b2) bstr_destroy(aux);
 		return BSTR_ERR;
@@ -449,7 +1253,7 @@ static inline int bstr_insert(bstr b1, int pos, const bstr b2, unsigned char fil
 	return BSTR_OK;
 }
 
-static inline bstr bstr_mid(const bstr b, int left, int len)
+static inline bstr bstr_mid(const bstr b, bstr_len_t left, bstr_len_t len)
 {
 	if (!b || b->slen < 0 || !b->data) return NULL;
 
@@ -463,89 +1267,807 @@ static inline bstr bstr_mid(const bstr b, int left, int len)
 	return blk_to_bstr(b->data + left, len);
 }
 
-static inline int bstr_rchr(const bstr b, int c, int pos)
+static inline bstr_len_t bstr_rchr(const bstr b, int c, bstr_len_t pos)
 {
 	if (!b || !b->data || b->slen <= pos || pos < 0) return BSTR_ERR;
 
-	for (int i = pos; i >= 0; i--)
+	for (bstr_len_t i = pos; i >= 0; i--)
 		if (b->data[i] == (unsigned char)c) return i;
 	return BSTR_ERR;
 }
 
-static inline int bstr_cmp(const bstr b0, const bstr b1)
-{
-	if (!b0 || !b1 || !b0->data || !b1->data || b0->slen < 0 || b1->slen < 0) return SHRT_MIN;
+/* Highest instruction set the kernels may use, capped by the CPU. */
+static int bstr__simd_max = BSTR_SIMD_AVX2;
 
-	int n = (b0->slen < b1->slen) ? b0->slen : b1->slen;
-	for (int i = 0; i < n; i++) {
-		int v = ((char)b0->data[i]) - ((char)b1->data[i]);
-		if (v != 0) return v;
-		if (b0->data[i] == '\0') return BSTR_OK;
-	}
-	return (b0->slen > b1->slen) - (b1->slen > b0->slen);
+static inline int bstr_simd_level(void)
+{
+#ifdef BSTR_X86_SIMD
+	if (bstr__simd_max >= BSTR_SIMD_AVX2 && __builtin_cpu_supports("avx2"))
+		return BSTR_SIMD_AVX2;
+	if (bstr__simd_max >= BSTR_SIMD_SSE2 && __builtin_cpu_supports("sse2"))
+		return BSTR_SIMD_SSE2;
+#endif
+	return BSTR_SIMD_NONE;
 }
 
-static inline int bstr_find(const bstr b1, int pos, const bstr b2)
+/*
+ * Cap the instruction set used by the vector kernels, mostly for testing
+ * and benchmarking the fallbacks. Returns the previous cap.
+ */
+static inline int bstr_set_simd_level(int level)
 {
-	if (!b1 || !b1->data || b1->slen < 0 || !b2 || !b2->data || b2->slen < 0) return BSTR_ERR;
+	int old = bstr__simd_max;
+
+	bstr__simd_max = level;
+	return old;
+}
 
-	int i = pos;
-	int lf = b1->slen - b2->slen + 1;
-	if (lf <= pos) return BSTR_ERR;
+#if defined(__GNUC__)
+#define bstr__ctz(x) __builtin_ctz(x)
+#define bstr__ctzll(x) __builtin_ctzll(x)
+#else
+static inline int bstr__ctz(unsigned int x)
+{
+	int n = 0;
+	while (!(x & 1)) {
+		x >>= 1;
+		n++;
+	}
+	return n;
+}
+#endif
 
-	unsigned char *d0 = b2->data;
-	unsigned char *d1 = b1->data;
-	unsigned char c0 = d0[0];
-	int ll = b2->slen;
+/*
+ * Substring search kernels. Each returns the first i in [pos, hlen - nlen]
+ * where the nlen (>= 2) byte needle n occurs in h, or BSTR_ERR. Candidates
+ * are filtered on the needle's first and last bytes before comparing the
+ * middle.
+ */
+static inline bstr_len_t bstr__find_scalar(const unsigned char *h, bstr_len_t hlen, bstr_len_t pos,
+				    const unsigned char *n, bstr_len_t nlen)
+{
+	const unsigned char *p = h + pos;
+	const unsigned char *end = h + hlen - nlen + 1;
+	unsigned char last = n[nlen - 1];
 
-	for (; i < lf; i++)
-		if (c0 == d1[i] && memcmp(d1 + i, d0, ll) == 0) return i;
+	while (p < end) {
+		p = memchr(p, n[0], end - p);
+		if (!p)
+			break;
+		if (p[nlen - 1] == last && memcmp(p + 1, n + 1, nlen - 2) == 0)
+			return (bstr_len_t)(p - h);
+		p++;
+	}
 	return BSTR_ERR;
 }
 
-static inline int bstr_trunc(bstr b, int n)
+#ifdef BSTR_X86_SIMD
+BSTR__SSE2
+static bstr_len_t bstr__find_sse2(const unsigned char *h, bstr_len_t hlen, bstr_len_t pos,
+			   const unsigned char *n, bstr_len_t nlen)
 {
-	if (n < 0 || !b || !b->data || b->mlen < b->slen || b->slen < 0 || b->mlen <= 0) return BSTR_ERR;
+	const __m128i first = _mm_set1_epi8((char)n[0]);
+	const __m128i last = _mm_set1_epi8((char)n[nlen - 1]);
+	bstr_len_t i = pos;
+
+	for (; i <= hlen - nlen + 1 - 16; i += 16) {
+		__m128i bf = _mm_loadu_si128((const __m128i *)(h + i));
+		__m128i bl = _mm_loadu_si128((const __m128i *)(h + i + nlen - 1));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(
+			_mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl)));
+
+		while (mask) {
+			int bit = bstr__ctz(mask);
+			if (memcmp(h + i + bit + 1, n + 1, nlen - 2) == 0)
+				return i + bit;
+			mask &= mask - 1;
+		}
+	}
+	return bstr__find_scalar(h, hlen, i, n, nlen);
+}
 
-	if (b->slen > n) {
-		b->slen = n;
-		b->data[n] = '\0';
+BSTR__AVX2
+static bstr_len_t bstr__find_avx2(const unsigned char *h, bstr_len_t hlen, bstr_len_t pos,
+			   const unsigned char *n, bstr_len_t nlen)
+{
+	const __m256i first = _mm256_set1_epi8((char)n[0]);
+	const __m256i last = _mm256_set1_epi8((char)n[nlen - 1]);
+	bstr_len_t i = pos;
+
+	for (; i <= hlen - nlen + 1 - 32; i += 32) {
+		__m256i bf = _mm256_loadu_si256((const __m256i *)(h + i));
+		__m256i bl = _mm256_loadu_si256((const __m256i *)(h + i + nlen - 1));
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+			_mm256_and_si256(_mm256_cmpeq_epi8(first, bf), _mm256_cmpeq_epi8(last, bl)));
+
+		while (mask) {
+			int bit = bstr__ctz(mask);
+			if (memcmp(h + i + bit + 1, n + 1, nlen - 2) == 0)
+				return i + bit;
+			mask &= mask - 1;
+		}
 	}
-	return BSTR_OK;
+	return bstr__find_sse2(h, hlen, i, n, nlen);
 }
+#endif /* BSTR_X86_SIMD */
 
-static inline int bstr_icmp(const bstr b0, const bstr b1)
+/* Find n in h starting at pos; nlen must be positive. */
+static inline bstr_len_t bstr__find_blk(const unsigned char *h, bstr_len_t hlen, bstr_len_t pos,
+				 const unsigned char *n, bstr_len_t nlen)
 {
-	if (!b0 || !b1 || !b0->data || !b1->data || b0->slen < 0 || b1->slen < 0) return SHRT_MIN;
+	if (pos < 0 || hlen - nlen < pos)
+		return BSTR_ERR;
 
-	int n = (b0->slen < b1->slen) ? b0->slen : b1->slen;
-	for (int i = 0; i < n; i++) {
-		int v = downcase(b0->data[i]) - downcase(b1->data[i]);
-		if (v != 0) return v;
+	if (nlen == 1) {
+		const unsigned char *p = memchr(h + pos, n[0], hlen - pos);
+		return p ? (bstr_len_t)(p - h) : BSTR_ERR;
 	}
 
-	return (b0->slen > b1->slen) - (b1->slen > b0->slen);
+	switch (bstr_simd_level()) {
+#ifdef BSTR_X86_SIMD
+	case BSTR_SIMD_AVX2:
+		return bstr__find_avx2(h, hlen, pos, n, nlen);
+	case BSTR_SIMD_SSE2:
+		return bstr__find_sse2(h, hlen, pos, n, nlen);
+#endif
+	default:
+		return bstr__find_scalar(h, hlen, pos, n, nlen);
+	}
 }
 
-static inline int bstr_tolower(bstr b)
+static inline bstr_len_t bstr_find(const bstr b1, bstr_len_t pos, const bstr b2)
 {
-	if (!b || !b->data || b->mlen < b->slen || b->slen < 0 || b->mlen <= 0) return BSTR_ERR;
+	if (!b1 || !b1->data || b1->slen < 0 || !b2 || !b2->data || b2->slen < 0) return BSTR_ERR;
 
-	for (int i = 0; i < b->slen; i++)
-		b->data[i] = (unsigned char)downcase(b->data[i]);
-	return BSTR_OK;
+	bstr_len_t lf = b1->slen - b2->slen + 1;
+	if (lf <= pos || pos < 0) return BSTR_ERR;
+
+	/* An empty needle matches its own terminator: the first NUL from pos */
+	if (b2->slen == 0) {
+		const unsigned char *p = memchr(b1->data + pos, '\0', lf - pos);
+		return p ? (bstr_len_t)(p - b1->data) : BSTR_ERR;
+	}
+
+	return bstr__find_blk(b1->data, b1->slen, pos, b2->data, b2->slen);
 }
 
-static inline int bstr_assign_mid(bstr dest, const bstr src, int start, int len)
+#define bstr__bitop(a, b, op) \
+	((a)[(size_t)(b) / (8 * sizeof *(a))] op (size_t)1 << ((size_t)(b) % (8 * sizeof *(a))))
+
+/* Maximal suffix of n under the byte order (rev == 0) or its reverse. */
+static inline bstr_len_t bstr__max_suffix(const unsigned char *n, bstr_len_t l, int rev, bstr_len_t *period)
 {
-	if (!dest || !src || !src->data || src->slen < 0 || start < 0 || len < 0) return BSTR_ERR;
+	bstr_len_t ip = -1, jp = 0, k = 1, p = 1;
+
+	while (jp + k < l) {
+		unsigned char a = n[ip + k], b = n[jp + k];
+		if (a == b) {
+			if (k == p) {
+				jp += p;
+				k = 1;
+			} else {
+				k++;
+			}
+		} else if (rev ? a < b : a > b) {
+			jp += k;
+			k = 1;
+			p = jp - ip;
+		} else {
+			ip = jp++;
+			k = p = 1;
+		}
+	}
+	*period = p;
+	return ip;
+}
 
-	if (start >= src->slen) return bstr_trunc(dest, 0);
+/* Fill in pat for searching the non-empty needle, which pat borrows. */
+static inline void bstr__pattern_prepare(struct bstr_pattern *pat, const bstr needle)
+{
+	const unsigned char *n = needle->data;
+	bstr_len_t l = needle->slen;
 
-	int new_len = len;
-	if (start + len > src->slen)
-		new_len = src->slen - start;
+	pat->needle = needle;
 
+	memset(pat->byteset, 0, sizeof(pat->byteset));
+	for (bstr_len_t i = 0; i < l; i++) {
+		bstr__bitop(pat->byteset, n[i], |=);
+		pat->shift[n[i]] = i + 1;
+	}
+
+	/* Critical factorisation: the larger of the two maximal suffixes */
+	bstr_len_t p0, p1;
+	bstr_len_t ms0 = bstr__max_suffix(n, l, 0, &p0);
+	bstr_len_t ms1 = bstr__max_suffix(n, l, 1, &p1);
+	pat->ms = ms1 > ms0 ? ms1 : ms0;
+	pat->p = ms1 > ms0 ? p1 : p0;
+
+	if (memcmp(n, n + pat->p, pat->ms + 1)) {
+		pat->mem0 = 0;
+		pat->p = (pat->ms > l - pat->ms - 1 ? pat->ms : l - pat->ms - 1) + 1;
+	} else {
+		pat->mem0 = l - pat->p;
+	}
+}
+
+/*
+ * Compile needle for bstr_pattern_find and friends. The needle is copied,
+ * so it may be destroyed afterwards. Returns NULL for an empty needle.
+ */
+static inline struct bstr_pattern *bstr_pattern_compile(const bstr needle)
+{
+	if (!needle || !needle->data || needle->slen <= 0)
+		return NULL;
+
+	const struct bstr_allocator *a = bstr__default_allocator;
+	struct bstr_pattern *pat = bstr__malloc(a, sizeof(*pat));
+	if (!pat)
+		return NULL;
+
+	bstr copy = bstr_copy_with(a, needle);
+	if (!copy) {
+		bstr__free(a, pat, sizeof(*pat));
+		return NULL;
+	}
+	bstr__pattern_prepare(pat, copy);
+	pat->ator = a;
+	return pat;
+}
+
+static inline int bstr_pattern_destroy(struct bstr_pattern *pat)
+{
+	if (!pat || !pat->needle)
+		return BSTR_ERR;
+	bstr_destroy(pat->needle);
+	pat->needle = NULL;
+	bstr__free(pat->ator, pat, sizeof(*pat));
+	return BSTR_OK;
+}
+
+/* Two-Way search of h[pos, hlen) for the compiled needle. */
+static inline bstr_len_t bstr__pattern_find_blk(const struct bstr_pattern *pat,
+					 const unsigned char *h, bstr_len_t hlen, bstr_len_t pos)
+{
+	const unsigned char *n = pat->needle->data;
+	bstr_len_t l = pat->needle->slen;
+	bstr_len_t mem = 0;
+
+	if (pos < 0 || hlen - l < pos)
+		return BSTR_ERR;
+	if (l == 1) {
+		const unsigned char *x = memchr(h + pos, n[0], hlen - pos);
+		return x ? (bstr_len_t)(x - h) : BSTR_ERR;
+	}
+
+	for (bstr_len_t i = pos; i <= hlen - l;) {
+		const unsigned char *w;
+		bstr_len_t k;
+
+		/*
+		 * With nothing remembered any start position is valid, so
+		 * let memchr jump to the next copy of the first byte. Each
+		 * byte is skipped this way at most once.
+		 */
+		if (!mem && h[i] != n[0]) {
+			const unsigned char *x = memchr(h + i, n[0], hlen - l + 1 - i);
+			if (!x)
+				break;
+			i = (bstr_len_t)(x - h);
+		}
+		w = h + i;
+
+		/* Check the last byte first and skip by the shift table */
+		if (bstr__bitop(pat->byteset, w[l - 1], &)) {
+			k = l - pat->shift[w[l - 1]];
+			if (k) {
+				if (k < mem)
+					k = mem;
+				i += k;
+				mem = 0;
+				continue;
+			}
+		} else {
+			i += l;
+			mem = 0;
+			continue;
+		}
+
+		/* Right half, then left half */
+		for (k = (pat->ms + 1 > mem ? pat->ms + 1 : mem); k < l && n[k] == w[k]; k++)
+			;
+		if (k < l) {
+			i += k - pat->ms;
+			mem = 0;
+			continue;
+		}
+		for (k = pat->ms + 1; k > mem && n[k - 1] == w[k - 1]; k--)
+			;
+		if (k <= mem)
+			return i;
+		i += pat->p;
+		mem = pat->mem0;
+	}
+	return BSTR_ERR;
+}
+
+/* Position of the first match at or after pos, or BSTR_ERR. Linear time. */
+static inline bstr_len_t bstr_pattern_find(const struct bstr_pattern *pat, const bstr haystack, bstr_len_t pos)
+{
+	if (!pat || !pat->needle || !haystack || !haystack->data || haystack->slen < 0)
+		return BSTR_ERR;
+	return bstr__pattern_find_blk(pat, haystack->data, haystack->slen, pos);
+}
+
+/*
+ * Call callback(parm, ofs, len) for every non-overlapping match at or
+ * after pos. Returns the number of matches, or BSTR_ERR if the callback
+ * fails.
+ */
+static inline bstr_len_t bstr_pattern_find_all(const struct bstr_pattern *pat, const bstr haystack, bstr_len_t pos,
+					int (*callback)(void *parm, bstr_len_t ofs, bstr_len_t len), void *parm)
+{
+	if (!pat || !pat->needle || !haystack || !haystack->data || haystack->slen < 0 || pos < 0)
+		return BSTR_ERR;
+
+	bstr_len_t count = 0;
+	bstr_len_t l = pat->needle->slen;
+	bstr_len_t i;
+
+	while ((i = bstr__pattern_find_blk(pat, haystack->data, haystack->slen, pos)) >= 0) {
+		if (callback && callback(parm, i, l) < 0)
+			return BSTR_ERR;
+		count++;
+		pos = i + l;
+	}
+	return count;
+}
+
+/* Number of non-overlapping matches at or after pos. */
+static inline bstr_len_t bstr_pattern_count(const struct bstr_pattern *pat, const bstr haystack, bstr_len_t pos)
+{
+	return bstr_pattern_find_all(pat, haystack, pos, NULL, NULL);
+}
+
+static inline int bstr_ac_destroy(struct bstr_ac *ac)
+{
+	if (!ac)
+		return BSTR_ERR;
+
+	const struct bstr_allocator *a = ac->ator;
+
+	if (ac->delta)
+		bstr__free(a, ac->delta, ac->delta_size);
+	if (ac->term)
+		bstr__free(a, ac->term, ac->term_size);
+	if (ac->dup)
+		bstr__free(a, ac->dup, ((size_t)ac->qty * 2 + 1) * sizeof(int));
+	bstr__free(a, ac, sizeof(*ac));
+	return BSTR_OK;
+}
+
+/*
+ * Build an automaton that finds every entry of needles in one pass.
+ * Empty needles never match. Returns NULL on bad input or out of memory.
+ */
+static inline struct bstr_ac *bstr_ac_compile(const struct bstr_list *needles)
+{
+	const struct bstr_allocator *a = bstr__default_allocator;
+	int *queue = NULL;
+
+	if (!needles || needles->qty < 0 || (needles->qty && !needles->entry))
+		return NULL;
+
+	struct bstr_ac *ac = bstr__malloc(a, sizeof(*ac));
+	if (!ac)
+		return NULL;
+	memset(ac, 0, sizeof(*ac));
+	ac->qty = needles->qty;
+	ac->ator = a;
+
+	/* Compress the alphabet and bound the number of states */
+	size_t total = 1;
+	for (int i = 0; i < needles->qty; i++) {
+		const bstr n = needles->entry[i];
+		if (!n || !n->data || n->slen < 0 || total + n->slen > (size_t)INT_MAX / 2)
+			goto fail;
+		total += (size_t)n->slen;
+		for (int j = 0; j < n->slen; j++)
+			ac->cls[n->data[j]] = 1;
+	}
+	ac->nclasses = 1;
+	for (int c = 0; c < 256; c++)
+		ac->cls[c] = ac->cls[c] ? (unsigned char)ac->nclasses++ : 0;
+	if (total > (size_t)INT_MAX / ac->nclasses)
+		goto fail;
+
+	int ncls = ac->nclasses;
+	ac->nstates = (int)total;
+	ac->delta = bstr__malloc(a, total * ncls * sizeof(int));
+	ac->term = bstr__malloc(a, total * 2 * sizeof(int));
+	ac->dup = bstr__malloc(a, ((size_t)ac->qty * 2 + 1) * sizeof(int));
+	ac->delta_size = total * ncls * sizeof(int);
+	ac->term_size = total * 2 * sizeof(int);
+	queue = bstr__malloc(a, total * 2 * sizeof(int));
+	if (!ac->delta || !ac->term || !ac->dup || !queue)
+		goto fail;
+	ac->dict = ac->term + total;
+	ac->nlen = ac->dup + ac->qty;
+	for (size_t i = 0; i < total * ncls; i++)
+		ac->delta[i] = -1;
+	for (size_t i = 0; i < total; i++)
+		ac->term[i] = ac->dict[i] = -1;
+
+	/* Trie; duplicates chain off the lowest index */
+	int used = 1;
+	for (int i = needles->qty - 1; i >= 0; i--) {
+		const bstr n = needles->entry[i];
+		int s = 0;
+
+		ac->nlen[i] = (int)n->slen;
+		ac->dup[i] = -1;
+		if (n->slen == 0)
+			continue;
+		for (int j = 0; j < n->slen; j++) {
+			int *t = &ac->delta[s * ncls + ac->cls[n->data[j]]];
+			if (*t < 0)
+				*t = used++;
+			s = *t;
+		}
+		ac->dup[i] = ac->term[s];
+		ac->term[s] = i;
+	}
+
+	/* Failure links in BFS order, completing the DFA as we go */
+	int *link = queue + total;
+	int head = 0, tail = 0;
+	for (int c = 0; c < ncls; c++) {
+		int t = ac->delta[c];
+		if (t < 0) {
+			ac->delta[c] = 0;
+		} else {
+			link[t] = 0;
+			queue[tail++] = t;
+		}
+	}
+	while (head < tail) {
+		int s = queue[head++];
+		int f = link[s];
+
+		ac->dict[s] = ac->term[f] >= 0 ? f : ac->dict[f];
+		for (int c = 0; c < ncls; c++) {
+			int *t = &ac->delta[s * ncls + c];
+			if (*t < 0) {
+				*t = ac->delta[f * ncls + c];
+			} else {
+				link[*t] = ac->delta[f * ncls + c];
+				queue[tail++] = *t;
+			}
+		}
+	}
+	bstr__free(a, queue, total * 2 * sizeof(int));
+
+	/* Trim to the states actually used; if a shrink fails, keep the larger block */
+	memmove(ac->term + used, ac->dict, used * sizeof(int));
+	int *x = bstr__realloc(a, ac->term, ac->term_size, (size_t)used * 2 * sizeof(int));
+	if (x) {
+		ac->term = x;
+		ac->term_size = (size_t)used * 2 * sizeof(int);
+	}
+	ac->dict = ac->term + used;
+	int *d = bstr__realloc(a, ac->delta, ac->delta_size, (size_t)used * ncls * sizeof(int));
+	if (d) {
+		ac->delta = d;
+		ac->delta_size = (size_t)used * ncls * sizeof(int);
+	}
+	ac->nstates = used;
+
+	/* Store row offsets, flagging states that end a needle */
+	for (int i = 0; i < used * ncls; i++) {
+		int t = ac->delta[i];
+		ac->delta[i] = (ac->term[t] >= 0 || ac->dict[t] >= 0) ? ~(t * ncls) : t * ncls;
+	}
+	return ac;
+
+fail:
+	if (queue)
+		bstr__free(a, queue, total * 2 * sizeof(int));
+	bstr_ac_destroy(ac);
+	return NULL;
+}
+
+/*
+ * Scan haystack from pos and call callback(parm, idx, ofs) for every
+ * occurrence of needle idx starting at ofs, in order of the match's end.
+ * Returns the number of matches, or BSTR_ERR if the callback fails.
+ */
+static inline bstr_len_t bstr_ac_search(const struct bstr_ac *ac, const bstr haystack, bstr_len_t pos,
+				 int (*callback)(void *parm, int idx, bstr_len_t ofs), void *parm)
+{
+	if (!ac || !haystack || !haystack->data || haystack->slen < 0 ||
+	    pos < 0 || pos > haystack->slen)
+		return BSTR_ERR;
+
+	const unsigned char *d = haystack->data;
+	const int *delta = ac->delta;
+	bstr_len_t count = 0;
+	int row = 0;
+
+	for (bstr_len_t i = pos; i < haystack->slen; i++) {
+		row = delta[row + ac->cls[d[i]]];
+		if (row >= 0)
+			continue;
+
+		row = ~row;
+		int s = row / ac->nclasses;
+		if (ac->term[s] < 0)
+			s = ac->dict[s];
+		for (; s >= 0; s = ac->dict[s]) {
+			for (int idx = ac->term[s]; idx >= 0; idx = ac->dup[idx]) {
+				if (callback && callback(parm, idx, i + 1 - ac->nlen[idx]) < 0)
+					return BSTR_ERR;
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+static inline int bstr_trunc(bstr b, bstr_len_t n)
+{
+	if (n < 0 || !b || !b->data || b->mlen < b->slen || b->slen < 0 || b->mlen <= 0) return BSTR_ERR;
+
+	if (b->slen > n) {
+		if (bstr__mutate(b) != BSTR_OK) return BSTR_ERR;
+		b->slen = n;
+		b->data[n] = '\0';
+	}
+	return BSTR_OK;
+}
+
+/*
+ * Case mapping. The kernels assume the locale maps ASCII letters the way
+ * the C locale does, which callers check with bstr__ascii_case(); bytes
+ * from 0x80 up always go through tolower()/toupper(). Vector blocks that
+ * contain such bytes are handed to the scalar code whole.
+ */
+static inline int bstr__ascii_case(void)
+{
+	return tolower('I') == 'i' && toupper('i') == 'I';
+}
+
+static inline unsigned char bstr__fold_lower(unsigned char c)
+{
+	if ((unsigned char)(c - 'A') < 26)
+		return c | 0x20;
+	return c < 0x80 ? c : (unsigned char)downcase(c);
+}
+
+static inline unsigned char bstr__fold_upper(unsigned char c)
+{
+	if ((unsigned char)(c - 'a') < 26)
+		return c & ~0x20;
+	return c < 0x80 ? c : (unsigned char)upcase(c);
+}
+
+static inline void bstr__case_map_scalar(unsigned char *d, bstr_len_t from, bstr_len_t to, int upper)
+{
+	for (bstr_len_t i = from; i < to; i++)
+		d[i] = upper ? bstr__fold_upper(d[i]) : bstr__fold_lower(d[i]);
+}
+
+/* First index in [from, to) where a and b differ after folding, or to. */
+static inline bstr_len_t bstr__case_mismatch_scalar(const unsigned char *a, const unsigned char *b,
+					     bstr_len_t from, bstr_len_t to)
+{
+	while (from < to && bstr__fold_lower(a[from]) == bstr__fold_lower(b[from]))
+		from++;
+	return from;
+}
+
+#ifdef BSTR_X86_SIMD
+/* Set 0x20 in the lanes of v holding letters from lo to lo + 25 */
+BSTR__SSE2
+static inline __m128i bstr__case_bit_sse2(__m128i v, char lo)
+{
+	__m128i in = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((char)(lo - 1))),
+				   _mm_cmplt_epi8(v, _mm_set1_epi8((char)(lo + 26))));
+	return _mm_and_si128(in, _mm_set1_epi8(0x20));
+}
+
+BSTR__AVX2
+static inline __m256i bstr__case_bit_avx2(__m256i v, char lo)
+{
+	__m256i in = _mm256_andnot_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8((char)(lo + 25))),
+					 _mm256_cmpgt_epi8(v, _mm256_set1_epi8((char)(lo - 1))));
+	return _mm256_and_si256(in, _mm256_set1_epi8(0x20));
+}
+
+BSTR__SSE2
+static void bstr__case_map_sse2(unsigned char *d, bstr_len_t len, int upper)
+{
+	char lo = upper ? 'a' : 'A';
+	bstr_len_t i = 0;
+
+	for (; len - i >= 16; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(d + i));
+		if (_mm_movemask_epi8(v)) {
+			bstr__case_map_scalar(d, i, i + 16, upper);
+			continue;
+		}
+		/* Lower case sets the bit, upper case clears it */
+		_mm_storeu_si128((__m128i *)(d + i), _mm_xor_si128(v, bstr__case_bit_sse2(v, lo)));
+	}
+	bstr__case_map_scalar(d, i, len, upper);
+}
+
+BSTR__AVX2
+static void bstr__case_map_avx2(unsigned char *d, bstr_len_t len, int upper)
+{
+	char lo = upper ? 'a' : 'A';
+	bstr_len_t i = 0;
+
+	for (; len - i >= 32; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(d + i));
+		if (_mm256_movemask_epi8(v)) {
+			bstr__case_map_scalar(d, i, i + 32, upper);
+			continue;
+		}
+		_mm256_storeu_si256((__m256i *)(d + i), _mm256_xor_si256(v, bstr__case_bit_avx2(v, lo)));
+	}
+	bstr__case_map_scalar(d, i, len, upper);
+}
+
+BSTR__SSE2
+static bstr_len_t bstr__case_mismatch_sse2(const unsigned char *a, const unsigned char *b, bstr_len_t len)
+{
+	bstr_len_t i = 0;
+
+	for (; len - i >= 16; i += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		if (_mm_movemask_epi8(_mm_or_si128(va, vb))) {
+			bstr_len_t k = bstr__case_mismatch_scalar(a, b, i, i + 16);
+			if (k < i + 16)
+				return k;
+			continue;
+		}
+		va = _mm_or_si128(va, bstr__case_bit_sse2(va, 'A'));
+		vb = _mm_or_si128(vb, bstr__case_bit_sse2(vb, 'A'));
+		unsigned int m = ~(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xffff;
+		if (m)
+			return i + bstr__ctz(m);
+	}
+	return bstr__case_mismatch_scalar(a, b, i, len);
+}
+
+BSTR__AVX2
+static bstr_len_t bstr__case_mismatch_avx2(const unsigned char *a, const unsigned char *b, bstr_len_t len)
+{
+	bstr_len_t i = 0;
+
+	for (; len - i >= 32; i += 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		if (_mm256_movemask_epi8(_mm256_or_si256(va, vb))) {
+			bstr_len_t k = bstr__case_mismatch_scalar(a, b, i, i + 32);
+			if (k < i + 32)
+				return k;
+			continue;
+		}
+		va = _mm256_or_si256(va, bstr__case_bit_avx2(va, 'A'));
+		vb = _mm256_or_si256(vb, bstr__case_bit_avx2(vb, 'A'));
+		unsigned int m = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if (m)
+			return i + bstr__ctz(m);
+	}
+	return bstr__case_mismatch_scalar(a, b, i, len);
+}
+#endif /* BSTR_X86_SIMD */
+
+static inline void bstr__case_map(unsigned char *d, bstr_len_t len, int upper)
+{
+	if (!bstr__ascii_case()) {
+		for (bstr_len_t i = 0; i < len; i++)
+			d[i] = (unsigned char)(upper ? upcase(d[i]) : downcase(d[i]));
+		return;
+	}
+
+	switch (bstr_simd_level()) {
+#ifdef BSTR_X86_SIMD
+	case BSTR_SIMD_AVX2:
+		bstr__case_map_avx2(d, len, upper);
+		return;
+	case BSTR_SIMD_SSE2:
+		bstr__case_map_sse2(d, len, upper);
+		return;
+#endif
+	default:
+		bstr__case_map_scalar(d, 0, len, upper);
+	}
+}
+
+/* Case-insensitive difference of a and b over their first len bytes. */
+static inline int bstr__case_cmp(const unsigned char *a, const unsigned char *b, bstr_len_t len)
+{
+	bstr_len_t i;
+
+	if (!bstr__ascii_case()) {
+		for (i = 0; i < len; i++) {
+			int v = downcase(a[i]) - downcase(b[i]);
+			if (v != 0) return v;
+		}
+		return 0;
+	}
+
+	switch (bstr_simd_level()) {
+#ifdef BSTR_X86_SIMD
+	case BSTR_SIMD_AVX2:
+		i = bstr__case_mismatch_avx2(a, b, len);
+		break;
+	case BSTR_SIMD_SSE2:
+		i = bstr__case_mismatch_sse2(a, b, len);
+		break;
+#endif
+	default:
+		i = bstr__case_mismatch_scalar(a, b, 0, len);
+	}
+	return i < len ? bstr__fold_lower(a[i]) - bstr__fold_lower(b[i]) : 0;
+}
+
+static inline int bstr_icmp(const bstr b0, const bstr b1)
+{
+	if (!b0 || !b1 || !b0->data || !b1->data || b0->slen < 0 || b1->slen < 0) return SHRT_MIN;
+
+	bstr_len_t n = (b0->slen < b1->slen) ? b0->slen : b1->slen;
+	int v = bstr__case_cmp(b0->data, b1->data, n);
+	if (v != 0) return v;
+
+	return (b0->slen > b1->slen) - (b1->slen > b0->slen);
+}
+
+/* Like bstr_ncmp, ignoring case. */
+static inline int bstr_incmp(const bstr b0, const bstr b1, bstr_len_t n)
+{
+	if (!b0 || !b1 || !b0->data || !b1->data || b0->slen < 0 || b1->slen < 0 || n < 0) return SHRT_MIN;
+
+	bstr_len_t len = (b0->slen < b1->slen) ? b0->slen : b1->slen;
+	if (n < len) len = n;
+
+	int v = bstr__case_cmp(b0->data, b1->data, len);
+	if (v != 0) return v;
+
+	return (n > len) ? ((b0->slen > b1->slen) - (b1->slen > b0->slen)) : 0;
+}
+
+static inline int bstr_tolower(bstr b)
+{
+	if (!b || !b->data || b->mlen < b->slen || b->slen < 0 || b->mlen <= 0) return BSTR_ERR;
+	if (bstr__mutate(b) != BSTR_OK) return BSTR_ERR;
+
+	bstr__case_map(b->data, b->slen, 0);
+	return BSTR_OK;
+}
+
+static inline int bstr_toupper(bstr b)
+{
+	if (!b || !b->data || b->mlen < b->slen || b->slen < 0 || b->mlen <= 0) return BSTR_ERR;
+	if (bstr__mutate(b) != BSTR_OK) return BSTR_ERR;
+
+	bstr__case_map(b->data, b->slen, 1);
+	return BSTR_OK;
+}
+
+static inline int bstr_assign_mid(bstr dest, const bstr src, bstr_len_t start, bstr_len_t len)
+{
+	if (!dest || !src || !src->data || src->slen < 0 || start < 0 || len < 0) return BSTR_ERR;
+
+	if (start >= src->slen) return bstr_trunc(dest, 0);
+
+	bstr_len_t new_len = len;
+	if (len > src->slen - start)
+		new_len = src->slen - start;
+
+	if (bstr__mutate(dest) != BSTR_OK) return BSTR_ERR;
 	if (bstr_alloc(dest, new_len) != BSTR_OK) return BSTR_ERR;
 
 	memmove(dest->data, src->data + start, new_len);
@@ -555,408 +2077,3522 @@ static inline int bstr_assign_mid(bstr dest, const bstr src, int start, int len)
 	return BSTR_OK;
 }
 
-static inline int bstr_format(bstr b, const char *fmt, ...)
+/* The formatter behind bstr_format and friends, overridable like malloc */
+#ifndef BSTR_VSNPRINTF
+#define BSTR_VSNPRINTF vsnprintf
+#endif
+
+/*
+ * Format into b starting at pos, which is at most b->slen. The first
+ * attempt writes into the spare capacity past the current contents, so
+ * a failure there costs nothing: an append is then already in place, and
+ * other output is moved down to pos. vsnprintf runs a second time, at
+ * pos, only if the output did not fit. On failure b is left as it was.
+ */
+static inline int bstr__vformat_at(bstr b, bstr_len_t pos, const char *fmt, va_list args)
 {
-	if (!b || !fmt) return BSTR_ERR;
+	if (!b || !b->data || !fmt || b->slen < 0 || b->mlen <= b->slen || pos < 0 || pos > b->slen)
+		return BSTR_ERR;
+	if (bstr__mutate(b) != BSTR_OK)
+		return BSTR_ERR;
+
+	va_list again;
+	va_copy(again, args);
+	/* A replacement keeps the old terminator, so b stays valid throughout */
+	bstr_len_t start = b->slen + (pos < b->slen);
+	bstr_len_t room = b->mlen - start;
+	int n = BSTR_VSNPRINTF((char *)b->data + start, (size_t)room, fmt, args);
+	int wrote = 0;
+
+	if (n >= 0 && n < room) {
+		if (start != pos)
+			memmove(b->data + pos, b->data + start, (size_t)n + 1);
+	} else if (n >= 0) {
+		if (n > BSTR_LEN_MAX - 1 - pos || bstr_alloc(b, pos + n + 1) != BSTR_OK) {
+			n = -1;
+		} else {
+			wrote = 1;
+			n = BSTR_VSNPRINTF((char *)b->data + pos, (size_t)(b->mlen - pos), fmt, again);
+		}
+	}
+	va_end(again);
+
+	if (n < 0) {
+		if (wrote)
+			b->slen = pos;
+		b->data[b->slen] = '\0';
+		return BSTR_ERR;
+	}
+	b->slen = pos + n;
+	return BSTR_OK;
+}
 
+/*
+ * Replace the contents of b with printf-style output. On failure b is
+ * left unchanged. No argument may point into b's data, which can be
+ * overwritten or moved before the argument is read.
+ */
+static inline int bstr_format(bstr b, const char *fmt, ...)
+{
 	va_list args;
 	va_start(args, fmt);
+	int ret = bstr__vformat_at(b, 0, fmt, args);
+	va_end(args);
+	return ret;
+}
+
+static inline int bstr_vformat(bstr b, const char *fmt, va_list args)
+{
+	return bstr__vformat_at(b, 0, fmt, args);
+}
+
+/*
+ * Like bstr_format, but appends to the current contents. The same rules
+ * apply: a failure leaves b unchanged, and no argument may point into
+ * b's data, so bstr_appendf(b, "%s", b->data) is not allowed.
+ */
+static inline int bstr_appendf(bstr b, const char *fmt, ...)
+{
+	if (!b)
+		return BSTR_ERR;
 
-	int required_len = vsnprintf(NULL, 0, fmt, args) + 1;
+	va_list args;
+	va_start(args, fmt);
+	int ret = bstr__vformat_at(b, b->slen, fmt, args);
 	va_end(args);
+	return ret;
+}
+
+static inline int bstr_vappendf(bstr b, const char *fmt, va_list args)
+{
+	if (!b)
+		return BSTR_ERR;
+	return bstr__vformat_at(b, b->slen, fmt, args);
+}
+
+/*
+ * Typed appends. Each reserves room for its longest possible output
+ * with one bstr_alloc and writes the digits straight into the buffer.
+ */
+static const char bstr__digit_pairs[201] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+/* Write the decimal digits of v so that they end just before end. */
+static inline char *bstr__u64_digits(char *end, uint64_t v)
+{
+	while (v >= 100) {
+		unsigned int r = (unsigned int)(v % 100);
+		v /= 100;
+		end -= 2;
+		memcpy(end, bstr__digit_pairs + 2 * r, 2);
+	}
+	if (v >= 10) {
+		end -= 2;
+		memcpy(end, bstr__digit_pairs + 2 * v, 2);
+	} else {
+		*--end = (char)('0' + v);
+	}
+	return end;
+}
+
+/* Make room for max more bytes and return where they go. */
+static inline char *bstr__append_reserve(bstr b, int max)
+{
+	if (!b || !b->data || b->slen < 0 || b->mlen <= b->slen || b->slen > BSTR_LEN_MAX - 1 - max)
+		return NULL;
+	if (bstr__mutate(b) != BSTR_OK || bstr_alloc(b, b->slen + max + 1) != BSTR_OK)
+		return NULL;
+	return (char *)b->data + b->slen;
+}
+
+static inline int bstr__append_commit(bstr b, const char *end)
+{
+	b->slen = (bstr_len_t)(end - (const char *)b->data);
+	b->data[b->slen] = '\0';
+	return BSTR_OK;
+}
 
-	if (required_len <= 0) return BSTR_ERR;
+/* Append the digits of a buffer filled from the back */
+static inline int bstr__append_tail(bstr b, const char *p, const char *end)
+{
+	char *d = bstr__append_reserve(b, (int)(end - p));
 
-	if (bstr_alloc(b, required_len) != BSTR_OK) return BSTR_ERR;
+	if (!d)
+		return BSTR_ERR;
+	memcpy(d, p, end - p);
+	return bstr__append_commit(b, d + (end - p));
+}
+
+static inline int bstr_append_u64(bstr b, uint64_t v)
+{
+	char buf[20];
+	return bstr__append_tail(b, bstr__u64_digits(buf + sizeof(buf), v), buf + sizeof(buf));
+}
+
+static inline int bstr_append_i64(bstr b, int64_t v)
+{
+	char buf[21];
+	char *p = bstr__u64_digits(buf + sizeof(buf), v < 0 ? 0 - (uint64_t)v : (uint64_t)v);
+
+	if (v < 0)
+		*--p = '-';
+	return bstr__append_tail(b, p, buf + sizeof(buf));
+}
+
+/* Lower-case hex digits of v, without prefix or padding. */
+static inline int bstr_append_hex(bstr b, uint64_t v)
+{
+	char buf[16];
+	char *p = buf + sizeof(buf);
+
+	do {
+		*--p = "0123456789abcdef"[v & 15];
+		v >>= 4;
+	} while (v);
+	return bstr__append_tail(b, p, buf + sizeof(buf));
+}
+
+/*
+ * Shortest round-trip doubles with Grisu2 (Florian Loitsch, "Printing
+ * Floating-Point Numbers Quickly and Accurately with Integers"). The
+ * digits always read back as the same double and are the shortest such
+ * string in all but a tiny fraction of cases. Cached powers of ten are
+ * 10^k for k = -348, -340, ..., 340, as 64-bit significands rounded to
+ * nearest with their binary exponents.
+ */
+struct bstr__diyfp {
+	uint64_t	f;
+	int		e;
+};
+
+static const uint64_t bstr__pow10_f[87] = {
+	0xfa8fd5a0081c0288ull, 0xbaaee17fa23ebf76ull, 0x8b16fb203055ac76ull, 0xcf42894a5dce35eaull,
+	0x9a6bb0aa55653b2dull, 0xe61acf033d1a45dfull, 0xab70fe17c79ac6caull, 0xff77b1fcbebcdc4full,
+	0xbe5691ef416bd60cull, 0x8dd01fad907ffc3cull, 0xd3515c2831559a83ull, 0x9d71ac8fada6c9b5ull,
+	0xea9c227723ee8bcbull, 0xaecc49914078536dull, 0x823c12795db6ce57ull, 0xc21094364dfb5637ull,
+	0x9096ea6f3848984full, 0xd77485cb25823ac7ull, 0xa086cfcd97bf97f4ull, 0xef340a98172aace5ull,
+	0xb23867fb2a35b28eull, 0x84c8d4dfd2c63f3bull, 0xc5dd44271ad3cdbaull, 0x936b9fcebb25c996ull,
+	0xdbac6c247d62a584ull, 0xa3ab66580d5fdaf6ull, 0xf3e2f893dec3f126ull, 0xb5b5ada8aaff80b8ull,
+	0x87625f056c7c4a8bull, 0xc9bcff6034c13053ull, 0x964e858c91ba2655ull, 0xdff9772470297ebdull,
+	0xa6dfbd9fb8e5b88full, 0xf8a95fcf88747d94ull, 0xb94470938fa89bcfull, 0x8a08f0f8bf0f156bull,
+	0xcdb02555653131b6ull, 0x993fe2c6d07b7facull, 0xe45c10c42a2b3b06ull, 0xaa242499697392d3ull,
+	0xfd87b5f28300ca0eull, 0xbce5086492111aebull, 0x8cbccc096f5088ccull, 0xd1b71758e219652cull,
+	0x9c40000000000000ull, 0xe8d4a51000000000ull, 0xad78ebc5ac620000ull, 0x813f3978f8940984ull,
+	0xc097ce7bc90715b3ull, 0x8f7e32ce7bea5c70ull, 0xd5d238a4abe98068ull, 0x9f4f2726179a2245ull,
+	0xed63a231d4c4fb27ull, 0xb0de65388cc8ada8ull, 0x83c7088e1aab65dbull, 0xc45d1df942711d9aull,
+	0x924d692ca61be758ull, 0xda01ee641a708deaull, 0xa26da3999aef774aull, 0xf209787bb47d6b85ull,
+	0xb454e4a179dd1877ull, 0x865b86925b9bc5c2ull, 0xc83553c5c8965d3dull, 0x952ab45cfa97a0b3ull,
+	0xde469fbd99a05fe3ull, 0xa59bc234db398c25ull, 0xf6c69a72a3989f5cull, 0xb7dcbf5354e9beceull,
+	0x88fcf317f22241e2ull, 0xcc20ce9bd35c78a5ull, 0x98165af37b2153dfull, 0xe2a0b5dc971f303aull,
+	0xa8d9d1535ce3b396ull, 0xfb9b7cd9a4a7443cull, 0xbb764c4ca7a44410ull, 0x8bab8eefb6409c1aull,
+	0xd01fef10a657842cull, 0x9b10a4e5e9913129ull, 0xe7109bfba19c0c9dull, 0xac2820d9623bf429ull,
+	0x80444b5e7aa7cf85ull, 0xbf21e44003acdd2dull, 0x8e679c2f5e44ff8full, 0xd433179d9c8cb841ull,
+	0x9e19db92b4e31ba9ull, 0xeb96bf6ebadf77d9ull, 0xaf87023b9bf0ee6bull,
+};
+
+static const short bstr__pow10_e[87] = {
+	-1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+	-901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+	-582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+	-263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+	56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+	375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+	694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+	1013, 1039, 1066,
+};
+
+static inline struct bstr__diyfp bstr__diyfp_make(uint64_t f, int e)
+{
+	struct bstr__diyfp r;
+
+	r.f = f;
+	r.e = e;
+	return r;
+}
+
+/* Upper 64 bits of the product, rounded */
+static inline struct bstr__diyfp bstr__diyfp_mul(struct bstr__diyfp x, struct bstr__diyfp y)
+{
+	const uint64_t m32 = 0xffffffffu;
+	uint64_t a = x.f >> 32, b = x.f & m32, c = y.f >> 32, d = y.f & m32;
+	uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+	uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32) + (1u << 31);
+
+	return bstr__diyfp_make(ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64);
+}
+
+static inline struct bstr__diyfp bstr__diyfp_norm(struct bstr__diyfp x)
+{
+	while (!(x.f & (1ull << 63))) {
+		x.f <<= 1;
+		x.e--;
+	}
+	return x;
+}
+
+static inline void bstr__grisu_round(char *buf, int len, uint64_t delta, uint64_t rest,
+				     uint64_t ten_kappa, uint64_t wp_w)
+{
+	while (rest < wp_w && delta - rest >= ten_kappa &&
+	       (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+		buf[len - 1]--;
+		rest += ten_kappa;
+	}
+}
+
+static inline void bstr__grisu_digits(struct bstr__diyfp w, struct bstr__diyfp mp, uint64_t delta,
+				      char *buf, int *len, int *k)
+{
+	static const uint64_t pow10[20] = {
+		1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull,
+		100000000ull, 1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull,
+		10000000000000ull, 100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+		100000000000000000ull, 1000000000000000000ull, 10000000000000000000ull,
+	};
+	const int shift = -mp.e;
+	const uint64_t one = 1ull << shift;
+	const uint64_t wp_w = mp.f - w.f;
+	uint32_t p1 = (uint32_t)(mp.f >> shift);
+	uint64_t p2 = mp.f & (one - 1);
+	int kappa = 1;
+
+	while (kappa < 10 && p1 >= pow10[kappa])
+		kappa++;
+	*len = 0;
+
+	while (kappa > 0) {
+		uint32_t d = p1 / (uint32_t)pow10[kappa - 1];
+		p1 %= (uint32_t)pow10[kappa - 1];
+		if (d || *len)
+			buf[(*len)++] = (char)('0' + d);
+		kappa--;
+		uint64_t rest = ((uint64_t)p1 << shift) + p2;
+		if (rest <= delta) {
+			*k += kappa;
+			bstr__grisu_round(buf, *len, delta, rest, pow10[kappa] << shift, wp_w);
+			return;
+		}
+	}
+
+	for (;;) {
+		p2 *= 10;
+		delta *= 10;
+		char d = (char)(p2 >> shift);
+		if (d || *len)
+			buf[(*len)++] = (char)('0' + d);
+		p2 &= one - 1;
+		kappa--;
+		if (p2 < delta) {
+			*k += kappa;
+			bstr__grisu_round(buf, *len, delta, p2, one, -kappa < 20 ? wp_w * pow10[-kappa] : 0);
+			return;
+		}
+	}
+}
+
+/* Digits of a finite, positive v; v equals buf[0, len) * 10^k. */
+static inline void bstr__grisu2(double v, char *buf, int *len, int *k)
+{
+	uint64_t u;
+	memcpy(&u, &v, sizeof(u));
+
+	int be = (int)(u >> 52 & 0x7ff);
+	uint64_t sig = u & ((1ull << 52) - 1);
+	struct bstr__diyfp x = be ? bstr__diyfp_make(sig | 1ull << 52, be - 1075)
+				  : bstr__diyfp_make(sig, -1074);
+
+	/* Boundaries halfway to the neighbouring doubles, sharing an exponent */
+	struct bstr__diyfp plus = bstr__diyfp_make((x.f << 1) + 1, x.e - 1);
+	while (!(plus.f & (1ull << 53))) {
+		plus.f <<= 1;
+		plus.e--;
+	}
+	plus.f <<= 10;
+	plus.e -= 10;
+	struct bstr__diyfp minus = x.f == 1ull << 52 ? bstr__diyfp_make((x.f << 2) - 1, x.e - 2)
+						    : bstr__diyfp_make((x.f << 1) - 1, x.e - 1);
+	minus.f <<= minus.e - plus.e;
+	minus.e = plus.e;
+
+	/* Cached power that brings the product's exponent into [-60, -32] */
+	double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+	int ik = (int)dk;
+	if (dk - ik > 0.0)
+		ik++;
+	int index = (ik >> 3) + 1;
+	*k = -(-348 + index * 8);
+	struct bstr__diyfp c = bstr__diyfp_make(bstr__pow10_f[index], bstr__pow10_e[index]);
+
+	struct bstr__diyfp w = bstr__diyfp_mul(bstr__diyfp_norm(x), c);
+	struct bstr__diyfp wp = bstr__diyfp_mul(plus, c);
+	struct bstr__diyfp wm = bstr__diyfp_mul(minus, c);
+	wm.f++;
+	wp.f--;
+	bstr__grisu_digits(w, wp, wp.f - wm.f, buf, len, k);
+}
+
+/*
+ * Append the shortest digits that read back as v. Plain notation is
+ * used for decimal exponents from -6 to 20 and exponent notation
+ * (1.5e+300, 1e-7) outside it; integral values get no fraction part.
+ * Non-finite values are written as nan, inf and -inf.
+ */
+static inline int bstr_append_double(bstr b, double v)
+{
+	char digits[24];
+	char *d = bstr__append_reserve(b, 32);
+	uint64_t u;
+	int len, k;
+
+	if (!d)
+		return BSTR_ERR;
+	memcpy(&u, &v, sizeof(u));
+	if ((u >> 52 & 0x7ff) == 0x7ff && (u & ((1ull << 52) - 1))) {
+		memcpy(d, "nan", 3);
+		return bstr__append_commit(b, d + 3);
+	}
+	if (u >> 63)
+		*d++ = '-';
+	if ((u >> 52 & 0x7ff) == 0x7ff) {
+		memcpy(d, "inf", 3);
+		return bstr__append_commit(b, d + 3);
+	}
+	if (!(u << 1)) {
+		*d++ = '0';
+		return bstr__append_commit(b, d);
+	}
+
+	bstr__grisu2(v < 0 ? -v : v, digits, &len, &k);
+	int point = len + k;    /* Position of the decimal point in the digits */
+
+	if (point > 0 && point <= 21) {
+		if (k >= 0) {
+			memcpy(d, digits, len);
+			memset(d + len, '0', k);
+			d += point;
+		} else {
+			memcpy(d, digits, point);
+			d[point] = '.';
+			memcpy(d + point + 1, digits + point, len - point);
+			d += len + 1;
+		}
+	} else if (point > -6 && point <= 0) {
+		*d++ = '0';
+		*d++ = '.';
+		memset(d, '0', -point);
+		d += -point;
+		memcpy(d, digits, len);
+		d += len;
+	} else {
+		int x = point - 1;
+		*d++ = digits[0];
+		if (len > 1) {
+			*d++ = '.';
+			memcpy(d, digits + 1, len - 1);
+			d += len - 1;
+		}
+		*d++ = 'e';
+		*d++ = x < 0 ? '-' : '+';
+		char buf[3];
+		char *p = bstr__u64_digits(buf + sizeof(buf), (uint64_t)(x < 0 ? -x : x));
+		memcpy(d, p, buf + sizeof(buf) - p);
+		d += buf + sizeof(buf) - p;
+	}
+	return bstr__append_commit(b, d);
+}
+
+/*
+ * Append v with prec digits after the decimal point, rounded exactly as
+ * printf("%.*f") does. Values with a binary exponent below zero and
+ * integers under 2^64 are converted exactly with 128-bit arithmetic for
+ * prec up to 19; anything else goes through bstr_appendf.
+ */
+static inline int bstr_append_fixed(bstr b, double v, int prec)
+{
+	if (prec < 0)
+		return BSTR_ERR;
+
+#ifdef __SIZEOF_INT128__
+	uint64_t u;
+	memcpy(&u, &v, sizeof(u));
+
+	int be = (int)(u >> 52 & 0x7ff);
+	uint64_t m = u & ((1ull << 52) - 1);
+	int e = be ? be - 1075 : -1074;
+	if (be)
+		m |= 1ull << 52;
+
+	if (be != 0x7ff && prec <= 19 && e <= 11) {
+		uint64_t p10 = 1;
+		for (int i = 0; i < prec; i++)
+			p10 *= 10;
+
+		/* q = round-half-even(m * 2^e * 10^prec) */
+		__uint128_t q;
+		if (e >= 0) {
+			q = (__uint128_t)(m << e) * p10;
+		} else {
+			__uint128_t prod = (__uint128_t)m * p10;
+			int s = -e;
+			if (s >= 118) {
+				q = 0;  /* prod < 2^117, below half a unit */
+			} else {
+				q = prod >> s;
+				__uint128_t rem = prod & (((__uint128_t)1 << s) - 1);
+				__uint128_t half = (__uint128_t)1 << (s - 1);
+				if (rem > half || (rem == half && (q & 1)))
+					q++;
+			}
+		}
+
+		/* At most 39 digits, a sign, a point and leading zeros */
+		char buf[64];
+		char *end = buf + sizeof(buf);
+		char *p = end;
+		uint64_t lo = (uint64_t)(q % 10000000000000000000ull);
+		uint64_t hi = (uint64_t)(q / 10000000000000000000ull);
+		if (hi) {
+			p = bstr__u64_digits(p, lo);
+			while (p > end - 19)
+				*--p = '0';
+			p = bstr__u64_digits(p, hi);
+		} else {
+			p = bstr__u64_digits(p, lo);
+		}
+		while (end - p < prec + 1)
+			*--p = '0';
+
+		char *d = bstr__append_reserve(b, (int)(end - p) + 2);
+		if (!d)
+			return BSTR_ERR;
+		if (u >> 63)
+			*d++ = '-';
+		int ilen = (int)(end - p) - prec;
+		memcpy(d, p, ilen);
+		d += ilen;
+		if (prec) {
+			*d++ = '.';
+			memcpy(d, p + ilen, prec);
+			d += prec;
+		}
+		return bstr__append_commit(b, d);
+	}
+#endif
+	return bstr_appendf(b, "%.*f", prec, v);
+}
+
+/*
+ * Hashing. Inputs below BSTR__HASH_LONG bytes use a wyhash-style mix of
+ * 128-bit products. Longer inputs are first folded 64 bytes at a time
+ * into eight independent 64-bit lanes, XXH3 style, which maps directly
+ * onto AVX2; the scalar and AVX2 lane kernels give identical results.
+ * Words are read little-endian, so hashes are only stable on one
+ * byte order.
+ */
+#define BSTR__HASH_LONG 256
+
+static const uint64_t bstr__hash_secret[8] = {
+	0x781ef86f5c8cc1abull, 0x48f165d57b00c7f4ull, 0x3a0562d56abd685aull, 0x017f9ee6725ed09dull,
+	0xdaa8b2a668d605d4ull, 0xb6043106a85f68b6ull, 0x3ce44e27424458b6ull, 0x38f12d92a28f17d8ull,
+};
+
+#define BSTR__WY0 0xa0761d6478bd642full
+#define BSTR__WY1 0xe7037ed1a0b428dbull
+#define BSTR__WY2 0x8ebc6af09c88c6e3ull
+#define BSTR__WY3 0x589965cc75374cc3ull
+#define BSTR__PRIME32 0x9e3779b1u
+#define BSTR__PRIME64 0x9e3779b185ebca87ull
+
+static inline uint64_t bstr__r8(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t bstr__r4(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* Fold the 128-bit product of a and b to 64 bits */
+static inline uint64_t bstr__mix(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+	uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t)a, lb = (uint32_t)b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32);
+	uint64_t c = t < rl;
+	uint64_t lo = t + (rm1 << 32);
+	c += lo < t;
+	return lo ^ (rh + (rm0 >> 32) + (rm1 >> 32) + c);
+#endif
+}
+
+static inline uint64_t bstr__hash_short(const unsigned char *p, size_t len, uint64_t seed)
+{
+	uint64_t a, b;
+
+	seed ^= bstr__mix(seed ^ BSTR__WY0, BSTR__WY1);
+	if (len <= 16) {
+		if (len >= 4) {
+			size_t q = (len >> 3) << 2;
+			a = (bstr__r4(p) << 32) | bstr__r4(p + q);
+			b = (bstr__r4(p + len - 4) << 32) | bstr__r4(p + len - 4 - q);
+		} else if (len > 0) {
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t i = len;
+		if (i > 48) {
+			uint64_t s1 = seed, s2 = seed;
+			do {
+				seed = bstr__mix(bstr__r8(p) ^ BSTR__WY1, bstr__r8(p + 8) ^ seed);
+				s1 = bstr__mix(bstr__r8(p + 16) ^ BSTR__WY2, bstr__r8(p + 24) ^ s1);
+				s2 = bstr__mix(bstr__r8(p + 32) ^ BSTR__WY3, bstr__r8(p + 40) ^ s2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= s1 ^ s2;
+		}
+		while (i > 16) {
+			seed = bstr__mix(bstr__r8(p) ^ BSTR__WY1, bstr__r8(p + 8) ^ seed);
+			p += 16;
+			i -= 16;
+		}
+		a = bstr__r8(p + i - 16);
+		b = bstr__r8(p + i - 8);
+	}
+	return bstr__mix(BSTR__WY1 ^ (uint64_t)len, bstr__mix(a ^ BSTR__WY1, b ^ seed));
+}
+
+/*
+ * Fold stripes 64-byte stripes of p into acc. Every 16 stripes the lanes
+ * are scrambled so that high bits feed back into the products.
+ */
+static inline void bstr__hash_lanes_scalar(uint64_t *acc, const unsigned char *p, size_t stripes,
+					   const uint64_t *key)
+{
+	for (size_t s = 0; s < stripes; s++, p += 64) {
+		for (int i = 0; i < 8; i++) {
+			uint64_t v = bstr__r8(p + 8 * i);
+			uint64_t k = v ^ key[i];
+			acc[i ^ 1] += v;
+			acc[i] += (k & 0xffffffffu) * (k >> 32);
+		}
+		if ((s & 15) == 15) {
+			for (int i = 0; i < 8; i++) {
+				acc[i] ^= acc[i] >> 47;
+				acc[i] ^= key[i];
+				acc[i] *= BSTR__PRIME32;
+			}
+		}
+	}
+}
+
+#ifdef BSTR_X86_SIMD
+BSTR__AVX2
+static void bstr__hash_lanes_avx2(uint64_t *acc, const unsigned char *p, size_t stripes,
+				  const uint64_t *key)
+{
+	__m256i a0 = _mm256_loadu_si256((const __m256i *)acc);
+	__m256i a1 = _mm256_loadu_si256((const __m256i *)(acc + 4));
+	const __m256i k0 = _mm256_loadu_si256((const __m256i *)key);
+	const __m256i k1 = _mm256_loadu_si256((const __m256i *)(key + 4));
+	const __m256i prime = _mm256_set1_epi64x(BSTR__PRIME32);
+
+	for (size_t s = 0; s < stripes; s++, p += 64) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+		__m256i d0 = _mm256_xor_si256(v0, k0);
+		__m256i d1 = _mm256_xor_si256(v1, k1);
+		/* Low half times high half of each keyed word; data goes to the neighbour lane */
+		a0 = _mm256_add_epi64(a0, _mm256_mul_epu32(d0, _mm256_srli_epi64(d0, 32)));
+		a1 = _mm256_add_epi64(a1, _mm256_mul_epu32(d1, _mm256_srli_epi64(d1, 32)));
+		a0 = _mm256_add_epi64(a0, _mm256_shuffle_epi32(v0, _MM_SHUFFLE(1, 0, 3, 2)));
+		a1 = _mm256_add_epi64(a1, _mm256_shuffle_epi32(v1, _MM_SHUFFLE(1, 0, 3, 2)));
+		if ((s & 15) == 15) {
+			a0 = _mm256_xor_si256(_mm256_xor_si256(a0, _mm256_srli_epi64(a0, 47)), k0);
+			a1 = _mm256_xor_si256(_mm256_xor_si256(a1, _mm256_srli_epi64(a1, 47)), k1);
+			/* 64-bit multiply by a 32-bit constant from two 32x32 products */
+			a0 = _mm256_add_epi64(_mm256_mul_epu32(a0, prime),
+					      _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a0, 32), prime), 32));
+			a1 = _mm256_add_epi64(_mm256_mul_epu32(a1, prime),
+					      _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a1, 32), prime), 32));
+		}
+	}
+	_mm256_storeu_si256((__m256i *)acc, a0);
+	_mm256_storeu_si256((__m256i *)(acc + 4), a1);
+}
+#endif /* BSTR_X86_SIMD */
+
+static inline uint64_t bstr__hash_long(const unsigned char *p, size_t len, uint64_t seed)
+{
+	uint64_t acc[8] = {
+		BSTR__PRIME32, BSTR__PRIME64, BSTR__WY0, BSTR__WY1,
+		BSTR__WY2, BSTR__WY3, ~BSTR__PRIME64, ~(uint64_t)BSTR__PRIME32,
+	};
+	uint64_t key[8];
+	size_t stripes = len / 64;
+
+	for (int i = 0; i < 8; i++)
+		key[i] = bstr__hash_secret[i] + seed;
+
+#ifdef BSTR_X86_SIMD
+	if (bstr_simd_level() >= BSTR_SIMD_AVX2)
+		bstr__hash_lanes_avx2(acc, p, stripes, key);
+	else
+#endif
+		bstr__hash_lanes_scalar(acc, p, stripes, key);
+
+	uint64_t h = (uint64_t)len * BSTR__PRIME64;
+	for (int i = 0; i < 8; i += 2)
+		h += bstr__mix(acc[i] ^ bstr__hash_secret[i], acc[i + 1] ^ bstr__hash_secret[i + 1]);
+	return bstr__hash_short(p + stripes * 64, len - stripes * 64, h);
+}
+
+/* 64-bit hash of len bytes at blk. Not suitable against adversarial keys. */
+static inline uint64_t bstr_hash_blk(const void *blk, bstr_len_t len, uint64_t seed)
+{
+	if (len <= 0 || !blk)
+		return bstr__hash_short(NULL, 0, seed);
+	if (len < BSTR__HASH_LONG)
+		return bstr__hash_short(blk, (size_t)len, seed);
+	return bstr__hash_long(blk, (size_t)len, seed);
+}
+
+/* Hash of the contents of b under seed; 0 if b is invalid. */
+static inline uint64_t bstr_hash_seeded(const bstr b, uint64_t seed)
+{
+	if (!b || !b->data || b->slen < 0)
+		return 0;
+	return bstr_hash_blk(b->data, b->slen, seed);
+}
+
+/*
+ * bstr_hash_seeded(b, 0), remembered in b until its contents change so
+ * repeated lookups with the same key hash it only once. Writes that
+ * bypass the bstr functions must call bstr_touch() first.
+ */
+static inline uint64_t bstr_hash(const bstr b)
+{
+	if (!b || !b->data || b->slen < 0)
+		return 0;
+	if (!(b->flags & BSTR__F_HASHED)) {
+		b->hash = bstr_hash_blk(b->data, b->slen, 0);
+		b->flags |= BSTR__F_HASHED;
+	}
+	return b->hash;
+}
+
+/*
+ * Index of the first byte where a and b differ in [0, len), or len. The
+ * scalar version compares a word at a time and only walks bytes inside
+ * the word that differs.
+ */
+static inline bstr_len_t bstr__mismatch_scalar(const unsigned char *a, const unsigned char *b, bstr_len_t i, bstr_len_t len)
+{
+	for (; len - i >= (bstr_len_t)sizeof(size_t); i += sizeof(size_t)) {
+		size_t x, y;
+		memcpy(&x, a + i, sizeof(x));
+		memcpy(&y, b + i, sizeof(y));
+		if (x != y)
+			break;
+	}
+	while (i < len && a[i] == b[i])
+		i++;
+	return i;
+}
+
+#ifdef BSTR_X86_SIMD
+BSTR__SSE2
+static bstr_len_t bstr__mismatch_sse2(const unsigned char *a, const unsigned char *b, bstr_len_t len)
+{
+	bstr_len_t i = 0;
+
+	for (; len - i >= 16; i += 16) {
+		__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)),
+					    _mm_loadu_si128((const __m128i *)(b + i)));
+		unsigned int m = ~(unsigned int)_mm_movemask_epi8(eq) & 0xffff;
+		if (m)
+			return i + bstr__ctz(m);
+	}
+	return bstr__mismatch_scalar(a, b, i, len);
+}
+
+BSTR__AVX2
+static bstr_len_t bstr__mismatch_avx2(const unsigned char *a, const unsigned char *b, bstr_len_t len)
+{
+	bstr_len_t i = 0;
+
+	for (; len - i >= 32; i += 32) {
+		__m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)),
+					       _mm256_loadu_si256((const __m256i *)(b + i)));
+		unsigned int m = ~(unsigned int)_mm256_movemask_epi8(eq);
+		if (m)
+			return i + bstr__ctz(m);
+	}
+	return bstr__mismatch_scalar(a, b, i, len);
+}
+#endif /* BSTR_X86_SIMD */
+
+/* Difference of the first unequal bytes of a and b within len, or 0. */
+static inline int bstr__blk_cmp(const unsigned char *a, const unsigned char *b, bstr_len_t len)
+{
+	bstr_len_t i;
+
+	if (a == b)
+		return 0;
+
+	switch (bstr_simd_level()) {
+#ifdef BSTR_X86_SIMD
+	case BSTR_SIMD_AVX2:
+		i = bstr__mismatch_avx2(a, b, len);
+		break;
+	case BSTR_SIMD_SSE2:
+		i = bstr__mismatch_sse2(a, b, len);
+		break;
+#endif
+	default:
+		i = bstr__mismatch_scalar(a, b, 0, len);
+	}
+	return i < len ? a[i] - b[i] : 0;
+}
+
+/*
+ * Compare as unsigned bytes, embedded NULs included. Returns the
+ * difference of the first unequal bytes, or the sign of the length
+ * difference if one string is a prefix of the other.
+ */
+static inline int bstr_cmp(const bstr b0, const bstr b1)
+{
+	if (!b0 || !b1 || !b0->data || !b1->data || b0->slen < 0 || b1->slen < 0) return SHRT_MIN;
+
+	bstr_len_t n = (b0->slen < b1->slen) ? b0->slen : b1->slen;
+	int v = bstr__blk_cmp(b0->data, b1->data, n);
+	if (v != 0) return v;
+
+	return (b0->slen > b1->slen) - (b1->slen > b0->slen);
+}
+
+static inline int bstr_ncmp(const bstr b0, const bstr b1, bstr_len_t n)
+{
+	if (!b0 || !b1 || !b0->data || !b1->data || b0->slen < 0 || b1->slen < 0 || n < 0) return SHRT_MIN;
+
+	bstr_len_t len = (b0->slen < b1->slen) ? b0->slen : b1->slen;
+	if (n < len) len = n;
+
+	int v = bstr__blk_cmp(b0->data, b1->data, len);
+	if (v != 0) return v;
+
+	return (n > len) ? ((b0->slen > b1->slen) - (b1->slen > b0->slen)) : 0;
+}
+
+/*
+ * 1 if b0 and b1 hold the same bytes, 0 if not, BSTR_ERR on bad input.
+ * Strings of different lengths, or whose cached hashes differ, are
+ * rejected without reading their data.
+ */
+static inline int bstr_eq(const bstr b0, const bstr b1)
+{
+	if (!b0 || !b1 || !b0->data || !b1->data || b0->slen < 0 || b1->slen < 0) return BSTR_ERR;
+
+	if (b0->slen != b1->slen)
+		return 0;
+	if (b0->data == b1->data)
+		return 1;
+	if ((b0->flags & b1->flags & BSTR__F_HASHED) && b0->hash != b1->hash)
+		return 0;
+	return bstr__blk_cmp(b0->data, b1->data, b0->slen) == 0;
+}
+
+static inline int bstr_charset_init_blk(struct bstr_charset *cs, const void *blk, bstr_len_t len)
+{
+	const unsigned char *s = blk;
+	unsigned short los[16] = { 0 };
+	unsigned short buckets[8];
+	int nb = 0;
+
+	if (!cs || len < 0 || (len && !blk))
+		return BSTR_ERR;
+
+	memset(cs, 0, sizeof(*cs));
+	for (bstr_len_t i = 0; i < len; i++) {
+		cs->bits[s[i] >> 3] |= (unsigned char)(1 << (s[i] & 7));
+		los[s[i] >> 4] |= (unsigned short)(1 << (s[i] & 15));
+	}
+
+	/* One bucket per distinct set of low nibbles */
+	cs->nibble = 1;
+	for (int h = 0; h < 16 && cs->nibble; h++) {
+		bstr_len_t k;
+		if (!los[h])
+			continue;
+		for (k = 0; k < nb && buckets[k] != los[h]; k++)
+			;
+		if (k == nb) {
+			if (nb == 8) {
+				cs->nibble = 0;
+				break;
+			}
+			buckets[nb++] = los[h];
+		}
+		cs->hi[h] = (unsigned char)(1 << k);
+	}
+	if (!cs->nibble) {
+		memset(cs->hi, 0, sizeof(cs->hi));
+		return BSTR_OK;
+	}
+	for (int l = 0; l < 16; l++)
+		for (int k = 0; k < nb; k++)
+			if ((buckets[k] >> l) & 1)
+				cs->lo[l] |= (unsigned char)(1 << k);
+	return BSTR_OK;
+}
+
+/* Compile the bytes of set for the bstr_charset_* functions. */
+static inline int bstr_charset_init(struct bstr_charset *cs, const bstr set)
+{
+	if (!set || !set->data || set->slen < 0)
+		return BSTR_ERR;
+	return bstr_charset_init_blk(cs, set->data, set->slen);
+}
+
+/*
+ * Byte class kernels. bstr__charset_span returns the first index in
+ * [from, to) whose membership differs from member, or to. The scan
+ * kernels mirror bstr__scan_byte, reporting the offsets of members.
+ */
+static inline bstr_len_t bstr__charset_span_scalar(const struct bstr_charset *cs, const unsigned char *d,
+					    bstr_len_t from, bstr_len_t to, int member)
+{
+	while (from < to && bstr_charset_has(cs, d[from]) == member)
+		from++;
+	return from;
+}
+
+static inline int bstr__charset_scan_scalar(const struct bstr_charset *cs, const unsigned char *d,
+					    bstr_len_t *from, bstr_len_t to, bstr_len_t *out, int max)
+{
+	bstr_len_t i = *from;
+	int n = 0;
+
+	for (; i < to && n < max; i++)
+		if (bstr_charset_has(cs, d[i]))
+			out[n++] = i;
+	*from = i;
+	return n;
+}
+
+#ifdef BSTR_X86_SIMD
+/* Bit i set iff p[i] is a member */
+__attribute__((target("ssse3")))
+static inline unsigned int bstr__charset_mask_ssse3(__m128i lo, __m128i hi, const unsigned char *p)
+{
+	const __m128i nib = _mm_set1_epi8(0x0f);
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	__m128i l = _mm_shuffle_epi8(lo, _mm_and_si128(v, nib));
+	__m128i h = _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), nib));
+	__m128i miss = _mm_cmpeq_epi8(_mm_and_si128(l, h), _mm_setzero_si128());
+	return ~(unsigned int)_mm_movemask_epi8(miss) & 0xffff;
+}
+
+BSTR__AVX2
+static inline unsigned int bstr__charset_mask_avx2(__m256i lo, __m256i hi, const unsigned char *p)
+{
+	const __m256i nib = _mm256_set1_epi8(0x0f);
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+	__m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(v, nib));
+	__m256i h = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), nib));
+	__m256i miss = _mm256_cmpeq_epi8(_mm256_and_si256(l, h), _mm256_setzero_si256());
+	return ~(unsigned int)_mm256_movemask_epi8(miss);
+}
+
+__attribute__((target("ssse3")))
+static bstr_len_t bstr__charset_span_ssse3(const struct bstr_charset *cs, const unsigned char *d,
+				    bstr_len_t from, bstr_len_t to, int member)
+{
+	const __m128i lo = _mm_loadu_si128((const __m128i *)cs->lo);
+	const __m128i hi = _mm_loadu_si128((const __m128i *)cs->hi);
+	unsigned int flip = member ? 0xffff : 0;
+
+	for (; to - from >= 16; from += 16) {
+		unsigned int m = bstr__charset_mask_ssse3(lo, hi, d + from) ^ flip;
+		if (m)
+			return from + bstr__ctz(m);
+	}
+	return bstr__charset_span_scalar(cs, d, from, to, member);
+}
+
+BSTR__AVX2
+static bstr_len_t bstr__charset_span_avx2(const struct bstr_charset *cs, const unsigned char *d,
+				   bstr_len_t from, bstr_len_t to, int member)
+{
+	const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)cs->lo));
+	const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)cs->hi));
+	unsigned int flip = member ? 0xffffffffu : 0;
+
+	for (; to - from >= 32; from += 32) {
+		unsigned int m = bstr__charset_mask_avx2(lo, hi, d + from) ^ flip;
+		if (m)
+			return from + bstr__ctz(m);
+	}
+	return bstr__charset_span_scalar(cs, d, from, to, member);
+}
+
+__attribute__((target("ssse3")))
+static int bstr__charset_scan_ssse3(const struct bstr_charset *cs, const unsigned char *d,
+				    bstr_len_t *from, bstr_len_t to, bstr_len_t *out, int max)
+{
+	const __m128i lo = _mm_loadu_si128((const __m128i *)cs->lo);
+	const __m128i hi = _mm_loadu_si128((const __m128i *)cs->hi);
+	bstr_len_t i = *from;
+	int n = 0;
+
+	for (; to - i >= 16 && max - n >= 16; i += 16) {
+		unsigned int m = bstr__charset_mask_ssse3(lo, hi, d + i);
+		while (m) {
+			out[n++] = i + bstr__ctz(m);
+			m &= m - 1;
+		}
+	}
+	*from = i;
+	return n + bstr__charset_scan_scalar(cs, d, from, to, out + n, max - n);
+}
+
+BSTR__AVX2
+static int bstr__charset_scan_avx2(const struct bstr_charset *cs, const unsigned char *d,
+				   bstr_len_t *from, bstr_len_t to, bstr_len_t *out, int max)
+{
+	const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)cs->lo));
+	const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)cs->hi));
+	bstr_len_t i = *from;
+	int n = 0;
+
+	for (; to - i >= 64 && max - n >= 64; i += 64) {
+		unsigned long long m = bstr__charset_mask_avx2(lo, hi, d + i) |
+			(unsigned long long)bstr__charset_mask_avx2(lo, hi, d + i + 32) << 32;
+		while (m) {
+			out[n++] = i + bstr__ctzll(m);
+			m &= m - 1;
+		}
+	}
+	*from = i;
+	return n + bstr__charset_scan_scalar(cs, d, from, to, out + n, max - n);
+}
+#endif /* BSTR_X86_SIMD */
+
+/* Which classifier suits cs on this CPU */
+static inline int bstr__charset_level(const struct bstr_charset *cs)
+{
+	int level = cs->nibble ? bstr_simd_level() : BSTR_SIMD_NONE;
+
+#ifdef BSTR_X86_SIMD
+	if (level == BSTR_SIMD_SSE2 && !__builtin_cpu_supports("ssse3"))
+		level = BSTR_SIMD_NONE;
+#endif
+	return level;
+}
+
+static inline bstr_len_t bstr__charset_span(const struct bstr_charset *cs, const unsigned char *d,
+				     bstr_len_t from, bstr_len_t to, int member)
+{
+	switch (bstr__charset_level(cs)) {
+#ifdef BSTR_X86_SIMD
+	case BSTR_SIMD_AVX2:
+		return bstr__charset_span_avx2(cs, d, from, to, member);
+	case BSTR_SIMD_SSE2:
+		return bstr__charset_span_ssse3(cs, d, from, to, member);
+#endif
+	default:
+		return bstr__charset_span_scalar(cs, d, from, to, member);
+	}
+}
+
+static inline int bstr__charset_scan(const struct bstr_charset *cs, const unsigned char *d,
+				     bstr_len_t *from, bstr_len_t to, bstr_len_t *out, int max)
+{
+	switch (bstr__charset_level(cs)) {
+#ifdef BSTR_X86_SIMD
+	case BSTR_SIMD_AVX2:
+		return bstr__charset_scan_avx2(cs, d, from, to, out, max);
+	case BSTR_SIMD_SSE2:
+		return bstr__charset_scan_ssse3(cs, d, from, to, out, max);
+#endif
+	default:
+		return bstr__charset_scan_scalar(cs, d, from, to, out, max);
+	}
+}
+
+/* Length of the run of members of cs in b starting at pos. */
+static inline bstr_len_t bstr_charset_spn(const struct bstr_charset *cs, const bstr b, bstr_len_t pos)
+{
+	if (!cs || !b || !b->data || b->slen < 0 || pos < 0)
+		return BSTR_ERR;
+	if (pos >= b->slen)
+		return 0;
+	return bstr__charset_span(cs, b->data, pos, b->slen, 1) - pos;
+}
+
+/* Length of the run of non-members of cs in b starting at pos. */
+static inline bstr_len_t bstr_charset_cspn(const struct bstr_charset *cs, const bstr b, bstr_len_t pos)
+{
+	if (!cs || !b || !b->data || b->slen < 0 || pos < 0)
+		return BSTR_ERR;
+	if (pos >= b->slen)
+		return 0;
+	return bstr__charset_span(cs, b->data, pos, b->slen, 0) - pos;
+}
+
+static inline bstr_len_t bstr_spn(const bstr b, const bstr accept)
+{
+	if (!b || !accept || !b->data || !accept->data || b->slen < 0 || accept->slen < 0) return BSTR_ERR;
+
+	struct bstr_charset cs;
+	bstr_charset_init(&cs, accept);
+	return bstr_charset_spn(&cs, b, 0);
+}
+
+static inline bstr_len_t bstr_cspn(const bstr b, const bstr reject)
+{
+	if (!b || !reject || !b->data || !reject->data || b->slen < 0 || reject->slen < 0) return BSTR_ERR;
+
+	struct bstr_charset cs;
+	bstr_charset_init(&cs, reject);
+	return bstr_charset_cspn(&cs, b, 0);
+}
+
+static inline int bstr_list_alloc_min(struct bstr_list *list, int msz)
+{
+	if (!list || msz <= 0 || !list->entry || list->qty < 0 ||
+	    list->mlen <= 0 || list->qty > list->mlen)
+		return BSTR_ERR;
+
+	// The new minimum size should be at least as large as the number of entries
+	if (msz < list->qty)
+		msz = list->qty;
+
+	if (list->mlen == msz)
+		return BSTR_OK;
+
+	// Ensure we don't decrease mlen below what it was previously set
+	if (msz < list->mlen)
+		return BSTR_OK;
+
+	size_t new_size = ((size_t)msz) * sizeof(bstr);
+
+	if (new_size < (size_t)msz)
+		return BSTR_ERR;
+
+	bstr *new_entry = bstr__realloc(list->ator, list->entry,
+					(size_t)list->mlen * sizeof(bstr), new_size);
+	if (!new_entry)
+		return BSTR_ERR;
+
+	list->mlen = msz;
+	list->entry = new_entry;
+	return BSTR_OK;
+}
+
+static inline int bstr_list_alloc(struct bstr_list *list, int msz)
+{
+	if (!list || msz <= 0 || !list->entry || list->qty < 0 ||
+	    list->mlen <= 0 || list->qty > list->mlen)
+		return BSTR_ERR;
+
+	if (list->mlen >= msz)
+		return BSTR_OK;
+
+	/* Entry counts stay int, so only snap up while the result fits */
+	int smsz = snap_up_size(msz) <= INT_MAX ? (int)snap_up_size(msz) : msz;
+	size_t new_size = ((size_t)smsz) * sizeof(bstr);
+
+	if (new_size < (size_t)smsz)
+		return BSTR_ERR;
+
+	size_t old_size = ((size_t)list->mlen) * sizeof(bstr);
+	bstr *new_entry = bstr__realloc(list->ator, list->entry, old_size, new_size);
+	if (!new_entry) {
+		smsz = msz;
+		new_size = ((size_t)smsz) * sizeof(bstr);
+		new_entry = bstr__realloc(list->ator, list->entry, old_size, new_size);
+		if (!new_entry)
+			return BSTR_ERR;
+	}
+
+	list->mlen = smsz;
+	list->entry = new_entry;
+	return BSTR_OK;
+}
+
+static inline int bstr_list_callback(void *parm, bstr_len_t ofs, bstr_len_t len)
+{
+	struct gen_bstr_list *g = (struct gen_bstr_list *)parm;
+	bstr substring = bstr_mid(g->b, ofs, len);
+
+	if (substring == NULL) return BSTR_ERR;
+
+	if (g->bl->qty >= g->bl->mlen) {
+		if (bstr_list_alloc(g->bl, g->bl->mlen * 2) != BSTR_OK) {
+			bstr_destroy(substring);
+			return BSTR_ERR;
+		}
+	}
+
+	g->bl->entry[g->bl->qty] = substring;
+	g->bl->qty++;
+	return BSTR_OK;
+}
+
+/* Allocate an empty list with room for mlen entries. */
+static inline struct bstr_list *bstr__list_new(const struct bstr_allocator *a, int mlen)
+{
+	if (!a || mlen <= 0)
+		return NULL;
+
+	struct bstr_list *list = bstr__malloc(a, sizeof(struct bstr_list));
+
+	if (list) {
+		list->entry = (bstr *)bstr__malloc(a, (size_t)mlen * sizeof(bstr));
+		if (!list->entry) {
+			bstr__free(a, list, sizeof(struct bstr_list));
+			list = NULL;
+		} else {
+			list->qty = 0;
+			list->mlen = mlen;
+			list->ator = a;
+		}
+	}
+	return list;
+}
+
+static inline struct bstr_list *bstr_list_create(void)
+{
+	return bstr__list_new(bstr__default_allocator, 1);
+}
+
+static inline struct bstr_list *bstr_list_create_with(const struct bstr_allocator *a)
+{
+	return bstr__list_new(a, 1);
+}
+
+static inline int bstr_list_destroy(struct bstr_list *list)
+{
+	if (!list || list->qty < 0)
+		return BSTR_ERR;
+	for (int i = 0; i < list->qty; i++) {
+		if (list->entry[i]) {
+			bstr_destroy(list->entry[i]);
+			list->entry[i] = NULL;
+		}
+	}
+	bstr__free(list->ator, list->entry, (size_t)list->mlen * sizeof(bstr));
+	list->qty = -1;
+	list->mlen = -1;
+	list->entry = NULL;
+	bstr__free(list->ator, list, sizeof(struct bstr_list));
+	return BSTR_OK;
+}
+
+/*
+ * Delimiter scanning kernels. Each scans d[*from, to) for c, writes the
+ * offsets of up to max hits to out and returns how many it wrote. *from
+ * is advanced past everything scanned, so callers resume from there once
+ * they have drained out. The vector kernels build a 64-bit mask per
+ * 64-byte block and only take a block while out has room for all of it.
+ */
+static inline int bstr__scan_byte_scalar(const unsigned char *d, bstr_len_t *from, bstr_len_t to,
+					 unsigned char c, bstr_len_t *out, int max)
+{
+	bstr_len_t i = *from;
+	int n = 0;
+
+	while (n < max && i < to) {
+		const unsigned char *p = memchr(d + i, c, to - i);
+		if (!p) {
+			i = to;
+			break;
+		}
+		out[n++] = (bstr_len_t)(p - d);
+		i = (bstr_len_t)(p - d) + 1;
+	}
+	*from = i;
+	return n;
+}
+
+#ifdef BSTR_X86_SIMD
+BSTR__SSE2
+static int bstr__scan_byte_sse2(const unsigned char *d, bstr_len_t *from, bstr_len_t to,
+				unsigned char c, bstr_len_t *out, int max)
+{
+	const __m128i v = _mm_set1_epi8((char)c);
+	bstr_len_t i = *from;
+	int n = 0;
+
+	for (; to - i >= 64 && max - n >= 64; i += 64) {
+		unsigned long long mask =
+			(unsigned long long)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v,
+				_mm_loadu_si128((const __m128i *)(d + i)))) |
+			(unsigned long long)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v,
+				_mm_loadu_si128((const __m128i *)(d + i + 16)))) << 16 |
+			(unsigned long long)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v,
+				_mm_loadu_si128((const __m128i *)(d + i + 32)))) << 32 |
+			(unsigned long long)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v,
+				_mm_loadu_si128((const __m128i *)(d + i + 48)))) << 48;
+		while (mask) {
+			out[n++] = i + bstr__ctzll(mask);
+			mask &= mask - 1;
+		}
+	}
+	*from = i;
+	return n + bstr__scan_byte_scalar(d, from, to, c, out + n, max - n);
+}
+
+BSTR__AVX2
+static int bstr__scan_byte_avx2(const unsigned char *d, bstr_len_t *from, bstr_len_t to,
+				unsigned char c, bstr_len_t *out, int max)
+{
+	const __m256i v = _mm256_set1_epi8((char)c);
+	bstr_len_t i = *from;
+	int n = 0;
+
+	for (; to - i >= 64 && max - n >= 64; i += 64) {
+		unsigned long long mask =
+			(unsigned long long)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v,
+				_mm256_loadu_si256((const __m256i *)(d + i)))) |
+			(unsigned long long)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v,
+				_mm256_loadu_si256((const __m256i *)(d + i + 32)))) << 32;
+		while (mask) {
+			out[n++] = i + bstr__ctzll(mask);
+			mask &= mask - 1;
+		}
+	}
+	*from = i;
+	return n + bstr__scan_byte_scalar(d, from, to, c, out + n, max - n);
+}
+#endif /* BSTR_X86_SIMD */
+
+static inline int bstr__scan_byte(const unsigned char *d, bstr_len_t *from, bstr_len_t to,
+				  unsigned char c, bstr_len_t *out, int max)
+{
+	switch (bstr_simd_level()) {
+#ifdef BSTR_X86_SIMD
+	case BSTR_SIMD_AVX2:
+		return bstr__scan_byte_avx2(d, from, to, c, out, max);
+	case BSTR_SIMD_SSE2:
+		return bstr__scan_byte_sse2(d, from, to, c, out, max);
+#endif
+	default:
+		return bstr__scan_byte_scalar(d, from, to, c, out, max);
+	}
+}
+
+/* Number of bytes equal to c in d[from, to). */
+static inline bstr_len_t bstr__count_byte(const unsigned char *d, bstr_len_t from, bstr_len_t to, unsigned char c)
+{
+	bstr_len_t n = 0;
+
+#ifdef BSTR_X86_SIMD
+	if (bstr_simd_level() >= BSTR_SIMD_SSE2) {
+		bstr_len_t batch[64];
+		int k;
+		/* The scan kernels already produce the masks; just tally them */
+		while ((k = bstr__scan_byte(d, &from, to, c, batch, 64)) > 0)
+			n += k;
+		return n;
+	}
+#endif
+	for (const unsigned char *p = d + from;
+	     (p = memchr(p, c, d + to - p)) != NULL; p++)
+		n++;
+	return n;
+}
+
+/* Offsets are handed out in batches of this many delimiters */
+#define BSTR__SPLIT_BATCH 256
+
+/*
+ * Find every occurrence of split_char at or after pos. The first max
+ * offsets are stored in ofs; the return value is the total number found,
+ * so a call with max == 0 just counts. Returns BSTR_ERR on bad input.
+ */
+static inline bstr_len_t bstr_split_offsets(const bstr str, unsigned char split_char, bstr_len_t pos, bstr_len_t *ofs, int max)
+{
+	if (!str || !str->data || str->slen < 0 || pos < 0 || max < 0 || (max && !ofs))
+		return BSTR_ERR;
+	if (pos >= str->slen)
+		return 0;
+
+	bstr_len_t i = pos;
+	int n = 0;
+	while (n < max && i < str->slen) {
+		int k = bstr__scan_byte(str->data, &i, str->slen, split_char, ofs + n, max - n);
+		if (k == 0)
+			break;
+		n += k;
+	}
+	return n + bstr__count_byte(str->data, i, str->slen, split_char);
+}
+
+static inline int bstr_split_cb(const bstr str, unsigned char split_char, bstr_len_t pos,
+				int (*callback)(void *parm, bstr_len_t ofs, bstr_len_t len), void *parm)
+{
+	if (!str || !str->data || str->slen < 0 || pos < 0 || !callback)
+		return BSTR_ERR;
+
+	bstr_len_t batch[BSTR__SPLIT_BATCH];
+	bstr_len_t start = pos;
+	bstr_len_t i = pos;
+	while (i < str->slen) {
+		int n = bstr__scan_byte(str->data, &i, str->slen, split_char, batch, BSTR__SPLIT_BATCH);
+		for (int k = 0; k < n; k++) {
+			if (callback(parm, start, batch[k] - start) < 0)
+				return BSTR_ERR;
+			start = batch[k] + 1;
+		}
+	}
+
+	if (start <= str->slen)
+		return callback(parm, start, str->slen - start);
+
+	return BSTR_OK;
+}
+
+static inline struct bstr_list *bstr_split(const bstr str, unsigned char split_char)
+{
+	struct gen_bstr_list g;
+
+	if (!str || !str->data || str->slen < 0)
+		return NULL;
+
+	/* Counting is cheap next to the copies, and sizes the list exactly */
+	bstr_len_t n = bstr_split_offsets(str, split_char, 0, NULL, 0);
+	if (n >= INT_MAX)
+		return NULL;
+	g.bl = bstr__list_new(bstr__default_allocator, (int)n + 1);
+	if (!g.bl)
+		return NULL;
+
+	g.b = (bstr)str;
+
+	if (bstr_split_cb(str, split_char, 0, bstr_list_callback, &g) < 0) {
+		bstr_list_destroy(g.bl);
+		return NULL;
+	}
+
+	return g.bl;
+}
+
+/* Like bstr_splits_cb, but with a precompiled set of delimiters. */
+static inline int bstr_charset_split_cb(const bstr str, const struct bstr_charset *cs, bstr_len_t pos,
+					int (*callback)(void *parm, bstr_len_t ofs, bstr_len_t len), void *parm)
+{
+	if (!str || !str->data || str->slen < 0 || !cs || pos < 0 || !callback)
+		return BSTR_ERR;
+
+	bstr_len_t batch[BSTR__SPLIT_BATCH];
+	bstr_len_t start = pos;
+	bstr_len_t i = pos;
+	while (i < str->slen) {
+		int n = bstr__charset_scan(cs, str->data, &i, str->slen, batch, BSTR__SPLIT_BATCH);
+		for (int k = 0; k < n; k++) {
+			if (callback(parm, start, batch[k] - start) < 0)
+				return BSTR_ERR;
+			start = batch[k] + 1;
+		}
+	}
+
+	if (start <= str->slen)
+		return callback(parm, start, str->slen - start);
+
+	return BSTR_OK;
+}
+
+static inline int bstr_splits_cb(const bstr str, const bstr split_str, bstr_len_t pos,
+				 int (*callback)(void *parm, bstr_len_t ofs, bstr_len_t len), void *parm)
+{
+	if (!str || !str->data || str->slen < 0 ||
+	    !split_str || !split_str->data || split_str->slen < 0 || !callback)
+		return BSTR_ERR;
+
+	struct bstr_charset cs;
+	bstr_charset_init(&cs, split_str);
+	return bstr_charset_split_cb(str, &cs, pos, callback, parm);
+}
+
+static inline struct bstr_list *bstr_splits(const bstr str, const bstr split_str)
+{
+	struct gen_bstr_list g;
+
+	if (!str || str->slen < 0 || !str->data ||
+	    !split_str || split_str->slen < 0 || !split_str->data)
+		return NULL;
+
+	g.bl = bstr__list_new(bstr__default_allocator, 4);
+	if (!g.bl)
+		return NULL;
+
+	g.b = (bstr)str;
+
+	if (bstr_splits_cb(str, split_str, 0, bstr_list_callback, &g) < 0) {
+		bstr_list_destroy(g.bl);
+		return NULL;
+	}
+
+	return g.bl;
+}
+
+/*
+ * Split str on every non-overlapping occurrence of a compiled separator.
+ * Runs in linear time and does no per-call setup, so one pattern can be
+ * reused across many records.
+ */
+static inline int bstr_pattern_split_cb(const bstr str, const struct bstr_pattern *pat, bstr_len_t pos,
+					int (*callback)(void *parm, bstr_len_t ofs, bstr_len_t len), void *parm)
+{
+	if (!str || !str->data || str->slen < 0 || !pat || !pat->needle || pos < 0 || !callback)
+		return BSTR_ERR;
+
+	bstr_len_t l = pat->needle->slen;
+	bstr_len_t i;
+	while ((i = bstr__pattern_find_blk(pat, str->data, str->slen, pos)) >= 0) {
+		if (callback(parm, pos, i - pos) < 0)
+			return BSTR_ERR;
+		pos = i + l;
+	}
+
+	if (pos <= str->slen)
+		return callback(parm, pos, str->slen - pos);
+
+	return BSTR_OK;
+}
+
+static inline int bstr_split_str_cb(const bstr str, const bstr split_str, bstr_len_t pos,
+				    int (*callback)(void *parm, bstr_len_t ofs, bstr_len_t len), void *parm)
+{
+	if (!str || !str->data || str->slen < 0 ||
+	    !split_str || !split_str->data || split_str->slen < 0 || pos < 0 || !callback)
+		return BSTR_ERR;
+
+	/*
+	 * An empty separator splits into single characters. As with any
+	 * other separator the last token runs to the end of str, so it is
+	 * empty here and an empty str still yields one token.
+	 */
+	if (split_str->slen == 0) {
+		for (; pos < str->slen; pos++)
+			if (callback(parm, pos, 1) < 0)
+				return BSTR_ERR;
+		if (pos == str->slen)
+			return callback(parm, pos, 0);
+		return BSTR_OK;
+	}
+	if (split_str->slen == 1)
+		return bstr_split_cb(str, split_str->data[0], pos, callback, parm);
+
+	struct bstr_pattern pat;
+	bstr__pattern_prepare(&pat, split_str);
+	return bstr_pattern_split_cb(str, &pat, pos, callback, parm);
+}
+
+static inline struct bstr_list *bstr_split_str(const bstr str, const bstr split_str)
+{
+	struct gen_bstr_list g;
+
+	if (!str || !str->data || str->slen < 0)
+		return NULL;
+
+	g.bl = bstr__list_new(bstr__default_allocator, 4);
+	if (!g.bl)
+		return NULL;
+
+	g.b = (bstr)str;
+
+	if (bstr_split_str_cb(str, split_str, 0, bstr_list_callback, &g) < 0) {
+		bstr_list_destroy(g.bl);
+		return NULL;
+	}
+
+	return g.bl;
+}
+
+static inline bstr bstr_join(const struct bstr_list *list, const bstr sep)
+{
+	if (list == NULL || list->qty < 0)
+		return NULL;
+	if (sep != NULL && (sep->slen < 0 || sep->data == NULL))
+		return NULL;
+
+	bstr_len_t total_length = 1; // For null terminator
+	for (int i = 0; i < list->qty; i++) {
+		if (list->entry[i]->slen < 0)
+			return NULL; // Invalid input
+		if (list->entry[i]->slen > BSTR_LEN_MAX - total_length)
+			return NULL; // Overflow
+		total_length += list->entry[i]->slen;
+	}
+
+	if (sep != NULL && list->qty > 1) {
+		if (sep->slen > (BSTR_LEN_MAX - total_length) / (list->qty - 1))
+			return NULL; // Overflow
+		total_length += (bstr_len_t)(list->qty - 1) * sep->slen;
+	}
+
+	bstr result = bstr__new(bstr__default_allocator, total_length);
+	if (!result)
+		return NULL; // Out of memory
+
+	result->slen = total_length - 1;
+
+	bstr_len_t current_pos = 0;
+	for (int i = 0; i < list->qty; i++) {
+		if (i > 0 && sep != NULL) {
+			memcpy(result->data + current_pos, sep->data, sep->slen);
+			current_pos += sep->slen;
+		}
+		memcpy(result->data + current_pos, list->entry[i]->data, list->entry[i]->slen);
+		current_pos += list->entry[i]->slen;
+	}
+
+	result->data[current_pos] = '\0';
+	return result;
+}
+
+/*
+ * Append the entries of list, separated by sep, to dest. dest is grown
+ * once to the final length, so reserving it beforehand makes this copy
+ * only. dest may itself appear in list or be sep.
+ */
+static inline int bstr_join_into(bstr dest, const struct bstr_list *list, const bstr sep)
+{
+	if (!dest || !dest->data || dest->slen < 0 || !list || list->qty < 0)
+		return BSTR_ERR;
+	if (sep && (sep->slen < 0 || !sep->data))
+		return BSTR_ERR;
+
+	bstr_len_t seplen = sep ? sep->slen : 0;
+	bstr_len_t total = dest->slen;
+	for (int i = 0; i < list->qty; i++) {
+		bstr b = list->entry[i];
+		if (!b || !b->data || b->slen < 0)
+			return BSTR_ERR;
+		if (b->slen > BSTR_LEN_MAX - 1 - total)
+			return BSTR_ERR;
+		total += b->slen;
+		if (i > 0) {
+			if (seplen > BSTR_LEN_MAX - 1 - total)
+				return BSTR_ERR;
+			total += seplen;
+		}
+	}
+
+	if (bstr__mutate(dest) != BSTR_OK || bstr_alloc(dest, total + 1) != BSTR_OK)
+		return BSTR_ERR;
+
+	/* dest->slen stays put until the end so aliased entries copy whole */
+	bstr_len_t pos = dest->slen;
+	for (int i = 0; i < list->qty; i++) {
+		if (i > 0 && seplen) {
+			memcpy(dest->data + pos, sep->data, seplen);
+			pos += seplen;
+		}
+		memcpy(dest->data + pos, list->entry[i]->data, list->entry[i]->slen);
+		pos += list->entry[i]->slen;
+	}
+
+	dest->slen = pos;
+	dest->data[pos] = '\0';
+	return BSTR_OK;
+}
+
+#ifdef BSTR_HAVE_WRITEV
+/* iovecs handed to a single writev call */
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define BSTR__IOV_BATCH IOV_MAX
+#else
+#define BSTR__IOV_BATCH 1024
+#endif
+
+/*
+ * Write all of iov[0, cnt) to fd, resuming after short writes and EINTR.
+ * The iovecs are consumed in the process.
+ */
+static inline int bstr__writev_all(int fd, struct iovec *iov, int cnt)
+{
+	while (cnt > 0) {
+		ssize_t n = writev(fd, iov, cnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return BSTR_ERR;
+		}
+		while (cnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= (ssize_t)iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= (size_t)n;
+		}
+	}
+	return BSTR_OK;
+}
+
+/*
+ * Write the entries of list, separated by sep, to fd without building
+ * the joined string. Returns BSTR_ERR with errno set if a write fails.
+ */
+static inline int bstr_list_writev(int fd, const struct bstr_list *list, const bstr sep)
+{
+	if (fd < 0 || !list || list->qty < 0)
+		return BSTR_ERR;
+	if (sep && (sep->slen < 0 || !sep->data))
+		return BSTR_ERR;
+
+	struct iovec iov[BSTR__IOV_BATCH];
+	int cnt = 0;
+	for (int i = 0; i < list->qty; i++) {
+		bstr b = list->entry[i];
+		if (!b || !b->data || b->slen < 0)
+			return BSTR_ERR;
+
+		/* Room for a separator and an entry */
+		if (cnt > BSTR__IOV_BATCH - 2) {
+			if (bstr__writev_all(fd, iov, cnt) != BSTR_OK)
+				return BSTR_ERR;
+			cnt = 0;
+		}
+		if (i > 0 && sep && sep->slen) {
+			iov[cnt].iov_base = sep->data;
+			iov[cnt++].iov_len = (size_t)sep->slen;
+		}
+		if (b->slen) {
+			iov[cnt].iov_base = b->data;
+			iov[cnt++].iov_len = (size_t)b->slen;
+		}
+	}
+	return bstr__writev_all(fd, iov, cnt);
+}
+#endif /* BSTR_HAVE_WRITEV */
+
+#define BSTR__CTRL_EMPTY 0x80
+#define BSTR__CTRL_DELETED 0xfe
+#define BSTR__GROUP 16
+#define bstr__h2(h) ((unsigned char)((h) >> 57))
+
+/* Bit i set iff g[i] == c, for one group of control bytes */
+static inline unsigned int bstr__group_match_scalar(const unsigned char *g, unsigned char c)
+{
+	unsigned int m = 0;
+
+	for (int i = 0; i < BSTR__GROUP; i++)
+		m |= (unsigned int)(g[i] == c) << i;
+	return m;
+}
+
+/* Bit i set iff g[i] is empty or deleted, the two values with the high bit */
+static inline unsigned int bstr__group_free_scalar(const unsigned char *g)
+{
+	unsigned int m = 0;
+
+	for (int i = 0; i < BSTR__GROUP; i++)
+		m |= (unsigned int)(g[i] >> 7) << i;
+	return m;
+}
+
+#ifdef BSTR_X86_SIMD
+BSTR__SSE2
+static unsigned int bstr__group_match_sse2(const unsigned char *g, unsigned char c)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)g);
+	return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)c)));
+}
+
+BSTR__SSE2
+static unsigned int bstr__group_free_sse2(const unsigned char *g)
+{
+	return (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)g));
+}
+#endif /* BSTR_X86_SIMD */
+
+static inline unsigned int bstr__group_match(const unsigned char *g, unsigned char c)
+{
+#ifdef BSTR_X86_SIMD
+	if (bstr_simd_level() >= BSTR_SIMD_SSE2)
+		return bstr__group_match_sse2(g, c);
+#endif
+	return bstr__group_match_scalar(g, c);
+}
+
+static inline unsigned int bstr__group_free(const unsigned char *g)
+{
+#ifdef BSTR_X86_SIMD
+	if (bstr_simd_level() >= BSTR_SIMD_SSE2)
+		return bstr__group_free_sse2(g);
+#endif
+	return bstr__group_free_scalar(g);
+}
+
+/*
+ * Probing visits whole groups, starting from the one picked by the hash
+ * and stepping 1, 2, 3, ... groups further, which covers every group
+ * when their number is a power of two. A group with an empty slot ends
+ * the probe. Returns the slot of the key, or -1.
+ */
+static inline int bstr__map_find(const struct bstr_map *m, const unsigned char *p, bstr_len_t len, uint64_t h)
+{
+	int gmask = m->cap / BSTR__GROUP - 1;
+	int g = (int)(h & (uint64_t)gmask);
+	unsigned char h2 = bstr__h2(h);
+
+	for (int step = 1;; step++) {
+		const unsigned char *ctrl = m->ctrl + g * BSTR__GROUP;
+		unsigned int match = bstr__group_match(ctrl, h2);
+		while (match) {
+			int i = g * BSTR__GROUP + bstr__ctz(match);
+			bstr k = m->slots[i].key;
+			if (k->hash == h && k->slen == len && memcmp(k->data, p, len) == 0)
+				return i;
+			match &= match - 1;
+		}
+		if (bstr__group_match(ctrl, BSTR__CTRL_EMPTY) || step > gmask)
+			return -1;
+		g = (g + step) & gmask;
+	}
+}
+
+/* First empty or deleted slot on the probe path of h */
+static inline int bstr__map_free_slot(const struct bstr_map *m, uint64_t h)
+{
+	int gmask = m->cap / BSTR__GROUP - 1;
+	int g = (int)(h & (uint64_t)gmask);
+
+	for (int step = 1;; step++) {
+		unsigned int avail = bstr__group_free(m->ctrl + g * BSTR__GROUP);
+		if (avail)
+			return g * BSTR__GROUP + bstr__ctz(avail);
+		g = (g + step) & gmask;
+	}
+}
+
+static inline size_t bstr__map_bytes(int cap)
+{
+	return (size_t)cap * (sizeof(struct bstr_map_slot) + 1);
+}
+
+/* Move every entry into a fresh table of cap slots. Keys keep their cached hashes. */
+static inline int bstr__map_rehash(struct bstr_map *m, int cap)
+{
+	struct bstr_map old = *m;
+	void *block = bstr__malloc(m->ator, bstr__map_bytes(cap));
+
+	if (!block)
+		return BSTR_ERR;
+	m->slots = block;
+	m->ctrl = (unsigned char *)(m->slots + cap);
+	m->cap = cap;
+	m->growth = cap - cap / 8 - m->size;
+	memset(m->ctrl, BSTR__CTRL_EMPTY, cap);
+
+	for (int i = 0; old.slots && i < old.cap; i++) {
+		if (old.ctrl[i] & 0x80)
+			continue;
+		int j = bstr__map_free_slot(m, old.slots[i].key->hash);
+		m->ctrl[j] = old.ctrl[i];
+		m->slots[j] = old.slots[i];
+	}
+	if (old.slots)
+		bstr__free(m->ator, old.slots, bstr__map_bytes(old.cap));
+	return BSTR_OK;
+}
+
+static inline struct bstr_map *bstr_map_create_with(const struct bstr_allocator *a)
+{
+	if (!a)
+		return NULL;
+
+	struct bstr_map *m = bstr__malloc(a, sizeof(struct bstr_map));
+	if (!m)
+		return NULL;
+	m->slots = NULL;
+	m->size = 0;
+	m->ator = a;
+	if (bstr__map_rehash(m, BSTR__GROUP) != BSTR_OK) {
+		bstr__free(a, m, sizeof(struct bstr_map));
+		return NULL;
+	}
+	return m;
+}
+
+static inline struct bstr_map *bstr_map_create(void)
+{
+	return bstr_map_create_with(bstr__default_allocator);
+}
+
+/* Destroy m and its keys. Values are left to the caller. */
+static inline int bstr_map_destroy(struct bstr_map *m)
+{
+	if (!m || !m->slots)
+		return BSTR_ERR;
+	for (int i = 0; i < m->cap; i++)
+		if (!(m->ctrl[i] & 0x80))
+			bstr_destroy(m->slots[i].key);
+	bstr__free(m->ator, m->slots, bstr__map_bytes(m->cap));
+	m->slots = NULL;
+	bstr__free(m->ator, m, sizeof(struct bstr_map));
+	return BSTR_OK;
+}
+
+/*
+ * Slot holding the len bytes at blk, inserting a copy of them with a NULL
+ * value if absent. src, if not NULL, is a bstr with those contents; it is
+ * copied with bstr_copy_with so that a shared key is not duplicated.
+ */
+static inline int bstr__map_slot(struct bstr_map *m, const bstr src, const void *blk, bstr_len_t len,
+				 uint64_t h, int *added)
+{
+	int i = bstr__map_find(m, blk, len, h);
+
+	*added = 0;
+	if (i >= 0)
+		return i;
+
+	if (m->growth == 0) {
+		/* Grow, unless deletions left enough tombstones to reclaim */
+		int cap = m->size >= m->cap / 2 ? m->cap * 2 : m->cap;
+		if (cap <= 0 || bstr__map_rehash(m, cap) != BSTR_OK)
+			return BSTR_ERR;
+	}
+
+	bstr k = src ? bstr_copy_with(m->ator, src) : blk_to_bstr_with(m->ator, len ? blk : "", len);
+	if (!k)
+		return BSTR_ERR;
+	k->hash = h;
+	k->flags |= BSTR__F_HASHED;
+
+	i = bstr__map_free_slot(m, h);
+	if (m->ctrl[i] == BSTR__CTRL_EMPTY)
+		m->growth--;
+	m->ctrl[i] = bstr__h2(h);
+	m->slots[i].key = k;
+	m->slots[i].value = NULL;
+	m->size++;
+	*added = 1;
+	return i;
+}
+
+/* Map key to value, replacing any previous value. */
+static inline int bstr_map_put(struct bstr_map *m, const bstr key, void *value)
+{
+	int added;
+
+	if (!m || !key || !key->data || key->slen < 0)
+		return BSTR_ERR;
+
+	int i = bstr__map_slot(m, key, key->data, key->slen, bstr_hash(key), &added);
+	if (i < 0)
+		return BSTR_ERR;
+	m->slots[i].value = value;
+	return BSTR_OK;
+}
+
+/* bstr_map_put with the key given as raw bytes, which the map copies. */
+static inline int bstr_map_put_blk(struct bstr_map *m, const void *blk, bstr_len_t len, void *value)
+{
+	int added;
+
+	if (!m || len < 0 || (len && !blk))
+		return BSTR_ERR;
+
+	int i = bstr__map_slot(m, NULL, blk, len, bstr_hash_blk(blk, len, 0), &added);
+	if (i < 0)
+		return BSTR_ERR;
+	m->slots[i].value = value;
+	return BSTR_OK;
+}
+
+static inline int bstr_map_put_view(struct bstr_map *m, bstr_view key, void *value)
+{
+	return bstr_map_put_blk(m, key.data, key.slen, value);
+}
+
+/*
+ * Lookups return the address of the value stored for the key, which
+ * stays valid until the map is next modified, or NULL if it is absent.
+ * The _blk and _view forms take the key as raw bytes, so looking up a
+ * string that is not already a bstr needs no allocation.
+ */
+static inline void **bstr_map_get_blk(const struct bstr_map *m, const void *blk, bstr_len_t len)
+{
+	if (!m || len < 0 || (len && !blk))
+		return NULL;
+
+	int i = bstr__map_find(m, blk, len, bstr_hash_blk(blk, len, 0));
+	return i >= 0 ? &m->slots[i].value : NULL;
+}
+
+static inline void **bstr_map_get(const struct bstr_map *m, const bstr key)
+{
+	if (!m || !key || !key->data || key->slen < 0)
+		return NULL;
+
+	int i = bstr__map_find(m, key->data, key->slen, bstr_hash(key));
+	return i >= 0 ? &m->slots[i].value : NULL;
+}
+
+static inline void **bstr_map_get_view(const struct bstr_map *m, bstr_view key)
+{
+	return bstr_map_get_blk(m, key.data, key.slen);
+}
+
+static inline int bstr__map_erase(struct bstr_map *m, int i)
+{
+	if (i < 0)
+		return BSTR_ERR;
+
+	/* No probe can have passed through a group that still has an empty slot */
+	if (bstr__group_match(m->ctrl + (i & ~(BSTR__GROUP - 1)), BSTR__CTRL_EMPTY)) {
+		m->ctrl[i] = BSTR__CTRL_EMPTY;
+		m->growth++;
+	} else {
+		m->ctrl[i] = BSTR__CTRL_DELETED;
+	}
+	bstr_destroy(m->slots[i].key);
+	m->size--;
+	return BSTR_OK;
+}
+
+static inline int bstr_map_remove_blk(struct bstr_map *m, const void *blk, bstr_len_t len)
+{
+	if (!m || len < 0 || (len && !blk))
+		return BSTR_ERR;
+	return bstr__map_erase(m, bstr__map_find(m, blk, len, bstr_hash_blk(blk, len, 0)));
+}
+
+/* Remove key; BSTR_ERR if it was not present. */
+static inline int bstr_map_remove(struct bstr_map *m, const bstr key)
+{
+	if (!m || !key || !key->data || key->slen < 0)
+		return BSTR_ERR;
+	return bstr__map_erase(m, bstr__map_find(m, key->data, key->slen, bstr_hash(key)));
+}
+
+static inline int bstr_map_remove_view(struct bstr_map *m, bstr_view key)
+{
+	return bstr_map_remove_blk(m, key.data, key.slen);
+}
+
+/* Call callback for every entry, in no particular order, until it fails. */
+static inline int bstr_map_foreach(const struct bstr_map *m,
+				   int (*callback)(void *parm, const bstr key, void *value), void *parm)
+{
+	if (!m || !callback)
+		return BSTR_ERR;
+	for (int i = 0; i < m->cap; i++)
+		if (!(m->ctrl[i] & 0x80) && callback(parm, m->slots[i].key, m->slots[i].value) < 0)
+			return BSTR_ERR;
+	return BSTR_OK;
+}
+
+static inline struct bstr_set *bstr_set_create_with(const struct bstr_allocator *a)
+{
+	return (struct bstr_set *)bstr_map_create_with(a);
+}
+
+static inline struct bstr_set *bstr_set_create(void)
+{
+	return bstr_set_create_with(bstr__default_allocator);
+}
+
+static inline int bstr_set_destroy(struct bstr_set *s)
+{
+	return bstr_map_destroy(s ? &s->map : NULL);
+}
+
+/* 1 if key was added, 0 if it was already present. */
+static inline int bstr_set_add(struct bstr_set *s, const bstr key)
+{
+	int added;
+
+	if (!s || !key || !key->data || key->slen < 0)
+		return BSTR_ERR;
+	if (bstr__map_slot(&s->map, key, key->data, key->slen, bstr_hash(key), &added) < 0)
+		return BSTR_ERR;
+	return added;
+}
+
+static inline int bstr_set_has(const struct bstr_set *s, const bstr key)
+{
+	return s && bstr_map_get(&s->map, key) != NULL;
+}
+
+static inline int bstr_set_has_blk(const struct bstr_set *s, const void *blk, bstr_len_t len)
+{
+	return s && bstr_map_get_blk(&s->map, blk, len) != NULL;
+}
+
+static inline int bstr_set_remove(struct bstr_set *s, const bstr key)
+{
+	return bstr_map_remove(s ? &s->map : NULL, key);
+}
+
+#ifdef BSTR_HAVE_INTERN
+#define BSTR__INTERN_MIN_CAP 64
+
+static inline size_t bstr__intern_table_bytes(int cap)
+{
+	return offsetof(struct bstr_intern_table, slots) + (size_t)cap * sizeof(bstr);
+}
+
+static inline struct bstr_intern_table *bstr__intern_table_new(const struct bstr_allocator *a, int cap)
+{
+	struct bstr_intern_table *t = bstr__malloc(a, bstr__intern_table_bytes(cap));
+
+	if (t) {
+		t->retired = NULL;
+		t->cap = cap;
+		memset(t->slots, 0, (size_t)cap * sizeof(bstr));
+	}
+	return t;
+}
+
+static inline struct bstr_intern *bstr_intern_create(void)
+{
+	const struct bstr_allocator *a = bstr__default_allocator;
+	struct bstr_intern *in = bstr__malloc(a, sizeof(struct bstr_intern));
+
+	if (!in)
+		return NULL;
+	in->ator = a;
+	for (int i = 0; i < BSTR_INTERN_SHARDS; i++) {
+		struct bstr_intern_shard *s = &in->shards[i];
+		s->table = bstr__intern_table_new(a, BSTR__INTERN_MIN_CAP);
+		if (!s->table || pthread_mutex_init(&s->lock, NULL) != 0) {
+			if (s->table)
+				bstr__free(a, s->table, bstr__intern_table_bytes(BSTR__INTERN_MIN_CAP));
+			while (i--) {
+				pthread_mutex_destroy(&in->shards[i].lock);
+				bstr__free(a, in->shards[i].table, bstr__intern_table_bytes(BSTR__INTERN_MIN_CAP));
+			}
+			bstr__free(a, in, sizeof(struct bstr_intern));
+			return NULL;
+		}
+		s->count = 0;
+		s->bytes = 0;
+		s->table_bytes = bstr__intern_table_bytes(BSTR__INTERN_MIN_CAP);
+	}
+	return in;
+}
+
+/* Free the pool and every string it handed out. No thread may still be using it. */
+static inline int bstr_intern_destroy(struct bstr_intern *in)
+{
+	if (!in)
+		return BSTR_ERR;
+
+	for (int i = 0; i < BSTR_INTERN_SHARDS; i++) {
+		struct bstr_intern_shard *s = &in->shards[i];
+		struct bstr_intern_table *t = s->table;
+		for (int j = 0; j < t->cap; j++) {
+			if (t->slots[j]) {
+				t->slots[j]->flags &= ~BSTR__F_RDONLY;
+				bstr_destroy(t->slots[j]);
+			}
+		}
+		while (t) {
+			struct bstr_intern_table *next = t->retired;
+			bstr__free(in->ator, t, bstr__intern_table_bytes(t->cap));
+			t = next;
+		}
+		pthread_mutex_destroy(&s->lock);
+	}
+	bstr__free(in->ator, in, sizeof(struct bstr_intern));
+	return BSTR_OK;
+}
+
+/* Lock-free probe of one table. Slots only ever go from NULL to a string. */
+static inline bstr bstr__intern_find(const struct bstr_intern_table *t, const unsigned char *p,
+				     bstr_len_t len, uint64_t h)
+{
+	int mask = t->cap - 1;
+
+	for (int i = (int)(h & (uint64_t)mask);; i = (i + 1) & mask) {
+		bstr s = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE);
+		if (!s)
+			return NULL;
+		if (s->hash == h && s->slen == len && memcmp(s->data, p, len) == 0)
+			return s;
+	}
+}
+
+static inline void bstr__intern_place(struct bstr_intern_table *t, bstr s)
+{
+	int mask = t->cap - 1;
+	int i = (int)(s->hash & (uint64_t)mask);
+
+	while (t->slots[i])
+		i = (i + 1) & mask;
+	__atomic_store_n(&t->slots[i], s, __ATOMIC_RELEASE);
+}
+
+/*
+ * Canonical copy of the len bytes at blk, created on first use. The
+ * result is read-only: mutators and bstr_destroy reject it. Safe to call
+ * from any number of threads at once.
+ */
+static inline bstr bstr_intern_blk(struct bstr_intern *in, const void *blk, bstr_len_t len)
+{
+	if (!in || len < 0 || (len && !blk))
+		return NULL;
+
+	const unsigned char *p = len ? blk : (const unsigned char *)"";
+	uint64_t h = bstr_hash_blk(p, len, 0);
+	/* Split in two so that a single shard does not shift by 64 */
+	struct bstr_intern_shard *s = &in->shards[h >> 1 >> (63 - BSTR__INTERN_SHARD_BITS)];
+
+	bstr found = bstr__intern_find(__atomic_load_n(&s->table, __ATOMIC_ACQUIRE), p, len, h);
+	if (found)
+		return found;
+
+	pthread_mutex_lock(&s->lock);
+	struct bstr_intern_table *t = s->table;
+	found = bstr__intern_find(t, p, len, h);
+	if (found)
+		goto out;
+
+	/* Keep tables at most 3/4 full so probes stay short and always end */
+	if (4 * (s->count + 1) > 3 * (size_t)t->cap) {
+		struct bstr_intern_table *nt = bstr__intern_table_new(in->ator, t->cap * 2);
+		if (!nt)
+			goto out;
+		for (int i = 0; i < t->cap; i++)
+			if (t->slots[i])
+				bstr__intern_place(nt, t->slots[i]);
+		nt->retired = t;
+		s->table_bytes += bstr__intern_table_bytes(nt->cap);
+		__atomic_store_n(&s->table, nt, __ATOMIC_RELEASE);
+		t = nt;
+	}
+
+	found = blk_to_bstr_with(in->ator, p, len);
+	if (!found)
+		goto out;
+	found->hash = h;
+	found->flags |= BSTR__F_HASHED | BSTR__F_RDONLY;
+	bstr__intern_place(t, found);
+	s->count++;
+	s->bytes += BSTR__HDR_SIZE + found->icap;
+out:
+	pthread_mutex_unlock(&s->lock);
+	return found;
+}
+
+static inline bstr bstr_intern_cstr(struct bstr_intern *in, const char *str)
+{
+	if (!str)
+		return NULL;
+
+	size_t len = strlen(str);
+	if (len > (size_t)BSTR_LEN_MAX - 2)
+		return NULL;
+	return bstr_intern_blk(in, str, (bstr_len_t)len);
+}
+
+static inline bstr bstr_intern(struct bstr_intern *in, const bstr b)
+{
+	if (!b || !b->data || b->slen < 0)
+		return NULL;
+	return bstr_intern_blk(in, b->data, b->slen);
+}
+
+/* Memory held by the pool, summed over its shards. */
+static inline void bstr_intern_stats(struct bstr_intern *in, struct bstr_intern_stats *stats)
+{
+	if (!stats)
+		return;
+	memset(stats, 0, sizeof(*stats));
+	if (!in)
+		return;
+	for (int i = 0; i < BSTR_INTERN_SHARDS; i++) {
+		struct bstr_intern_shard *s = &in->shards[i];
+		pthread_mutex_lock(&s->lock);
+		stats->strings += s->count;
+		stats->string_bytes += s->bytes;
+		stats->table_bytes += s->table_bytes;
+		pthread_mutex_unlock(&s->lock);
+	}
+	stats->table_bytes += sizeof(struct bstr_intern);
+}
+#endif /* BSTR_HAVE_INTERN */
+
+#define bstr__view_ok(v) ((v).slen >= 0 && ((v).data || (v).slen == 0))
+
+/* View of all of b; an invalid b gives a view with slen -1. */
+static inline bstr_view bstr_view_of(const bstr b)
+{
+	bstr_view v = { NULL, -1 };
+
+	if (b && b->data && b->slen >= 0) {
+		v.data = b->data;
+		v.slen = b->slen;
+	}
+	return v;
+}
+
+/* Like bstr_mid, but without copying: the range is clamped to b. */
+static inline bstr_view bstr_view_mid(const bstr b, bstr_len_t left, bstr_len_t len)
+{
+	bstr_view v = bstr_view_of(b);
+
+	if (v.slen < 0)
+		return v;
+	if (left < 0) {
+		len += left;
+		left = 0;
+	}
+	if (len > v.slen - left)
+		len = v.slen - left;
+	if (len < 0)
+		len = 0;
+	v.data += left < v.slen ? left : v.slen;
+	v.slen = len;
+	return v;
+}
+
+static inline bstr_view bstr_view_blk(const void *blk, bstr_len_t len)
+{
+	bstr_view v = { NULL, -1 };
+
+	if (len >= 0 && (blk || len == 0)) {
+		v.data = blk;
+		v.slen = len;
+	}
+	return v;
+}
+
+/* Copy the bytes of v into a new bstr. */
+static inline bstr bstr_from_view(bstr_view v)
+{
+	if (!bstr__view_ok(v))
+		return NULL;
+	return blk_to_bstr(v.data ? (const void *)v.data : "", v.slen);
+}
+
+/* Bytewise comparison; shorter views order first. */
+static inline int bstr_view_cmp(bstr_view v0, bstr_view v1)
+{
+	if (!bstr__view_ok(v0) || !bstr__view_ok(v1))
+		return SHRT_MIN;
+
+	bstr_len_t n = (v0.slen < v1.slen) ? v0.slen : v1.slen;
+	int v = bstr__blk_cmp(v0.data, v1.data, n);
+	if (v != 0) return v;
+
+	return (v0.slen > v1.slen) - (v1.slen > v0.slen);
+}
+
+/* Offset of v2 in v1 at or after pos, or BSTR_ERR. An empty v2 matches at pos. */
+static inline bstr_len_t bstr_view_find(bstr_view v1, bstr_len_t pos, bstr_view v2)
+{
+	if (!bstr__view_ok(v1) || !bstr__view_ok(v2) || pos < 0 || pos > v1.slen)
+		return BSTR_ERR;
+	if (v2.slen == 0)
+		return pos;
+	return bstr__find_blk(v1.data, v1.slen, pos, v2.data, v2.slen);
+}
+
+static inline bstr_len_t bstr_view_spn(bstr_view v, bstr_view accept)
+{
+	if (!bstr__view_ok(v) || !bstr__view_ok(accept))
+		return BSTR_ERR;
+	if (v.slen == 0)
+		return 0;
+
+	struct bstr_charset cs;
+	bstr_charset_init_blk(&cs, accept.data, accept.slen);
+	return bstr__charset_span(&cs, v.data, 0, v.slen, 1);
+}
+
+static inline bstr_len_t bstr_view_cspn(bstr_view v, bstr_view reject)
+{
+	if (!bstr__view_ok(v) || !bstr__view_ok(reject))
+		return BSTR_ERR;
+	if (v.slen == 0)
+		return 0;
+
+	struct bstr_charset cs;
+	bstr_charset_init_blk(&cs, reject.data, reject.slen);
+	return bstr__charset_span(&cs, v.data, 0, v.slen, 0);
+}
+
+/*
+ * Parse all of v as a decimal integer with an optional sign. Fails on
+ * empty input, stray characters and overflow, leaving *out untouched.
+ */
+static inline int bstr_view_to_long(bstr_view v, long *out)
+{
+	if (!bstr__view_ok(v) || !out || v.slen == 0)
+		return BSTR_ERR;
+
+	bstr_len_t i = 0;
+	int neg = 0;
+	if (v.data[0] == '+' || v.data[0] == '-') {
+		neg = v.data[0] == '-';
+		i = 1;
+	}
+	if (i == v.slen)
+		return BSTR_ERR;
+
+	/* Accumulate negatively so LONG_MIN is representable */
+	long x = 0;
+	for (; i < v.slen; i++) {
+		int d = v.data[i] - '0';
+		if (d < 0 || d > 9)
+			return BSTR_ERR;
+		if (x < (LONG_MIN + d) / 10)
+			return BSTR_ERR;
+		x = x * 10 - d;
+	}
+	if (!neg) {
+		if (x == LONG_MIN)
+			return BSTR_ERR;
+		x = -x;
+	}
+	*out = x;
+	return BSTR_OK;
+}
+
+/* Parse all of v as a floating point number in strtod syntax. */
+static inline int bstr_view_to_double(bstr_view v, double *out)
+{
+	if (!bstr__view_ok(v) || !out || v.slen == 0 || isspace(v.data[0]))
+		return BSTR_ERR;
+
+	/* strtod needs a terminator; copy short inputs to the stack */
+	char stack[64];
+	char *s = stack;
+	if (v.slen >= (int)sizeof(stack)) {
+		s = bstr__malloc(bstr__default_allocator, (size_t)v.slen + 1);
+		if (!s)
+			return BSTR_ERR;
+	}
+	memcpy(s, v.data, v.slen);
+	s[v.slen] = '\0';
+
+	char *end;
+	double x = strtod(s, &end);
+	int ret = (end == s + v.slen) ? BSTR_OK : BSTR_ERR;
+	if (s != stack)
+		bstr__free(bstr__default_allocator, s, (size_t)v.slen + 1);
+	if (ret == BSTR_OK)
+		*out = x;
+	return ret;
+}
+
+struct gen_view_list {
+	struct bstr_view_list *	vl;
+	const unsigned char *	data;
+};
+
+static inline int bstr__view_list_callback(void *parm, bstr_len_t ofs, bstr_len_t len)
+{
+	struct gen_view_list *g = parm;
+
+	g->vl->entry[g->vl->qty].data = g->data + ofs;
+	g->vl->entry[g->vl->qty].slen = len;
+	g->vl->qty++;
+	return BSTR_OK;
+}
+
+/*
+ * Split str on split_char into views of str. The delimiters are counted
+ * first so the list and all of its entries come from one allocation.
+ */
+static inline struct bstr_view_list *bstr_split_view(const bstr str, unsigned char split_char)
+{
+	bstr_len_t n = bstr_split_offsets(str, split_char, 0, NULL, 0);
+
+	if (n < 0)
+		return NULL;
+
+	const struct bstr_allocator *a = bstr__default_allocator;
+	size_t size = offsetof(struct bstr_view_list, entry) + ((size_t)n + 1) * sizeof(bstr_view);
+	struct gen_view_list g;
+
+	g.vl = bstr__malloc(a, size);
+	if (!g.vl)
+		return NULL;
+	g.vl->qty = 0;
+	g.vl->ator = a;
+	g.data = str->data;
+
+	bstr_split_cb(str, split_char, 0, bstr__view_list_callback, &g);
+	return g.vl;
+}
+
+static inline int bstr_view_list_destroy(struct bstr_view_list *list)
+{
+	if (!list || list->qty < 0)
+		return BSTR_ERR;
+
+	size_t size = offsetof(struct bstr_view_list, entry) + (size_t)list->qty * sizeof(bstr_view);
+	list->qty = -1;
+	bstr__free(list->ator, list, size);
+	return BSTR_OK;
+}
+
+static inline size_t bstr__packed_size(int qty, bstr_len_t blen)
+{
+	return offsetof(struct bstr_packed_list, ofs) + ((size_t)qty + 1) * sizeof(bstr_len_t) + (size_t)blen;
+}
+
+/* Allocate a packed list for qty entries holding blen bytes in total. */
+static inline struct bstr_packed_list *bstr__packed_new(const struct bstr_allocator *a, int qty, bstr_len_t blen)
+{
+	struct bstr_packed_list *pl = bstr__malloc(a, bstr__packed_size(qty, blen));
+
+	if (pl) {
+		pl->qty = qty;
+		pl->blen = blen;
+		pl->ator = a;
+		pl->blob = (unsigned char *)(pl->ofs + qty + 1);
+		pl->ofs[qty] = blen;
+	}
+	return pl;
+}
+
+struct gen_packed_list {
+	struct bstr_packed_list *	pl;
+	const unsigned char *		data;
+	int				n;
+	bstr_len_t			pos;
+};
+
+static inline int bstr__packed_callback(void *parm, bstr_len_t ofs, bstr_len_t len)
+{
+	struct gen_packed_list *g = parm;
+
+	g->pl->ofs[g->n++] = g->pos;
+	memcpy(g->pl->blob + g->pos, g->data + ofs, len);
+	g->pos += len;
+	g->pl->blob[g->pos++] = '\0';
+	return BSTR_OK;
+}
+
+/*
+ * Split str on split_char into a packed list. A counting pass sizes the
+ * result exactly: n delimiters give n + 1 entries whose bytes and NULs
+ * add up to the length of str plus one.
+ */
+static inline struct bstr_packed_list *bstr_packed_split(const bstr str, unsigned char split_char)
+{
+	bstr_len_t n = bstr_split_offsets(str, split_char, 0, NULL, 0);
+
+	if (n < 0 || n >= INT_MAX || str->slen == BSTR_LEN_MAX)
+		return NULL;
+
+	struct gen_packed_list g;
+	g.pl = bstr__packed_new(bstr__default_allocator, (int)n + 1, str->slen + 1);
+	if (!g.pl)
+		return NULL;
+	g.data = str->data;
+	g.n = 0;
+	g.pos = 0;
+
+	bstr_split_cb(str, split_char, 0, bstr__packed_callback, &g);
+	return g.pl;
+}
+
+/* Pack the entries of list into a single block. */
+static inline struct bstr_packed_list *bstr_packed_from_list(const struct bstr_list *list)
+{
+	if (!list || list->qty < 0)
+		return NULL;
+
+	bstr_len_t blen = 0;
+	for (int i = 0; i < list->qty; i++) {
+		bstr b = list->entry[i];
+		if (!b || !b->data || b->slen < 0 || b->slen >= BSTR_LEN_MAX - blen)
+			return NULL;
+		blen += b->slen + 1;
+	}
+
+	struct gen_packed_list g;
+	g.pl = bstr__packed_new(list->ator, list->qty, blen);
+	if (!g.pl)
+		return NULL;
+	g.n = 0;
+	g.pos = 0;
+	for (int i = 0; i < list->qty; i++) {
+		g.data = list->entry[i]->data;
+		bstr__packed_callback(&g, 0, list->entry[i]->slen);
+	}
+	return g.pl;
+}
+
+/* Entry i of pl, or an invalid view if i is out of range. */
+static inline bstr_view bstr_packed_view(const struct bstr_packed_list *pl, int i)
+{
+	bstr_view v = { NULL, -1 };
+
+	if (pl && i >= 0 && i < pl->qty) {
+		v.data = pl->blob + pl->ofs[i];
+		v.slen = pl->ofs[i + 1] - pl->ofs[i] - 1;
+	}
+	return v;
+}
+
+/* Copy the entries of pl out into an exactly sized bstr_list. */
+static inline struct bstr_list *bstr_packed_to_list(const struct bstr_packed_list *pl)
+{
+	if (!pl || pl->qty < 0)
+		return NULL;
+
+	struct bstr_list *list = bstr__list_new(pl->ator, pl->qty ? pl->qty : 1);
+	if (!list)
+		return NULL;
+
+	for (int i = 0; i < pl->qty; i++) {
+		bstr_view v = bstr_packed_view(pl, i);
+		bstr b = blk_to_bstr_with(pl->ator, v.data, v.slen);
+		if (!b) {
+			bstr_list_destroy(list);
+			return NULL;
+		}
+		list->entry[list->qty++] = b;
+	}
+	return list;
+}
+
+/* Release a packed list and all of its entries with a single free. */
+static inline int bstr_packed_destroy(struct bstr_packed_list *pl)
+{
+	if (!pl || pl->qty < 0)
+		return BSTR_ERR;
+
+	size_t size = bstr__packed_size(pl->qty, pl->blen);
+	pl->qty = -1;
+	bstr__free(pl->ator, pl, size);
+	return BSTR_OK;
+}
+
+#define bstr__rope_size(n) ((n) ? (n)->size : 0)
+
+static inline void bstr__rope_update(struct bstr_rope_node *n)
+{
+	n->size = bstr__rope_size(n->left) + n->len + bstr__rope_size(n->right);
+}
+
+static inline size_t bstr__rope_node_bytes(int cap)
+{
+	return offsetof(struct bstr_rope_node, data) + (size_t)cap;
+}
+
+/* A node with room for cap bytes, none of them live yet. */
+static inline struct bstr_rope_node *bstr__rope_node_new(struct bstr_rope *r, int cap, int off)
+{
+	struct bstr_rope_node *n = bstr__malloc(r->ator, bstr__rope_node_bytes(cap));
+
+	if (n) {
+		/* xorshift32 */
+		r->seed ^= r->seed << 13;
+		r->seed ^= r->seed >> 17;
+		r->seed ^= r->seed << 5;
+		n->left = n->right = NULL;
+		n->prio = r->seed;
+		n->off = off;
+		n->len = 0;
+		n->cap = cap;
+		n->size = 0;
+	}
+	return n;
+}
+
+static inline void bstr__rope_free(struct bstr_rope *r, struct bstr_rope_node *n)
+{
+	if (n) {
+		bstr__rope_free(r, n->left);
+		bstr__rope_free(r, n->right);
+		bstr__free(r->ator, n, bstr__rope_node_bytes(n->cap));
+	}
+}
+
+static inline struct bstr_rope_node *bstr__rope_merge(struct bstr_rope_node *a, struct bstr_rope_node *b)
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+	if (a->prio > b->prio) {
+		a->right = bstr__rope_merge(a->right, b);
+		bstr__rope_update(a);
+		return a;
+	}
+	b->left = bstr__rope_merge(a, b->left);
+	bstr__rope_update(b);
+	return b;
+}
+
+/*
+ * Split t into its first pos bytes and the rest. A chunk straddling pos
+ * is cut in two, with the second half moved into *spare, which the
+ * caller allocated beforehand so that splitting cannot fail.
+ */
+static inline void bstr__rope_split(struct bstr_rope_node *t, bstr_len_t pos, struct bstr_rope_node **spare,
+				    struct bstr_rope_node **l, struct bstr_rope_node **r)
+{
+	if (!t) {
+		*l = *r = NULL;
+		return;
+	}
+
+	bstr_len_t lsize = bstr__rope_size(t->left);
+	if (pos <= lsize) {
+		bstr__rope_split(t->left, pos, spare, l, &t->left);
+		bstr__rope_update(t);
+		*r = t;
+	} else if (pos >= lsize + t->len) {
+		bstr__rope_split(t->right, pos - lsize - t->len, spare, &t->right, r);
+		bstr__rope_update(t);
+		*l = t;
+	} else {
+		struct bstr_rope_node *n = *spare;
+		int k = (int)(pos - lsize);
+		*spare = NULL;
+		n->len = t->len - k;
+		memcpy(n->data, t->data + t->off + k, n->len);
+		bstr__rope_update(n);
+		t->len = k;
+		struct bstr_rope_node *right = t->right;
+		t->right = NULL;
+		bstr__rope_update(t);
+		*l = t;
+		*r = bstr__rope_merge(n, right);
+	}
+}
+
+/* Drop the cached flat copy once the contents change */
+static inline void bstr__rope_touch(struct bstr_rope *r)
+{
+	if (r->flat) {
+		r->flat->flags &= ~BSTR__F_RDONLY;
+		bstr_destroy(r->flat);
+		r->flat = NULL;
+	}
+}
+
+static inline struct bstr_rope *bstr_rope_create(void)
+{
+	const struct bstr_allocator *a = bstr__default_allocator;
+	struct bstr_rope *r = bstr__malloc(a, sizeof(struct bstr_rope));
+
+	if (r) {
+		r->root = r->head = r->tail = NULL;
+		r->len = 0;
+		r->seed = 0x9e3779b9u ^ (unsigned int)(uintptr_t)r;
+		if (!r->seed)
+			r->seed = 1;
+		r->flat = NULL;
+		r->ator = a;
+	}
+	return r;
+}
+
+static inline int bstr_rope_destroy(struct bstr_rope *r)
+{
+	if (!r)
+		return BSTR_ERR;
+	bstr__rope_touch(r);
+	bstr__rope_free(r, r->root);
+	bstr__rope_free(r, r->head);
+	bstr__rope_free(r, r->tail);
+	bstr__free(r->ator, r, sizeof(struct bstr_rope));
+	return BSTR_OK;
+}
+
+static inline bstr_len_t bstr_rope_len(const struct bstr_rope *r)
+{
+	return r ? r->len : BSTR_ERR;
+}
+
+/*
+ * Allocate enough chunks, chained through their right links, to hold len
+ * bytes beyond the room already free at the end being extended. On
+ * failure nothing stays allocated, so the caller can leave the rope as
+ * it was.
+ */
+static inline int bstr__rope_reserve(struct bstr_rope *r, bstr_len_t room, bstr_len_t len, int off,
+				     struct bstr_rope_node **chain)
+{
+	*chain = NULL;
+	for (; room < len; room += BSTR_ROPE_CHUNK) {
+		struct bstr_rope_node *n = bstr__rope_node_new(r, BSTR_ROPE_CHUNK, off);
+		if (!n) {
+			while ((n = *chain)) {
+				*chain = n->right;
+				bstr__free(r->ator, n, bstr__rope_node_bytes(n->cap));
+			}
+			return BSTR_ERR;
+		}
+		n->right = *chain;
+		*chain = n;
+	}
+	return BSTR_OK;
+}
+
+static inline int bstr_rope_append_blk(struct bstr_rope *r, const void *blk, bstr_len_t len)
+{
+	const unsigned char *p = blk;
+	struct bstr_rope_node *chain;
+
+	if (!r || len < 0 || (len && !blk) || len > BSTR_LEN_MAX - 1 - r->len)
+		return BSTR_ERR;
+	if (bstr__rope_reserve(r, r->tail ? r->tail->cap - r->tail->len : 0, len, 0, &chain) != BSTR_OK)
+		return BSTR_ERR;
+	bstr__rope_touch(r);
+
+	while (len > 0) {
+		if (!r->tail) {
+			r->tail = chain;
+			chain = chain->right;
+			r->tail->right = NULL;
+		}
+		struct bstr_rope_node *t = r->tail;
+		int n = t->cap - t->len;
+		if (n > len)
+			n = (int)len;
+		memcpy(t->data + t->len, p, n);
+		t->len += n;
+		r->len += n;
+		p += n;
+		len -= n;
+		if (t->len == t->cap) {
+			bstr__rope_update(t);
+			r->root = bstr__rope_merge(r->root, t);
+			r->tail = NULL;
+		}
+	}
+	return BSTR_OK;
+}
+
+static inline int bstr_rope_append(struct bstr_rope *r, const bstr b)
+{
+	if (!b || !b->data || b->slen < 0)
+		return BSTR_ERR;
+	return bstr_rope_append_blk(r, b->data, b->slen);
+}
+
+static inline int bstr_rope_prepend_blk(struct bstr_rope *r, const void *blk, bstr_len_t len)
+{
+	const unsigned char *p = blk;
+	struct bstr_rope_node *chain;
+
+	if (!r || len < 0 || (len && !blk) || len > BSTR_LEN_MAX - 1 - r->len)
+		return BSTR_ERR;
+	if (bstr__rope_reserve(r, r->head ? r->head->off : 0, len, BSTR_ROPE_CHUNK, &chain) != BSTR_OK)
+		return BSTR_ERR;
+	bstr__rope_touch(r);
+
+	while (len > 0) {
+		if (!r->head) {
+			r->head = chain;
+			chain = chain->right;
+			r->head->right = NULL;
+		}
+		struct bstr_rope_node *h = r->head;
+		int n = h->off < len ? h->off : (int)len;
+		h->off -= n;
+		h->len += n;
+		memcpy(h->data + h->off, p + len - n, n);
+		r->len += n;
+		len -= n;
+		if (h->off == 0) {
+			bstr__rope_update(h);
+			r->root = bstr__rope_merge(h, r->root);
+			r->head = NULL;
+		}
+	}
+	return BSTR_OK;
+}
+
+static inline int bstr_rope_prepend(struct bstr_rope *r, const bstr b)
+{
+	if (!b || !b->data || b->slen < 0)
+		return BSTR_ERR;
+	return bstr_rope_prepend_blk(r, b->data, b->slen);
+}
+
+/* Bytes after pos in the chunk that straddles it, 0 if pos falls between chunks. */
+static inline int bstr__rope_cut(const struct bstr_rope_node *t, bstr_len_t pos)
+{
+	while (t) {
+		bstr_len_t lsize = bstr__rope_size(t->left);
+		if (pos <= lsize) {
+			t = t->left;
+		} else if (pos >= lsize + t->len) {
+			pos -= lsize + t->len;
+			t = t->right;
+		} else {
+			return t->len - (int)(pos - lsize);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Insert n bytes at pos into the chunk that holds or ends at pos, if it
+ * has room or can grow to make room without exceeding BSTR_ROPE_CHUNK.
+ * Chunks grow geometrically, so a run of small inserts at one spot
+ * fills a single chunk instead of adding one each. Returns 0, with the
+ * contents unchanged, if the bytes do not fit.
+ */
+static inline int bstr__rope_insert_leaf(struct bstr_rope *r, struct bstr_rope_node **tp, bstr_len_t pos,
+					 const unsigned char *p, int n)
+{
+	struct bstr_rope_node *t = *tp;
+	bstr_len_t lsize = bstr__rope_size(t->left);
+
+	/* At a chunk boundary, extend the chunk before it, as typing does */
+	if (pos <= lsize && t->left) {
+		if (!bstr__rope_insert_leaf(r, &t->left, pos, p, n))
+			return 0;
+	} else if (pos > lsize + t->len) {
+		if (!bstr__rope_insert_leaf(r, &t->right, pos - lsize - t->len, p, n))
+			return 0;
+	} else {
+		int k = (int)(pos - lsize);
+
+		if (t->cap - t->len < n) {
+			if (t->len > BSTR_ROPE_CHUNK - n)
+				return 0;
+			int cap = (int)snap_up_size(t->len + n);
+			if (cap > BSTR_ROPE_CHUNK)
+				cap = BSTR_ROPE_CHUNK;
+			memmove(t->data, t->data + t->off, t->len);
+			t->off = 0;
+			struct bstr_rope_node *x = bstr__realloc(r->ator, t, bstr__rope_node_bytes(t->cap),
+								 bstr__rope_node_bytes(cap));
+			if (!x)
+				return 0;
+			*tp = t = x;
+			t->cap = cap;
+		}
+		if (t->off >= n) {
+			memmove(t->data + t->off - n, t->data + t->off, k);
+			t->off -= n;
+		} else {
+			if (t->off + t->len + n > t->cap) {
+				memmove(t->data, t->data + t->off, t->len);
+				t->off = 0;
+			}
+			memmove(t->data + t->off + k + n, t->data + t->off + k, t->len - k);
+		}
+		memcpy(t->data + t->off + k, p, n);
+		t->len += n;
+	}
+	t->size += n;
+	return 1;
+}
+
+/* Insert len bytes so that they start at offset pos. */
+static inline int bstr_rope_insert_blk(struct bstr_rope *r, bstr_len_t pos, const void *blk, bstr_len_t len)
+{
+	const unsigned char *p = blk;
+
+	if (!r || pos < 0 || pos > r->len || len < 0 || (len && !blk) || len > BSTR_LEN_MAX - 1 - r->len)
+		return BSTR_ERR;
+	if (pos == 0)
+		return bstr_rope_prepend_blk(r, blk, len);
+	if (pos == r->len)
+		return bstr_rope_append_blk(r, blk, len);
+
+	/* Fold the head and tail chunks in so the tree holds everything */
+	if (r->head) {
+		bstr__rope_update(r->head);
+		r->root = bstr__rope_merge(r->head, r->root);
+		r->head = NULL;
+	}
+	if (r->tail) {
+		bstr__rope_update(r->tail);
+		r->root = bstr__rope_merge(r->root, r->tail);
+		r->tail = NULL;
+	}
+
+	if (len <= BSTR_ROPE_CHUNK && bstr__rope_insert_leaf(r, &r->root, pos, p, (int)len)) {
+		bstr__rope_touch(r);
+		r->len += len;
+		return BSTR_OK;
+	}
+
+	/*
+	 * Allocate every node up front, each sized to its contents, so that
+	 * nothing fails halfway. The spare is only needed if pos splits a chunk.
+	 */
+	struct bstr_rope_node *mid = NULL;
+	struct bstr_rope_node *spare = NULL;
+	int cut = bstr__rope_cut(r->root, pos);
+	if (cut && !(spare = bstr__rope_node_new(r, cut, 0)))
+		return BSTR_ERR;
+	for (bstr_len_t done = 0; done < len;) {
+		int size = len - done < BSTR_ROPE_CHUNK ? (int)(len - done) : BSTR_ROPE_CHUNK;
+		struct bstr_rope_node *n = bstr__rope_node_new(r, size, 0);
+		if (!n) {
+			bstr__rope_free(r, mid);
+			bstr__rope_free(r, spare);
+			return BSTR_ERR;
+		}
+		n->len = size;
+		memcpy(n->data, p + done, size);
+		done += size;
+		bstr__rope_update(n);
+		mid = bstr__rope_merge(mid, n);
+	}
+	bstr__rope_touch(r);
+
+	struct bstr_rope_node *left, *right;
+	bstr__rope_split(r->root, pos, &spare, &left, &right);
+	r->root = bstr__rope_merge(bstr__rope_merge(left, mid), right);
+	r->len += len;
+	if (spare)
+		bstr__rope_free(r, spare);
+	return BSTR_OK;
+}
+
+static inline int bstr_rope_insert(struct bstr_rope *r, bstr_len_t pos, const bstr b)
+{
+	if (!b || !b->data || b->slen < 0)
+		return BSTR_ERR;
+	return bstr_rope_insert_blk(r, pos, b->data, b->slen);
+}
+
+static inline int bstr__rope_walk(const struct bstr_rope_node *n,
+				  int (*callback)(void *parm, const void *blk, bstr_len_t len), void *parm)
+{
+	if (!n)
+		return BSTR_OK;
+	if (bstr__rope_walk(n->left, callback, parm) < 0)
+		return BSTR_ERR;
+	if (n->len && callback(parm, n->data + n->off, n->len) < 0)
+		return BSTR_ERR;
+	return bstr__rope_walk(n->right, callback, parm);
+}
+
+/* Call callback on every chunk, in order, until it fails. */
+static inline int bstr_rope_chunks(const struct bstr_rope *r,
+				   int (*callback)(void *parm, const void *blk, bstr_len_t len), void *parm)
+{
+	if (!r || !callback)
+		return BSTR_ERR;
+	if (r->head && r->head->len && callback(parm, r->head->data + r->head->off, r->head->len) < 0)
+		return BSTR_ERR;
+	if (bstr__rope_walk(r->root, callback, parm) < 0)
+		return BSTR_ERR;
+	if (r->tail && r->tail->len && callback(parm, r->tail->data, r->tail->len) < 0)
+		return BSTR_ERR;
+	return BSTR_OK;
+}
 
-	va_start(args, fmt);
-	vsnprintf((char *)b->data, required_len, fmt, args);
-	va_end(args);
+static inline int bstr__rope_copy_chunk(void *parm, const void *blk, bstr_len_t len)
+{
+	bstr b = parm;
 
-	b->slen = required_len - 1;
+	memcpy(b->data + b->slen, blk, len);
+	b->slen += len;
 	return BSTR_OK;
 }
 
-static inline int bstr_vformat(bstr b, const char *fmt, va_list args)
+/*
+ * Contents of r as one contiguous string. The result belongs to r, is
+ * read-only, and stays valid until r is next modified; it is built on
+ * the first call after a change and reused until then.
+ */
+static inline bstr bstr_rope_flatten(struct bstr_rope *r)
 {
-	if (!b || !fmt) return BSTR_ERR;
+	if (!r)
+		return NULL;
+	if (r->flat)
+		return r->flat;
 
-	va_list args_copy;
-	va_copy(args_copy, args);
-	int required_len = vsnprintf(NULL, 0, fmt, args_copy) + 1;
-	va_end(args_copy);
+	bstr b = bstr__new(r->ator, r->len + 1);
+	if (!b)
+		return NULL;
+	bstr_rope_chunks(r, bstr__rope_copy_chunk, b);
+	b->data[b->slen] = '\0';
+	b->flags |= BSTR__F_RDONLY;
+	r->flat = b;
+	return b;
+}
 
-	if (required_len <= 0) return BSTR_ERR;
+#ifdef BSTR_HAVE_WRITEV
+struct bstr__iov_batch {
+	int		fd;
+	int		cnt;
+	struct iovec	iov[BSTR__IOV_BATCH];
+};
 
-	if (bstr_alloc(b, required_len) != BSTR_OK) return BSTR_ERR;
+static inline int bstr__iov_chunk(void *parm, const void *blk, bstr_len_t len)
+{
+	struct bstr__iov_batch *batch = parm;
 
-	vsnprintf((char *)b->data, required_len, fmt, args);
-	b->slen = required_len - 1;
+	if (batch->cnt == BSTR__IOV_BATCH) {
+		if (bstr__writev_all(batch->fd, batch->iov, batch->cnt) != BSTR_OK)
+			return BSTR_ERR;
+		batch->cnt = 0;
+	}
+	batch->iov[batch->cnt].iov_base = (void *)blk;
+	batch->iov[batch->cnt++].iov_len = (size_t)len;
 	return BSTR_OK;
 }
 
-static inline int bstr_ncmp(const bstr b0, const bstr b1, int n)
+/* Write the contents of r to fd chunk by chunk, without flattening. */
+static inline int bstr_rope_write(int fd, const struct bstr_rope *r)
 {
-	if (!b0 || !b1 || !b0->data || !b1->data || b0->slen < 0 || b1->slen < 0 || n < 0) return SHRT_MIN;
-
-	int len = (b0->slen < b1->slen) ? b0->slen : b1->slen;
-	if (n < len) len = n;
-
-	for (int i = 0; i < len; i++) {
-		int v = ((unsigned char)b0->data[i]) - ((unsigned char)b1->data[i]);
-		if (v != 0) return v;
-	}
+	struct bstr__iov_batch batch;
 
-	return (n > len) ? ((b0->slen > b1->slen) - (b1->slen > b0->slen)) : 0;
+	if (fd < 0 || !r)
+		return BSTR_ERR;
+	batch.fd = fd;
+	batch.cnt = 0;
+	if (bstr_rope_chunks(r, bstr__iov_chunk, &batch) < 0)
+		return BSTR_ERR;
+	return bstr__writev_all(fd, batch.iov, batch.cnt);
 }
+#endif /* BSTR_HAVE_WRITEV */
 
-static inline int bstr_spn(const bstr b, const bstr accept)
-{
-	if (!b || !accept || !b->data || !accept->data || b->slen < 0 || accept->slen < 0) return BSTR_ERR;
+#define bstr__gap_size(g) ((g)->gap_end - (g)->gap_start)
 
-	int i;
-	for (i = 0; i < b->slen; i++)
-		if (!memchr(accept->data, b->data[i], accept->slen))
-			break;
-	return i;
+/* Move the gap so that it starts at pos. */
+static inline void bstr__gap_move(struct bstr_gap *g, bstr_len_t pos)
+{
+	unsigned char *d = g->buf->data;
+
+	if (pos < g->gap_start) {
+		bstr_len_t n = g->gap_start - pos;
+		memmove(d + g->gap_end - n, d + pos, n);
+		g->gap_start -= n;
+		g->gap_end -= n;
+	} else if (pos > g->gap_start) {
+		bstr_len_t n = pos - g->gap_start;
+		memmove(d + g->gap_start, d + g->gap_end, n);
+		g->gap_start += n;
+		g->gap_end += n;
+	}
 }
 
-static inline int bstr_cspn(const bstr b, const bstr reject)
+/*
+ * Close the gap at the end of the text, leaving buf an ordinary string
+ * (with slen set) that the usual bstr functions can work on.
+ */
+static inline void bstr__gap_close(struct bstr_gap *g)
 {
-	if (!b || !reject || !b->data || !reject->data || b->slen < 0 || reject->slen < 0) return BSTR_ERR;
-
-	int i;
-	for (i = 0; i < b->slen; i++)
-		if (memchr(reject->data, b->data[i], reject->slen))
-			break;
-	return i;
+	bstr__gap_move(g, g->buf->mlen - bstr__gap_size(g));
+	g->buf->slen = g->gap_start;
 }
 
-static inline int bstr_list_alloc_min(struct bstr_list *list, int msz)
+/* Ensure room for len more bytes plus the terminator. */
+static inline int bstr__gap_reserve(struct bstr_gap *g, bstr_len_t len)
 {
-	if (!list || msz <= 0 || !list->entry || list->qty < 0 ||
-	    list->mlen <= 0 || list->qty > list->mlen)
-		return BSTR_ERR;
-
-	// The new minimum size should be at least as large as the number of entries
-	if (msz < list->qty)
-		msz = list->qty;
-
-	if (list->mlen == msz)
-		return BSTR_OK;
+	bstr b = g->buf;
 
-	// Ensure we don't decrease mlen below what it was previously set
-	if (msz < list->mlen)
+	if (bstr__gap_size(g) > len)
 		return BSTR_OK;
 
-	size_t new_size = ((size_t)msz) * sizeof(bstr);
-
-	if (new_size < (size_t)msz)
-		return BSTR_ERR;
-
-	bstr *new_entry = realloc(list->entry, new_size);
-	if (!new_entry)
+	bstr_len_t used = b->mlen - bstr__gap_size(g);
+	if (len > BSTR_LEN_MAX - 1 - used)
 		return BSTR_ERR;
-
-	list->mlen = msz;
-	list->entry = new_entry;
-	return BSTR_OK;
+	/* Grow geometrically so a stream of inserts stays amortized O(1) */
+	bstr_len_t want = used + len + 1;
+	if (used < BSTR_LEN_MAX / 2 && want < 2 * used)
+		want = 2 * used;
+
+	bstr_len_t pos = g->gap_start;
+	bstr__gap_close(g);
+	b->flags &= ~BSTR__F_RDONLY;
+	int ret = bstr_alloc(b, want);
+	b->flags |= BSTR__F_RDONLY;
+	g->gap_end = b->mlen;
+	bstr__gap_move(g, pos);
+	return ret;
 }
 
-static inline int bstr_list_alloc(struct bstr_list *list, int msz)
+/* A gap buffer holding a copy of b. */
+static inline struct bstr_gap *bstr_gap_create(const bstr b)
 {
-	if (!list || msz <= 0 || !list->entry || list->qty < 0 ||
-	    list->mlen <= 0 || list->qty > list->mlen)
-		return BSTR_ERR;
-
-	if (list->mlen >= msz)
-		return BSTR_OK;
+	if (!b || !b->data || b->slen < 0)
+		return NULL;
 
-	int smsz = snap_up_size(msz);
-	size_t new_size = ((size_t)smsz) * sizeof(bstr);
+	const struct bstr_allocator *a = bstr__default_allocator;
+	struct bstr_gap *g = bstr__malloc(a, sizeof(struct bstr_gap));
+	if (!g)
+		return NULL;
+	g->buf = blk_to_bstr_with(a, b->data, b->slen);
+	if (!g->buf) {
+		bstr__free(a, g, sizeof(struct bstr_gap));
+		return NULL;
+	}
+	g->buf->flags |= BSTR__F_RDONLY;
+	g->gap_start = g->buf->slen;
+	g->gap_end = g->buf->mlen;
+	return g;
+}
 
-	if (new_size < (size_t)smsz)
+static inline int bstr_gap_destroy(struct bstr_gap *g)
+{
+	if (!g || !g->buf)
 		return BSTR_ERR;
 
-	bstr *new_entry = realloc(list->entry, new_size);
-	if (!new_entry) {
-		smsz = msz;
-		new_size = ((size_t)smsz) * sizeof(bstr);
-		new_entry = realloc(list->entry, new_size);
-		if (!new_entry)
-			return BSTR_ERR;
-	}
-
-	list->mlen = smsz;
-	list->entry = new_entry;
+	const struct bstr_allocator *a = g->buf->ator;
+	g->buf->flags &= ~BSTR__F_RDONLY;
+	bstr_destroy(g->buf);
+	g->buf = NULL;
+	bstr__free(a, g, sizeof(struct bstr_gap));
 	return BSTR_OK;
 }
 
-static inline int bstr_list_callback(void *parm, int ofs, int len)
+static inline bstr_len_t bstr_gap_len(const struct bstr_gap *g)
 {
-	struct gen_bstr_list *g = (struct gen_bstr_list *)parm;
-	bstr substring = bstr_mid(g->b, ofs, len);
+	if (!g || !g->buf)
+		return BSTR_ERR;
+	return g->buf->mlen - bstr__gap_size(g);
+}
 
-	if (substring == NULL) return BSTR_ERR;
+/* Insert len bytes at pos; blk may point into the gap buffer itself. */
+static inline int bstr_gap_insert_blk(struct bstr_gap *g, bstr_len_t pos, const void *blk, bstr_len_t len)
+{
+	if (!g || !g->buf || pos < 0 || pos > bstr_gap_len(g) || len < 0 || (len && !blk))
+		return BSTR_ERR;
+	if (len == 0)
+		return BSTR_OK;
 
-	if (g->bl->qty >= g->bl->mlen) {
-		if (bstr_list_alloc(g->bl, g->bl->mlen * 2) != BSTR_OK) {
-			bstr_destroy(substring);
+	const unsigned char *p = blk;
+	unsigned char *aux = NULL;
+	const struct bstr_allocator *a = g->buf->ator;
+	if (p + len > g->buf->data && p < g->buf->data + g->buf->mlen) {
+		/* Aliased: the source moves with the gap, so copy it out */
+		aux = bstr__malloc(a, len);
+		if (!aux)
 			return BSTR_ERR;
-		}
+		memcpy(aux, p, len);
+		p = aux;
 	}
 
-	g->bl->entry[g->bl->qty] = substring;
-	g->bl->qty++;
-	return BSTR_OK;
-}
-
-static inline struct bstr_list *bstr_list_create(void)
-{
-	struct bstr_list *list = malloc(sizeof(struct bstr_list));
-
-	if (list) {
-		list->entry = (bstr *)malloc(1 * sizeof(bstr));
-		if (!list->entry) {
-			free(list);
-			list = NULL;
-		} else {
-			list->qty = 0;
-			list->mlen = 1;
-		}
+	int ret = bstr__gap_reserve(g, len);
+	if (ret == BSTR_OK) {
+		g->buf->flags &= ~BSTR__F_HASHED;
+		bstr__gap_move(g, pos);
+		memcpy(g->buf->data + g->gap_start, p, len);
+		g->gap_start += len;
 	}
-	return list;
+	if (aux)
+		bstr__free(a, aux, len);
+	return ret;
 }
 
-static inline int bstr_list_destroy(struct bstr_list *list)
+static inline int bstr_gap_insert(struct bstr_gap *g, bstr_len_t pos, const bstr b)
 {
-	if (!list || list->qty < 0)
+	if (!b || !b->data || b->slen < 0)
 		return BSTR_ERR;
-	for (int i = 0; i < list->qty; i++) {
-		if (list->entry[i]) {
-			bstr_destroy(list->entry[i]);
-			list->entry[i] = NULL;
-		}
-	}
-	list->qty = -1;
-	list->mlen = -1;
-	free(list->entry);
-	list->entry = NULL;
-	free(list);
-	return BSTR_OK;
+	return bstr_gap_insert_blk(g, pos, b->data, b->slen);
 }
 
-static inline int bstr_split_cb(const bstr str, unsigned char split_char, int pos,
-				int (*callback)(void *parm, int ofs, int len), void *parm)
+/* Remove len bytes starting at pos, clamped to the end of the text. */
+static inline int bstr_gap_delete(struct bstr_gap *g, bstr_len_t pos, bstr_len_t len)
 {
-	if (!str || !str->data || str->slen < 0 || !callback)
+	if (!g || !g->buf || pos < 0 || len < 0)
 		return BSTR_ERR;
 
-	int start = pos;
-	for (int i = pos; i < str->slen; i++) {
-		if (str->data[i] == split_char) {
-			if (callback(parm, start, i - start) < 0)
-				return BSTR_ERR;
-			start = i + 1;
-		}
-	}
-
-	if (start <= str->slen)
-		return callback(parm, start, str->slen - start);
+	bstr_len_t total = bstr_gap_len(g);
+	if (pos > total)
+		return BSTR_ERR;
+	if (len > total - pos)
+		len = total - pos;
+	if (len == 0)
+		return BSTR_OK;
 
+	g->buf->flags &= ~BSTR__F_HASHED;
+	bstr__gap_move(g, pos);
+	g->gap_end += len;
 	return BSTR_OK;
 }
 
-static inline struct bstr_list *bstr_split(const bstr str, unsigned char split_char)
+/*
+ * The text as one contiguous string. The result belongs to g, is
+ * read-only, and stays valid until g is next edited. Edits cost
+ * nothing extra when the view is not taken; taking it moves the gap to
+ * the end of the text.
+ */
+static inline bstr bstr_gap_str(struct bstr_gap *g)
 {
-	struct gen_bstr_list g;
-
-	if (!str || !str->data || str->slen < 0)
+	if (!g || !g->buf)
 		return NULL;
+	bstr__gap_close(g);
+	g->buf->data[g->buf->slen] = '\0';
+	return g->buf;
+}
 
-	g.bl = malloc(sizeof(struct bstr_list));
-	if (!g.bl)
-		return NULL;
+/* Free g and hand its text back as an ordinary bstr. */
+static inline bstr bstr_gap_release(struct bstr_gap *g)
+{
+	bstr b = bstr_gap_str(g);
 
-	g.bl->mlen = 4;
-	g.bl->entry = malloc(g.bl->mlen * sizeof(bstr));
-	if (!g.bl->entry) {
-		free(g.bl);
-		return NULL;
+	if (b) {
+		b->flags &= ~BSTR__F_RDONLY;
+		bstr__free(b->ator, g, sizeof(struct bstr_gap));
 	}
+	return b;
+}
 
-	g.b = (bstr)str;
-	g.bl->qty = 0;
+#define BSTR__ARENA_ALIGN (2 * sizeof(void *))
+#define BSTR__ARENA_ROUND(n) (((n) + BSTR__ARENA_ALIGN - 1) & ~(BSTR__ARENA_ALIGN - 1))
+#define BSTR__ARENA_HDR BSTR__ARENA_ROUND(sizeof(struct bstr_arena_chunk))
+#define bstr__arena_mem(c) ((unsigned char *)(c) + BSTR__ARENA_HDR)
 
-	if (bstr_split_cb(str, split_char, 0, bstr_list_callback, &g) < 0) {
-		bstr_list_destroy(g.bl);
-		return NULL;
+static void *bstr__arena_alloc(void *ctx, size_t size)
+{
+	struct bstr_arena *arena = ctx;
+	struct bstr_arena_chunk *c = arena->head;
+
+	size = BSTR__ARENA_ROUND(size);
+	if (!c || c->size - c->used < size) {
+		size_t csz = arena->chunk_size;
+		if (csz < size)
+			csz = size;
+		if (csz > (size_t)-1 - BSTR__ARENA_HDR)
+			return NULL;
+		c = malloc(BSTR__ARENA_HDR + csz);
+		if (!c)
+			return NULL;
+		c->size = csz;
+		c->used = 0;
+		c->next = arena->head;
+		arena->head = c;
 	}
 
-	return g.bl;
+	arena->last = bstr__arena_mem(c) + c->used;
+	c->used += size;
+	return arena->last;
 }
 
-static inline int bstr_splits_cb(const bstr str, const bstr split_str, int pos,
-				 int (*callback)(void *parm, int ofs, int len), void *parm)
+static void *bstr__arena_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size)
 {
-	if (!str || !str->data || str->slen < 0 ||
-	    !split_str || !split_str->data || split_str->slen < 0 || !callback)
-		return BSTR_ERR;
-
-	int start = pos;
-	for (int i = pos; i < str->slen; i++) {
-		for (int j = 0; j < split_str->slen; j++) {
-			if (str->data[i] == split_str->data[j]) {
-				if (callback(parm, start, i - start) < 0)
-					return BSTR_ERR;
-				start = i + 1;
-				break;
-			}
-		}
+	struct bstr_arena *arena = ctx;
+	struct bstr_arena_chunk *c = arena->head;
+
+	old_size = BSTR__ARENA_ROUND(old_size);
+	if (new_size <= old_size)
+		return ptr;
+
+	/* The most recent allocation can grow in place */
+	if (ptr == arena->last && c &&
+	    BSTR__ARENA_ROUND(new_size) - old_size <= c->size - c->used) {
+		c->used += BSTR__ARENA_ROUND(new_size) - old_size;
+		return ptr;
 	}
 
-	if (start <= str->slen)
-		return callback(parm, start, str->slen - start);
-
-	return BSTR_OK;
+	void *x = bstr__arena_alloc(ctx, new_size);
+	if (x && old_size)
+		memcpy(x, ptr, old_size);
+	return x;
 }
 
-static inline struct bstr_list *bstr_splits(const bstr str, const bstr split_str)
+static void bstr__arena_free(void *ctx, void *ptr, size_t size)
 {
-	struct gen_bstr_list g;
-
-	if (!str || str->slen < 0 || !str->data ||
-	    !split_str || split_str->slen < 0 || !split_str->data)
-		return NULL;
-
-	g.bl = malloc(sizeof(struct bstr_list));
-	if (!g.bl)
-		return NULL;
+	struct bstr_arena *arena = ctx;
 
-	g.bl->mlen = 4;
-	g.bl->entry = malloc(g.bl->mlen * sizeof(bstr));
-	if (!g.bl->entry) {
-		free(g.bl);
-		return NULL;
+	/* Only the most recent allocation is given back; the rest wait for a reset */
+	if (ptr && ptr == arena->last) {
+		arena->head->used -= BSTR__ARENA_ROUND(size);
+		arena->last = NULL;
 	}
+}
 
-	g.b = (bstr)str;
-	g.bl->qty = 0;
+/*
+ * Prepare an arena that hands out memory from chunks of chunk_size bytes.
+ * Strings and lists created with &arena->allocator need not be destroyed
+ * individually; bstr_arena_reset releases all of them at once.
+ */
+static inline void bstr_arena_init(struct bstr_arena *arena, size_t chunk_size)
+{
+	arena->allocator.alloc = bstr__arena_alloc;
+	arena->allocator.realloc = bstr__arena_realloc;
+	arena->allocator.free = bstr__arena_free;
+	arena->allocator.ctx = arena;
+	arena->head = NULL;
+	arena->chunk_size = chunk_size ? chunk_size : 4096;
+	arena->last = NULL;
+}
 
-	if (bstr_splits_cb(str, split_str, 0, bstr_list_callback, &g) < 0) {
-		bstr_list_destroy(g.bl);
-		return NULL;
+/*
+ * Release everything allocated from the arena. The most recent chunk is
+ * kept for reuse, so a reset arena does not go back to malloc.
+ */
+static inline void bstr_arena_reset(struct bstr_arena *arena)
+{
+	struct bstr_arena_chunk *c = arena->head;
+
+	if (!c)
+		return;
+	while (c->next) {
+		struct bstr_arena_chunk *next = c->next->next;
+		free(c->next);
+		c->next = next;
 	}
-
-	return g.bl;
+	c->used = 0;
+	arena->last = NULL;
 }
 
-static inline int bstr_split_str_cb(const bstr str, const bstr split_str, int pos,
-				    int (*callback)(void *parm, int ofs, int len), void *parm)
+static inline void bstr_arena_destroy(struct bstr_arena *arena)
 {
-	if (!str || !str->data || str->slen < 0 ||
-	    !split_str || !split_str->data || split_str->slen < 0 || !callback)
-		return BSTR_ERR;
-
-	int start = pos;
-	while (start <= str->slen - split_str->slen) {
-		int found = 1;
-		for (int j = 0; j < split_str->slen; j++) {
-			if (str->data[start + j] != split_str->data[j]) {
-				found = 0;
-				break;
-			}
-		}
-
-		if (found) {
-			if (callback(parm, pos, start - pos) < 0)
-				return BSTR_ERR;
-			pos = start + split_str->slen;
-			start = pos;
-		} else {
-			start++;
-		}
+	while (arena->head) {
+		struct bstr_arena_chunk *next = arena->head->next;
+		free(arena->head);
+		arena->head = next;
 	}
-
-	if (pos <= str->slen)
-		return callback(parm, pos, str->slen - pos);
-
-	return BSTR_OK;
+	arena->last = NULL;
 }
 
-static inline struct bstr_list *bstr_split_str(const bstr str, const bstr split_str)
+/* Size class serving a block of size bytes, or -1 if it is too large to pool. */
+static inline int bstr__pool_class(size_t size)
 {
-	struct gen_bstr_list g;
-
-	if (!str || !str->data || str->slen < 0)
-		return NULL;
+	if (size <= ((size_t)1 << BSTR__POOL_MIN_SHIFT))
+		return 0;
+	if (size > ((size_t)1 << BSTR_POOL_MAX_SHIFT))
+		return -1;
+#if defined(__GNUC__)
+	return (int)(sizeof(unsigned int) * CHAR_BIT) -
+	       __builtin_clz((unsigned int)size - 1) - BSTR__POOL_MIN_SHIFT;
+#else
+	int shift = BSTR__POOL_MIN_SHIFT;
+	while (((size_t)1 << shift) < size)
+		shift++;
+	return shift - BSTR__POOL_MIN_SHIFT;
+#endif
+}
 
-	g.bl = malloc(sizeof(struct bstr_list));
-	if (!g.bl)
-		return NULL;
+#define bstr__pool_class_size(c) ((size_t)1 << ((c) + BSTR__POOL_MIN_SHIFT))
 
-	g.bl->mlen = 4;
-	g.bl->entry = malloc(g.bl->mlen * sizeof(bstr));
-	if (!g.bl->entry) {
-		free(g.bl);
-		return NULL;
-	}
+#ifdef BSTR_TLS
+struct bstr__pool_cache {
+	void *			free_list[BSTR__POOL_CLASSES];
+	int			count[BSTR__POOL_CLASSES];
+	struct bstr_pool_stats	stats;
+};
 
-	g.b = (bstr)str;
-	g.bl->qty = 0;
+static BSTR_TLS struct bstr__pool_cache bstr__pool;
 
-	if (bstr_split_str_cb(str, split_str, 0, bstr_list_callback, &g) < 0) {
-		bstr_list_destroy(g.bl);
-		return NULL;
+static void *bstr__pool_alloc(void *ctx, size_t size)
+{
+	(void)ctx;
+	int c = bstr__pool_class(size);
+
+	if (c >= 0 && bstr__pool.free_list[c]) {
+		void *p = bstr__pool.free_list[c];
+		bstr__pool.free_list[c] = *(void **)p;
+		bstr__pool.count[c]--;
+		bstr__pool.stats.hits++;
+		bstr__pool.stats.cached_bytes -= bstr__pool_class_size(c);
+		return p;
 	}
 
-	return g.bl;
+	bstr__pool.stats.misses++;
+	return malloc(c >= 0 ? bstr__pool_class_size(c) : size);
 }
 
-static inline bstr bstr_join(const struct bstr_list *list, const bstr sep)
+static void bstr__pool_free(void *ctx, void *ptr, size_t size)
 {
-	if (list == NULL || list->qty < 0)
-		return NULL;
-	if (sep != NULL && (sep->slen < 0 || sep->data == NULL))
-		return NULL;
-
-	int total_length = 1; // For null terminator
-	for (int i = 0; i < list->qty; i++) {
-		if (list->entry[i]->slen < 0)
-			return NULL; // Invalid input
-		total_length += list->entry[i]->slen;
-		if (total_length < 0)
-			return NULL; // Overflow
+	(void)ctx;
+	int c = bstr__pool_class(size);
+
+	if (!ptr)
+		return;
+	if (c < 0 || bstr__pool.count[c] >= BSTR_POOL_DEPTH) {
+		bstr__pool.stats.released++;
+		free(ptr);
+		return;
 	}
 
-	if (sep != NULL)
-		total_length += (list->qty - 1) * sep->slen;
+	*(void **)ptr = bstr__pool.free_list[c];
+	bstr__pool.free_list[c] = ptr;
+	bstr__pool.count[c]++;
+	bstr__pool.stats.recycled++;
+	bstr__pool.stats.cached_bytes += bstr__pool_class_size(c);
+}
 
-	bstr result = malloc(sizeof(struct tagbstr));
-	if (!result)
-		return NULL; // Out of memory
+static void *bstr__pool_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size)
+{
+	int oc = bstr__pool_class(old_size);
+	int nc = bstr__pool_class(new_size);
 
-	result->data = malloc(total_length);
-	if (!result->data) {
-		free(result);
+	/* Still fits the block we handed out */
+	if (oc >= 0 && oc == nc)
+		return ptr;
+	if (oc < 0 && nc < 0)
+		return realloc(ptr, new_size);
+
+	void *x = bstr__pool_alloc(ctx, new_size);
+	if (!x)
 		return NULL;
-	}
+	memcpy(x, ptr, old_size < new_size ? old_size : new_size);
+	bstr__pool_free(ctx, ptr, old_size);
+	return x;
+}
 
-	result->mlen = total_length;
-	result->slen = total_length - 1;
+/*
+ * Opt-in pooled allocator; install it with bstr_set_allocator or pass it
+ * to the _with functions. Blocks may be freed on any thread and join that
+ * thread's cache. Call bstr_pool_trim before a thread exits to hand its
+ * idle blocks back to the system.
+ */
+static const struct bstr_allocator bstr_pool_allocator = {
+	bstr__pool_alloc, bstr__pool_realloc, bstr__pool_free, NULL
+};
 
-	int current_pos = 0;
-	for (int i = 0; i < list->qty; i++) {
-		if (i > 0 && sep != NULL) {
-			memcpy(result->data + current_pos, sep->data, sep->slen);
-			current_pos += sep->slen;
+/* Counters for the calling thread's cache. */
+static inline void bstr_pool_stats(struct bstr_pool_stats *stats)
+{
+	if (stats)
+		*stats = bstr__pool.stats;
+}
+
+/* Free every idle block cached by the calling thread. */
+static inline void bstr_pool_trim(void)
+{
+	for (int c = 0; c < BSTR__POOL_CLASSES; c++) {
+		while (bstr__pool.free_list[c]) {
+			void *p = bstr__pool.free_list[c];
+			bstr__pool.free_list[c] = *(void **)p;
+			free(p);
 		}
-		memcpy(result->data + current_pos, list->entry[i]->data, list->entry[i]->slen);
-		current_pos += list->entry[i]->slen;
+		bstr__pool.count[c] = 0;
 	}
+	bstr__pool.stats.cached_bytes = 0;
+}
+#else
+/* Without thread-local storage the pool degrades to plain malloc. */
+static const struct bstr_allocator bstr_pool_allocator = {
+	bstr__libc_alloc, bstr__libc_realloc, bstr__libc_free, NULL
+};
 
-	result->data[current_pos] = '\0';
-	return result;
+static inline void bstr_pool_stats(struct bstr_pool_stats *stats)
+{
+	if (stats)
+		memset(stats, 0, sizeof(*stats));
+}
+
+static inline void bstr_pool_trim(void)
+{
 }
+#endif /* BSTR_TLS */
 
 #endif /* BSTR_H */
@@ -1,4 +1,17 @@
 #include "uptest.h"
+#include <stdarg.h>
+#include <stdio.h>
+
+// Counts formatter runs, so tests can check which path bstr_format took
+static int vsnprintf_calls;
+
+static int counting_vsnprintf(char *s, size_t n, const char *fmt, va_list args)
+{
+	vsnprintf_calls++;
+	return vsnprintf(s, n, fmt, args);
+}
+#define BSTR_VSNPRINTF counting_vsnprintf
+
 #include "bstr.h"
 #include "log.h"
 #include <assert.h>
@@ -6,6 +19,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <wchar.h>
 
 // Generate a random string of a given length
 char *generate_random_string(size_t length)
@@ -330,6 +344,1316 @@ static unit_result test_bstr_join(void)
 	return UNIT_PASS;
 }
 
+// Test for inline storage of short strings
+static unit_result test_bstr_sso(void)
+{
+	bstr b = bstr_from_cstr("key");
+
+	UT_ASSERT(b != NULL);
+	UT_ASSERT(bstr__is_inline(b));
+	UT_ASSERT(b->mlen >= BSTR_SSO_SIZE);
+
+	// Growing past the inline capacity spills to the heap
+	int cap = b->mlen;
+	for (int i = 3; i < cap; i++)
+		UT_ASSERT(bstr_append_char(b, 'x') == BSTR_OK);
+	UT_ASSERT(!bstr__is_inline(b));
+	UT_ASSERT(b->slen == cap);
+	UT_ASSERT(b->mlen > b->slen);
+	UT_ASSERT(memcmp(b->data, "keyxxx", 6) == 0);
+	UT_ASSERT(b->data[b->slen] == '\0');
+
+	bstr mid = bstr_mid(b, 0, 3);
+	UT_ASSERT(mid != NULL);
+	UT_ASSERT(bstr__is_inline(mid));
+	UT_ASSERT(strcmp((char *)mid->data, "key") == 0);
+
+	UT_ASSERT(bstr_destroy(mid) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(b) == BSTR_OK);
+	return UNIT_PASS;
+}
+
+// Test that long strings share a single block with their header
+static unit_result test_bstr_single_block(void)
+{
+	char *long_str = generate_random_string(300);
+
+	UT_ASSERT(long_str != NULL);
+
+	bstr b = bstr_from_cstr(long_str);
+	UT_ASSERT(b != NULL);
+	UT_ASSERT(bstr__is_inline(b));
+	UT_ASSERT(b->mlen > 300);
+
+	bstr copy = bstr_copy(b);
+	UT_ASSERT(copy != NULL);
+	UT_ASSERT(bstr__is_inline(copy));
+	UT_ASSERT(strcmp((char *)copy->data, long_str) == 0);
+
+	UT_ASSERT(bstr_concat(copy, b) == BSTR_OK);
+	UT_ASSERT(copy->slen == 600);
+	UT_ASSERT(memcmp(copy->data + 300, long_str, 300) == 0);
+
+	UT_ASSERT(bstr_destroy(copy) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(b) == BSTR_OK);
+	free(long_str);
+	return UNIT_PASS;
+}
+
+// Test for bstr_arena and the allocator hooks
+static unit_result test_bstr_arena(void)
+{
+	struct bstr_arena arena;
+
+	bstr_arena_init(&arena, 256);
+
+	bstr a = bstr_from_cstr_with(&arena.allocator, "arena");
+	bstr b = blk_to_bstr_with(&arena.allocator, "string", 6);
+	UT_ASSERT(a != NULL && b != NULL);
+	UT_ASSERT(a->ator == &arena.allocator);
+
+	// Growth goes through the arena as well, including past a chunk
+	for (int i = 0; i < 40; i++)
+		UT_ASSERT(bstr_concat(a, b) == BSTR_OK);
+	UT_ASSERT(a->slen == 5 + 40 * 6);
+	UT_ASSERT(memcmp(a->data + a->slen - 6, "string", 6) == 0);
+
+	// Derived strings use the default allocator once it is installed
+	const struct bstr_allocator *old = bstr_set_allocator(&arena.allocator);
+	UT_ASSERT(old == &bstr_libc_allocator);
+	bstr_list *list = bstr_split(a, 's');
+	UT_ASSERT(list != NULL);
+	UT_ASSERT(list->ator == &arena.allocator);
+	UT_ASSERT(list->qty == 41);
+	UT_ASSERT(list->entry[1]->ator == &arena.allocator);
+	UT_ASSERT(bstr_set_allocator(NULL) == &arena.allocator);
+	UT_ASSERT(bstr_get_allocator() == &bstr_libc_allocator);
+
+	bstr_arena_reset(&arena);
+	UT_ASSERT(arena.head != NULL && arena.head->next == NULL);
+	UT_ASSERT(arena.head->used == 0);
+
+	bstr c = bstr_from_cstr_with(&arena.allocator, "again");
+	UT_ASSERT(c != NULL);
+	UT_ASSERT(strcmp((char *)c->data, "again") == 0);
+	UT_ASSERT(bstr_destroy(c) == BSTR_OK);
+
+	bstr_arena_destroy(&arena);
+	UT_ASSERT(arena.head == NULL);
+	return UNIT_PASS;
+}
+
+// Test for the thread-local pool allocator
+static unit_result test_bstr_pool(void)
+{
+	struct bstr_pool_stats before, after;
+
+	bstr_pool_trim();
+	bstr_pool_stats(&before);
+	const struct bstr_allocator *old = bstr_set_allocator(&bstr_pool_allocator);
+
+	bstr b = bstr_from_cstr("pooled");
+	UT_ASSERT(b != NULL);
+	for (int i = 0; i < 10; i++)
+		UT_ASSERT(bstr_concat(b, b) == BSTR_OK);
+	UT_ASSERT(b->slen == 6 << 10);
+	UT_ASSERT(bstr_destroy(b) == BSTR_OK);
+
+	bstr_pool_stats(&after);
+	UT_ASSERT(after.misses > before.misses);
+	UT_ASSERT(after.recycled > before.recycled);
+	UT_ASSERT(after.cached_bytes > 0);
+
+	// The same sizes come straight back out of the free lists
+	unsigned long long misses = after.misses;
+	b = bstr_from_cstr("pooled");
+	UT_ASSERT(b != NULL);
+	for (int i = 0; i < 10; i++)
+		UT_ASSERT(bstr_concat(b, b) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(b) == BSTR_OK);
+
+	bstr_pool_stats(&after);
+	UT_ASSERT(after.hits > before.hits);
+	UT_ASSERT(after.misses == misses);
+
+	// Lists and their entries are recycled too
+	b = bstr_from_cstr("pool,of,short,tokens");
+	bstr_list *list = bstr_split(b, ',');
+	UT_ASSERT(list != NULL && list->qty == 4);
+	UT_ASSERT(bstr_list_destroy(list) == BSTR_OK);
+	bstr_pool_stats(&after);
+	misses = after.misses;
+	list = bstr_split(b, ',');
+	UT_ASSERT(list != NULL && list->qty == 4);
+	UT_ASSERT(bstr_list_destroy(list) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(b) == BSTR_OK);
+	bstr_pool_stats(&after);
+	UT_ASSERT(after.misses == misses);
+
+	bstr_set_allocator(old);
+	bstr_pool_trim();
+	bstr_pool_stats(&after);
+	UT_ASSERT(after.cached_bytes == 0);
+	return UNIT_PASS;
+}
+
+// Test for bstr_find
+static unit_result test_bstr_find(void)
+{
+	bstr h = bstr_from_cstr("the quick brown fox jumps over the lazy dog, "
+				"the quick brown fox jumps over the lazy dog");
+	bstr fox = bstr_from_cstr("fox");
+	bstr empty = bstr_from_cstr("");
+	bstr absent = bstr_from_cstr("cat");
+
+	UT_ASSERT(h && fox && empty && absent);
+
+	UT_ASSERT_EQ(16, bstr_find(h, 0, fox));
+	UT_ASSERT_EQ(61, bstr_find(h, 17, fox));
+	UT_ASSERT_EQ(BSTR_ERR, bstr_find(h, 62, fox));
+	UT_ASSERT_EQ(BSTR_ERR, bstr_find(h, 0, absent));
+	UT_ASSERT_EQ(BSTR_ERR, bstr_find(h, -1, fox));
+	// An empty needle matches at the terminating NUL
+	UT_ASSERT_EQ(h->slen, bstr_find(h, 3, empty));
+
+	UT_ASSERT(bstr_destroy(h) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(fox) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(empty) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(absent) == BSTR_OK);
+	return UNIT_PASS;
+}
+
+static int collect_offsets(void *parm, bstr_len_t ofs, bstr_len_t len)
+{
+	int *out = parm;
+
+	(void)len;
+	out[++out[0]] = (int)ofs;
+	return BSTR_OK;
+}
+
+// Test for bstr_pattern
+static unit_result test_bstr_pattern(void)
+{
+	bstr h = bstr_from_cstr("abaabaabaababaab, aab");
+	bstr needle = bstr_from_cstr("aab");
+	bstr empty = bstr_from_cstr("");
+
+	UT_ASSERT(h && needle && empty);
+	UT_ASSERT(bstr_pattern_compile(empty) == NULL);
+
+	struct bstr_pattern *pat = bstr_pattern_compile(needle);
+	UT_ASSERT(pat != NULL);
+	UT_ASSERT(bstr_destroy(needle) == BSTR_OK);
+
+	UT_ASSERT_EQ(2, bstr_pattern_find(pat, h, 0));
+	UT_ASSERT_EQ(5, bstr_pattern_find(pat, h, 3));
+	UT_ASSERT_EQ(BSTR_ERR, bstr_pattern_find(pat, h, 20));
+	UT_ASSERT_EQ(5, bstr_pattern_count(pat, h, 0));
+
+	int offsets[8] = { 0 };
+	UT_ASSERT_EQ(5, bstr_pattern_find_all(pat, h, 0, collect_offsets, offsets));
+	UT_ASSERT_EQ(5, offsets[0]);
+	UT_ASSERT_EQ(2, offsets[1]);
+	UT_ASSERT_EQ(5, offsets[2]);
+	UT_ASSERT_EQ(8, offsets[3]);
+	UT_ASSERT_EQ(13, offsets[4]);
+	UT_ASSERT_EQ(18, offsets[5]);
+
+	// Freed through the allocator it was compiled with
+	const struct bstr_allocator *old = bstr_set_allocator(&bstr_pool_allocator);
+	UT_ASSERT(pat->ator == old);
+	UT_ASSERT(bstr_pattern_destroy(pat) == BSTR_OK);
+	bstr_set_allocator(old);
+	bstr_pool_trim();
+	UT_ASSERT(bstr_destroy(h) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(empty) == BSTR_OK);
+	return UNIT_PASS;
+}
+
+/*
+ * Allocator that checks the size passed to every free and realloc, and
+ * a guard byte after every block. It can be told to fail the n-th
+ * allocation, any realloc, or any request above a size.
+ */
+struct checked_heap {
+	int	calls;          /* alloc calls so far */
+	int	fail_at;        /* Fail this alloc call, 0 for never */
+	int	fail_realloc;
+	size_t	fail_over;      /* Fail requests larger than this, 0 for never */
+	int	bad_sizes;      /* Frees or reallocs given the wrong size */
+	int	overruns;       /* Blocks whose guard byte was overwritten */
+	int	live;           /* Blocks not yet freed */
+	size_t	bytes;          /* Bytes in those blocks */
+};
+
+#define CHECKED_GUARD 0xa5
+
+static void checked_verify(struct checked_heap *h, size_t *p, size_t size)
+{
+	if (*p != size)
+		h->bad_sizes++;
+	if (((unsigned char *)(p + 1))[*p] != CHECKED_GUARD)
+		h->overruns++;
+}
+
+static void *checked_alloc(void *ctx, size_t size)
+{
+	struct checked_heap *h = ctx;
+
+	if (++h->calls == h->fail_at || (h->fail_over && size > h->fail_over))
+		return NULL;
+	size_t *p = malloc(sizeof(size_t) + size + 1);
+	if (!p)
+		return NULL;
+	*p = size;
+	((unsigned char *)(p + 1))[size] = CHECKED_GUARD;
+	h->live++;
+	h->bytes += size;
+	return p + 1;
+}
+
+static void checked_free(void *ctx, void *ptr, size_t size)
+{
+	struct checked_heap *h = ctx;
+	size_t *p = (size_t *)ptr - 1;
+
+	checked_verify(h, p, size);
+	h->live--;
+	h->bytes -= *p;
+	free(p);
+}
+
+static void *checked_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size)
+{
+	struct checked_heap *h = ctx;
+	size_t *p = (size_t *)ptr - 1;
+
+	if (h->fail_realloc || (h->fail_over && new_size > h->fail_over))
+		return NULL;
+	checked_verify(h, p, old_size);
+	size_t old = *p;
+	p = realloc(p, sizeof(size_t) + new_size + 1);
+	if (!p)
+		return NULL;
+	h->bytes += new_size - old;
+	*p = new_size;
+	((unsigned char *)(p + 1))[new_size] = CHECKED_GUARD;
+	return p + 1;
+}
+
+struct ac_matches {
+	int	qty;
+	int	idx[16];
+	int	ofs[16];
+};
+
+static int collect_ac_match(void *parm, int idx, bstr_len_t ofs)
+{
+	struct ac_matches *m = parm;
+
+	if (m->qty >= 16)
+		return BSTR_ERR;
+	m->idx[m->qty] = idx;
+	m->ofs[m->qty++] = (int)ofs;
+	return BSTR_OK;
+}
+
+// Test for the Aho-Corasick automaton
+static unit_result test_bstr_ac(void)
+{
+	bstr words = bstr_from_cstr("he,she,his,hers,,she");
+	bstr text = bstr_from_cstr("ushers");
+
+	UT_ASSERT(words != NULL && text != NULL);
+
+	bstr_list *needles = bstr_split(words, ',');
+	UT_ASSERT(needles != NULL && needles->qty == 6);
+
+	struct bstr_ac *ac = bstr_ac_compile(needles);
+	UT_ASSERT(ac != NULL);
+
+	struct ac_matches m = { 0 };
+	UT_ASSERT_EQ(4, bstr_ac_search(ac, text, 0, collect_ac_match, &m));
+	UT_ASSERT_EQ(4, m.qty);
+	// "she" and its duplicate end together with "he" at offset 3
+	UT_ASSERT(m.idx[0] == 1 && m.ofs[0] == 1);
+	UT_ASSERT(m.idx[1] == 5 && m.ofs[1] == 1);
+	UT_ASSERT(m.idx[2] == 0 && m.ofs[2] == 2);
+	UT_ASSERT(m.idx[3] == 3 && m.ofs[3] == 2);
+
+	UT_ASSERT_EQ(2, bstr_ac_search(ac, text, 2, NULL, NULL));
+	UT_ASSERT(bstr_ac_destroy(ac) == BSTR_OK);
+
+	// A failed trim keeps the untrimmed automaton, and destroy uses the
+	// allocator and sizes it was built with
+	struct checked_heap heap = { 0 };
+	struct bstr_allocator checked = { checked_alloc, checked_realloc, checked_free, &heap };
+	heap.fail_realloc = 1;
+	const struct bstr_allocator *old = bstr_set_allocator(&checked);
+	ac = bstr_ac_compile(needles);
+	bstr_set_allocator(old);
+	UT_ASSERT(ac != NULL);
+	UT_ASSERT_EQ(4, bstr_ac_search(ac, text, 0, NULL, NULL));
+	UT_ASSERT(bstr_ac_destroy(ac) == BSTR_OK);
+	UT_ASSERT_EQ(0, heap.bad_sizes);
+	UT_ASSERT_EQ(0, heap.live);
+
+	UT_ASSERT(bstr_list_destroy(needles) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(words) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(text) == BSTR_OK);
+	return UNIT_PASS;
+}
+
+// Test for bstr_split_offsets
+static unit_result test_bstr_split_offsets(void)
+{
+	bstr str = bstr_from_cstr("a,b,,c,");
+	bstr_len_t ofs[8];
+
+	UT_ASSERT(str != NULL);
+
+	UT_ASSERT_EQ(4, bstr_split_offsets(str, ',', 0, NULL, 0));
+	UT_ASSERT_EQ(4, bstr_split_offsets(str, ',', 0, ofs, 2));
+	UT_ASSERT_EQ(1, ofs[0]);
+	UT_ASSERT_EQ(3, ofs[1]);
+	UT_ASSERT_EQ(3, bstr_split_offsets(str, ',', 2, ofs, 8));
+	UT_ASSERT_EQ(3, ofs[0]);
+	UT_ASSERT_EQ(4, ofs[1]);
+	UT_ASSERT_EQ(6, ofs[2]);
+	UT_ASSERT_EQ(0, bstr_split_offsets(str, ',', 7, ofs, 8));
+	UT_ASSERT_EQ(BSTR_ERR, bstr_split_offsets(str, ',', -1, ofs, 8));
+
+	UT_ASSERT(bstr_destroy(str) == BSTR_OK);
+	return UNIT_PASS;
+}
+
+// Test for the compiled byte classes
+static unit_result test_bstr_charset(void)
+{
+	bstr ws = bstr_from_cstr(" \t\r\n");
+	bstr line = bstr_from_cstr("  \t key = value\r\n");
+	struct bstr_charset cs;
+
+	UT_ASSERT(ws != NULL && line != NULL);
+	UT_ASSERT(bstr_charset_init(&cs, ws) == BSTR_OK);
+	UT_ASSERT(cs.nibble);
+	UT_ASSERT(bstr_charset_has(&cs, '\t'));
+	UT_ASSERT(!bstr_charset_has(&cs, 'k'));
+
+	UT_ASSERT_EQ(4, bstr_charset_spn(&cs, line, 0));
+	UT_ASSERT_EQ(3, bstr_charset_cspn(&cs, line, 4));
+	UT_ASSERT_EQ(0, bstr_charset_spn(&cs, line, line->slen));
+	UT_ASSERT_EQ(4, bstr_spn(line, ws));
+	UT_ASSERT_EQ(0, bstr_cspn(line, ws));
+
+	// More than eight distinct low-nibble groups fall back to the bitmap
+	unsigned char wide[16];
+	for (int i = 0; i < 16; i++)
+		wide[i] = (unsigned char)(i * 17);
+	UT_ASSERT(bstr_charset_init_blk(&cs, wide, 16) == BSTR_OK);
+	UT_ASSERT(!cs.nibble);
+	UT_ASSERT(bstr_charset_has(&cs, 0x22));
+	UT_ASSERT(!bstr_charset_has(&cs, 0x23));
+
+	UT_ASSERT(bstr_destroy(ws) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(line) == BSTR_OK);
+	return UNIT_PASS;
+}
+
+// Callback recording tokens as a count followed by (ofs, len) pairs
+static int record_token(void *parm, bstr_len_t ofs, bstr_len_t len)
+{
+	int *out = parm;
+
+	out[1 + 2 * out[0]] = (int)ofs;
+	out[2 + 2 * out[0]] = (int)len;
+	out[0]++;
+	return BSTR_OK;
+}
+
+// Test for splitting on a precompiled separator
+static unit_result test_bstr_pattern_split(void)
+{
+	bstr sep = bstr_from_cstr("\r\n\r\n");
+	bstr msg = bstr_from_cstr("head\r\n\r\nbody\r\n\r\n\r\n\r\ntail");
+	bstr abc = bstr_from_cstr("abc");
+	bstr empty = bstr_from_cstr("");
+	static int tokens[1 + 2 * 8];
+
+	UT_ASSERT(sep && msg && abc && empty);
+
+	struct bstr_pattern *pat = bstr_pattern_compile(sep);
+	UT_ASSERT(pat != NULL);
+
+	tokens[0] = 0;
+	UT_ASSERT(bstr_pattern_split_cb(msg, pat, 0, record_token, tokens) == BSTR_OK);
+	UT_ASSERT_EQ(4, tokens[0]);
+	UT_ASSERT(tokens[1] == 0 && tokens[2] == 4);
+	UT_ASSERT(tokens[3] == 8 && tokens[4] == 4);
+	UT_ASSERT(tokens[5] == 16 && tokens[6] == 0);
+	UT_ASSERT(tokens[7] == 20 && tokens[8] == 4);
+
+	bstr_list *list = bstr_split_str(msg, sep);
+	UT_ASSERT(list != NULL && list->qty == 4);
+	UT_ASSERT(strcmp((char *)list->entry[3]->data, "tail") == 0);
+	UT_ASSERT(bstr_list_destroy(list) == BSTR_OK);
+
+	// An empty separator yields one token per character, then the empty tail
+	list = bstr_split_str(abc, empty);
+	UT_ASSERT(list != NULL && list->qty == 4);
+	UT_ASSERT(strcmp((char *)list->entry[1]->data, "b") == 0);
+	UT_ASSERT_EQ(0, list->entry[3]->slen);
+	UT_ASSERT(bstr_list_destroy(list) == BSTR_OK);
+
+	// Empty input is one empty token whatever the separator
+	tokens[0] = 0;
+	UT_ASSERT(bstr_split_str_cb(empty, empty, 0, record_token, tokens) == BSTR_OK);
+	UT_ASSERT(bstr_split_str_cb(empty, sep, 0, record_token, tokens) == BSTR_OK);
+	UT_ASSERT_EQ(2, tokens[0]);
+	UT_ASSERT(tokens[1] == 0 && tokens[2] == 0);
+	UT_ASSERT(tokens[3] == 0 && tokens[4] == 0);
+
+	UT_ASSERT(bstr_pattern_destroy(pat) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(sep) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(msg) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(abc) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(empty) == BSTR_OK);
+	return UNIT_PASS;
+}
+
+// Test for bstr_view and bstr_split_view
+static unit_result test_bstr_view(void)
+{
+	bstr rec = bstr_from_cstr("42,-17,,3.5e2,abc,9223372036854775808");
+	bstr digits = bstr_from_cstr("0123456789");
+	UT_ASSERT(rec && digits);
+
+	struct bstr_view_list *fields = bstr_split_view(rec, ',');
+	UT_ASSERT(fields != NULL);
+	UT_ASSERT_EQ(6, fields->qty);
+	UT_ASSERT(fields->entry[0].data == rec->data);
+	UT_ASSERT(fields->entry[2].slen == 0);
+
+	long n = 0;
+	double d = 0;
+	UT_ASSERT(bstr_view_to_long(fields->entry[0], &n) == BSTR_OK && n == 42);
+	UT_ASSERT(bstr_view_to_long(fields->entry[1], &n) == BSTR_OK && n == -17);
+	UT_ASSERT(bstr_view_to_long(fields->entry[2], &n) == BSTR_ERR);
+	UT_ASSERT(bstr_view_to_long(fields->entry[3], &n) == BSTR_ERR);
+	UT_ASSERT(bstr_view_to_double(fields->entry[3], &d) == BSTR_OK && d == 350.0);
+	UT_ASSERT(bstr_view_to_double(fields->entry[4], &d) == BSTR_ERR);
+	if (LONG_MAX == 9223372036854775807L)
+		UT_ASSERT(bstr_view_to_long(fields->entry[5], &n) == BSTR_ERR);
+
+	UT_ASSERT(bstr_view_cmp(fields->entry[4], bstr_view_blk("abc", 3)) == 0);
+	UT_ASSERT(bstr_view_cmp(fields->entry[4], bstr_view_blk("abd", 3)) < 0);
+	UT_ASSERT(bstr_view_cmp(fields->entry[4], bstr_view_blk("ab", 2)) > 0);
+	UT_ASSERT(bstr_view_find(bstr_view_of(rec), 0, bstr_view_blk("abc", 3)) == 14);
+	UT_ASSERT(bstr_view_find(fields->entry[4], 1, bstr_view_blk("a", 1)) == BSTR_ERR);
+	UT_ASSERT(bstr_view_spn(fields->entry[5], bstr_view_of(digits)) == 19);
+	UT_ASSERT(bstr_view_cspn(bstr_view_of(rec), bstr_view_blk("-", 1)) == 3);
+
+	bstr_view mid = bstr_view_mid(rec, 6, 100);
+	UT_ASSERT(mid.data == rec->data + 6 && mid.slen == rec->slen - 6);
+	mid = bstr_view_mid(rec, 100, 5);
+	UT_ASSERT(mid.slen == 0);
+	UT_ASSERT(bstr_view_of(NULL).slen < 0);
+
+	bstr copy = bstr_from_view(fields->entry[4]);
+	UT_ASSERT(copy && strcmp((char *)copy->data, "abc") == 0);
+
+	UT_ASSERT(bstr_view_list_destroy(fields) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(copy) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(rec) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(digits) == BSTR_OK);
+	return UNIT_PASS;
+}
+
+// Test for bstr_packed_list
+static unit_result test_bstr_packed(void)
+{
+	bstr str = bstr_from_cstr("alpha::beta:");
+	UT_ASSERT(str != NULL);
+
+	struct bstr_packed_list *pl = bstr_packed_split(str, ':');
+	UT_ASSERT(pl != NULL);
+	UT_ASSERT_EQ(4, pl->qty);
+	UT_ASSERT_EQ(str->slen + 1, pl->blen);
+	UT_ASSERT(strcmp((char *)pl->blob + pl->ofs[0], "alpha") == 0);
+	UT_ASSERT(bstr_packed_view(pl, 1).slen == 0);
+	UT_ASSERT(bstr_view_cmp(bstr_packed_view(pl, 2), bstr_view_blk("beta", 4)) == 0);
+	UT_ASSERT(bstr_packed_view(pl, 3).slen == 0);
+	UT_ASSERT(bstr_packed_view(pl, 4).slen < 0);
+
+	struct bstr_list *list = bstr_packed_to_list(pl);
+	UT_ASSERT(list != NULL && list->qty == 4 && list->mlen == 4);
+	UT_ASSERT(strcmp((char *)list->entry[2]->data, "beta") == 0);
+
+	struct bstr_packed_list *again = bstr_packed_from_list(list);
+	UT_ASSERT(again != NULL && again->qty == 4 && again->blen == pl->blen);
+	UT_ASSERT(memcmp(again->blob, pl->blob, pl->blen) == 0);
+	UT_ASSERT(memcmp(again->ofs, pl->ofs, 5 * sizeof(int)) == 0);
+
+	UT_ASSERT(bstr_packed_destroy(again) == BSTR_OK);
+	UT_ASSERT(bstr_packed_destroy(pl) == BSTR_OK);
+	UT_ASSERT(bstr_list_destroy(list) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(str) == BSTR_OK);
+	return UNIT_PASS;
+}
+
+// Test for bstr_join_into and bstr_list_writev
+static unit_result test_bstr_join_into(void)
+{
+	bstr dest = bstr_from_cstr("> ");
+	bstr sep = bstr_from_cstr(", ");
+	struct bstr_list *list = bstr_list_create();
+	UT_ASSERT(dest && sep && list);
+
+	// More entries than fit in one writev batch
+	for (int i = 0; i < 3000; i++) {
+		UT_ASSERT(bstr_list_alloc(list, list->qty + 1) == BSTR_OK);
+		list->entry[list->qty++] = bstr_from_cstr(i % 2 ? "ab" : "");
+	}
+
+	UT_ASSERT(bstr_join_into(dest, list, sep) == BSTR_OK);
+	bstr joined = bstr_join(list, sep);
+	UT_ASSERT(joined != NULL);
+	UT_ASSERT_EQ(joined->slen + 2, dest->slen);
+	UT_ASSERT(memcmp(dest->data + 2, joined->data, joined->slen + 1) == 0);
+
+#ifdef BSTR_HAVE_WRITEV
+	int fds[2];
+	UT_ASSERT(pipe(fds) == 0);
+	UT_ASSERT(bstr_list_writev(fds[1], list, sep) == BSTR_OK);
+	close(fds[1]);
+
+	char *buf = malloc(joined->slen + 1);
+	int got = 0;
+	ssize_t n;
+	UT_ASSERT(buf != NULL);
+	while ((n = read(fds[0], buf + got, joined->slen + 1 - got)) > 0)
+		got += (int)n;
+	close(fds[0]);
+	UT_ASSERT_EQ(joined->slen, got);
+	UT_ASSERT(memcmp(buf, joined->data, got) == 0);
+	free(buf);
+#endif
+
+	// The destination may be one of the entries
+	struct bstr_list *self = bstr_list_create();
+	bstr word = bstr_from_cstr("na");
+	UT_ASSERT(self && word);
+	self->entry[self->qty++] = word;
+	UT_ASSERT(bstr_join_into(word, self, word) == BSTR_OK);
+	UT_ASSERT(strcmp((char *)word->data, "nana") == 0);
+
+	// Only the exact size is available, which must still fit the NUL
+	struct checked_heap heap = { 0 };
+	struct bstr_allocator checked = { checked_alloc, checked_realloc, checked_free, &heap };
+	bstr tight = bstr_from_cstr_with(&checked, "");
+	UT_ASSERT(tight != NULL);
+	for (int i = 0; i < 39; i++) {
+		UT_ASSERT(bstr_list_alloc(self, self->qty + 1) == BSTR_OK);
+		self->entry[self->qty++] = bstr_copy(word);
+	}
+	heap.fail_over = 199;
+	UT_ASSERT(bstr_join_into(tight, self, NULL) == BSTR_OK);
+	UT_ASSERT_EQ(160, tight->slen);
+	UT_ASSERT(tight->data[160] == '\0');
+	UT_ASSERT(bstr_destroy(tight) == BSTR_OK);
+	UT_ASSERT_EQ(0, heap.overruns);
+	UT_ASSERT_EQ(0, heap.live);
+
+	UT_ASSERT(bstr_list_destroy(self) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(joined) == BSTR_OK);
+	UT_ASSERT(bstr_list_destroy(list) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(sep) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(dest) == BSTR_OK);
+	return UNIT_PASS;
+}
+
+// Test for bstr_toupper and bstr_incmp
+static unit_result test_bstr_toupper(void)
+{
+	bstr b = bstr_from_cstr("Content-Length: 42 [\xe9t\xe9] {@`az}");
+	bstr hdr = bstr_from_cstr("CONTENT-TYPE");
+	UT_ASSERT(b && hdr);
+
+	UT_ASSERT(bstr_toupper(b) == BSTR_OK);
+	UT_ASSERT(strcmp((char *)b->data, "CONTENT-LENGTH: 42 [\xe9T\xe9] {@`AZ}") == 0);
+
+	UT_ASSERT(bstr_incmp(b, hdr, 8) == 0);
+	UT_ASSERT(bstr_incmp(b, hdr, 9) < 0);
+	UT_ASSERT(bstr_icmp(b, hdr) < 0);
+	UT_ASSERT(bstr_incmp(hdr, hdr, 100) == 0);
+	UT_ASSERT(bstr_incmp(b, hdr, -1) == SHRT_MIN);
+
+	UT_ASSERT(bstr_destroy(b) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(hdr) == BSTR_OK);
+	return UNIT_PASS;
+}
+
+// Test for binary-safe bstr_cmp, bstr_ncmp and bstr_eq
+static unit_result test_bstr_cmp_binary(void)
+{
+	bstr a = blk_to_bstr("ab\0cd", 5);
+	bstr b = blk_to_bstr("ab\0ce", 5);
+	bstr c = blk_to_bstr("ab\xff", 3);
+	bstr d = blk_to_bstr("ab\x01", 3);
+	UT_ASSERT(a && b && c && d);
+
+	UT_ASSERT(bstr_cmp(a, b) == 'd' - 'e');
+	UT_ASSERT(bstr_ncmp(a, b, 4) == 0);
+	UT_ASSERT(bstr_cmp(c, d) == 0xff - 0x01);
+	UT_ASSERT(bstr_cmp(d, a) > 0);
+	UT_ASSERT(bstr_eq(a, a) == 1);
+	UT_ASSERT(bstr_eq(a, b) == 0);
+	UT_ASSERT(bstr_eq(a, c) == 0);
+	UT_ASSERT(bstr_eq(a, NULL) == BSTR_ERR);
+
+	UT_ASSERT(bstr_destroy(a) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(b) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(c) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(d) == BSTR_OK);
+	return UNIT_PASS;
+}
+
+// Test for bstr_hash and its cached value
+static unit_result test_bstr_hash(void)
+{
+	bstr a = bstr_from_cstr("Content-Type");
+	bstr b = bstr_from_cstr("content-type");
+	bstr tail = bstr_from_cstr("!");
+	UT_ASSERT(a && b && tail);
+
+	uint64_t ha = bstr_hash(a);
+	UT_ASSERT(ha == bstr_hash_blk("Content-Type", 12, 0));
+	UT_ASSERT(ha == bstr_hash_seeded(a, 0));
+	UT_ASSERT(ha != bstr_hash_seeded(a, 1));
+	UT_ASSERT(ha != bstr_hash(b));
+	UT_ASSERT(bstr_eq(a, b) == 0);
+
+	// Every mutator drops the cached value
+	UT_ASSERT(bstr_tolower(a) == BSTR_OK);
+	UT_ASSERT(bstr_hash(a) == bstr_hash(b));
+	UT_ASSERT(bstr_eq(a, b) == 1);
+	UT_ASSERT(bstr_concat(a, tail) == BSTR_OK);
+	UT_ASSERT(bstr_hash(a) == bstr_hash_blk("content-type!", 13, 0));
+	UT_ASSERT(bstr_trunc(a, 7) == BSTR_OK);
+	UT_ASSERT(bstr_hash(a) == bstr_hash_blk("content", 7, 0));
+	UT_ASSERT(bstr_insert(a, 0, tail, ' ') == BSTR_OK);
+	UT_ASSERT(bstr_hash(a) == bstr_hash_blk("!content", 8, 0));
+	UT_ASSERT(bstr_toupper(a) == BSTR_OK);
+	UT_ASSERT(bstr_hash(a) == bstr_hash_blk("!CONTENT", 8, 0));
+	UT_ASSERT(bstr_assign(a, b) == BSTR_OK);
+	UT_ASSERT(bstr_hash(a) == bstr_hash(b));
+	UT_ASSERT(bstr_append_char(a, 'x') == BSTR_OK);
+	UT_ASSERT(bstr_hash(a) == bstr_hash_blk("content-typex", 13, 0));
+
+	// Copies inherit the cached hash along with the bytes
+	bstr c = bstr_copy(a);
+	UT_ASSERT(c != NULL && bstr_eq(a, c) == 1 && bstr_hash(c) == bstr_hash(a));
+
+	// Direct writes announce themselves with bstr_touch
+	UT_ASSERT(bstr_touch(c) == BSTR_OK);
+	c->data[0] = 'C';
+	c->data[--c->slen] = '\0';
+	UT_ASSERT(bstr_hash(c) == bstr_hash_blk("Content-type", 12, 0));
+	UT_ASSERT(bstr_eq(c, a) == 0);
+	UT_ASSERT(bstr_touch(c) == BSTR_OK);
+	c->data[0] = 'c';
+	UT_ASSERT(bstr_eq(c, b) == 1);
+	UT_ASSERT(bstr_touch(NULL) == BSTR_ERR);
+
+	UT_ASSERT(bstr_destroy(a) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(b) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(c) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(tail) == BSTR_OK);
+	return UNIT_PASS;
+}
+
+static int sum_map_values(void *parm, const bstr key, void *value)
+{
+	(void)key;
+	*(long *)parm += (long)(size_t)value;
+	return BSTR_OK;
+}
+
+// Test for bstr_map and bstr_set
+static unit_result test_bstr_map(void)
+{
+	struct bstr_map *m = bstr_map_create();
+	struct bstr_set *s = bstr_set_create();
+	bstr line = bstr_from_cstr("a b c a b a");
+	UT_ASSERT(m && s && line);
+
+	// Count words, looking them up and inserting them as views into the line
+	struct bstr_view_list *words = bstr_split_view(line, ' ');
+	UT_ASSERT(words != NULL);
+	for (int i = 0; i < words->qty; i++) {
+		void **v = bstr_map_get_view(m, words->entry[i]);
+		if (!v)
+			UT_ASSERT(bstr_map_put_view(m, words->entry[i], (void *)(size_t)1) == BSTR_OK);
+		else
+			*v = (void *)((size_t)*v + 1);
+	}
+	UT_ASSERT_EQ(3, m->size);
+	UT_ASSERT((size_t)*bstr_map_get_blk(m, "a", 1) == 3);
+	UT_ASSERT((size_t)*bstr_map_get_blk(m, "b", 1) == 2);
+	UT_ASSERT(bstr_map_get_blk(m, "d", 1) == NULL);
+
+	long total = 0;
+	UT_ASSERT(bstr_map_foreach(m, sum_map_values, &total) == BSTR_OK);
+	UT_ASSERT_EQ(6, total);
+
+	UT_ASSERT(bstr_map_remove_blk(m, "b", 1) == BSTR_OK);
+	UT_ASSERT(bstr_map_remove_blk(m, "b", 1) == BSTR_ERR);
+	UT_ASSERT(bstr_map_get_blk(m, "b", 1) == NULL);
+	UT_ASSERT_EQ(2, m->size);
+
+	// Keys inserted from raw bytes are copied, the empty key included
+	char key[] = "c";
+	UT_ASSERT(bstr_map_put_blk(m, key, 1, (void *)(size_t)7) == BSTR_OK);
+	UT_ASSERT(bstr_map_put_blk(m, "", 0, (void *)(size_t)9) == BSTR_OK);
+	key[0] = 'x';
+	UT_ASSERT_EQ(3, m->size);
+	UT_ASSERT((size_t)*bstr_map_get_blk(m, "c", 1) == 7);
+	UT_ASSERT((size_t)*bstr_map_get_blk(m, "", 0) == 9);
+	UT_ASSERT(bstr_map_put_blk(m, NULL, 1, NULL) == BSTR_ERR);
+	bstr_view empty = { (const unsigned char *)"", 0 };
+	UT_ASSERT(bstr_map_remove_view(m, empty) == BSTR_OK);
+	UT_ASSERT_EQ(2, m->size);
+
+	// Sets report whether a key was new
+	bstr a = bstr_from_cstr("a");
+	UT_ASSERT(a != NULL);
+	UT_ASSERT(bstr_set_add(s, a) == 1);
+	UT_ASSERT(bstr_set_add(s, a) == 0);
+	UT_ASSERT(bstr_set_has_blk(s, "a", 1) == 1);
+	UT_ASSERT(bstr_set_remove(s, a) == BSTR_OK);
+	UT_ASSERT(bstr_set_has(s, a) == 0);
+
+	UT_ASSERT(bstr_destroy(a) == BSTR_OK);
+	UT_ASSERT(bstr_view_list_destroy(words) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(line) == BSTR_OK);
+	UT_ASSERT(bstr_set_destroy(s) == BSTR_OK);
+	UT_ASSERT(bstr_map_destroy(m) == BSTR_OK);
+	return UNIT_PASS;
+}
+
+#ifdef BSTR_HAVE_INTERN
+struct intern_job {
+	struct bstr_intern *	pool;
+	bstr			out[500];
+	int			seed;
+};
+
+static void *intern_worker(void *arg)
+{
+	struct intern_job *job = arg;
+	char name[32];
+
+	for (int n = 0; n < 500; n++) {
+		int k = (n * 7 + job->seed * 13) % 500;
+		job->out[k] = bstr_intern_blk(job->pool, name, sprintf(name, "field_%d", k));
+	}
+	return NULL;
+}
+#endif
+
+// Test for the intern pool
+static unit_result test_bstr_intern(void)
+{
+#ifdef BSTR_HAVE_INTERN
+	struct bstr_intern *pool = bstr_intern_create();
+	bstr host = bstr_from_cstr("host");
+	UT_ASSERT(pool && host);
+
+	bstr a = bstr_intern_cstr(pool, "host");
+	bstr b = bstr_intern(pool, host);
+	UT_ASSERT(a != NULL && a == b && a != host);
+	UT_ASSERT(bstr_intern_blk(pool, "hostname", 4) == a);
+	UT_ASSERT(bstr_intern_blk(pool, "", 0) != NULL);
+
+	// Canonical strings cannot be changed or freed by their users
+	UT_ASSERT(bstr_append_char(a, 's') == BSTR_ERR);
+	UT_ASSERT(bstr_tolower(a) == BSTR_ERR);
+	UT_ASSERT(bstr_trunc(a, 0) == BSTR_ERR);
+	UT_ASSERT(bstr_destroy(a) == BSTR_ERR);
+	UT_ASSERT(strcmp((char *)a->data, "host") == 0);
+
+	// Racing threads agree on every canonical pointer
+	static struct intern_job jobs[4];
+	pthread_t tid[4];
+	for (int i = 0; i < 4; i++) {
+		jobs[i].pool = pool;
+		jobs[i].seed = i;
+		UT_ASSERT(pthread_create(&tid[i], NULL, intern_worker, &jobs[i]) == 0);
+	}
+	for (int i = 0; i < 4; i++)
+		pthread_join(tid[i], NULL);
+	for (int k = 0; k < 500; k++) {
+		UT_ASSERT(jobs[0].out[k] != NULL);
+		for (int i = 1; i < 4; i++)
+			UT_ASSERT(jobs[i].out[k] == jobs[0].out[k]);
+	}
+
+	struct bstr_intern_stats st;
+	bstr_intern_stats(pool, &st);
+	UT_ASSERT_EQ(502, (int)st.strings);
+	UT_ASSERT(st.string_bytes >= 502 * BSTR__HDR_SIZE);
+	UT_ASSERT(st.table_bytes >= sizeof(struct bstr_intern));
+	bstr_intern_stats(pool, NULL);
+
+	// 502 strings reach every shard
+	for (int i = 0; i < BSTR_INTERN_SHARDS; i++)
+		UT_ASSERT(pool->shards[i].count > 0);
+
+	UT_ASSERT(bstr_intern_destroy(pool) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(host) == BSTR_OK);
+#endif
+	return UNIT_PASS;
+}
+
+static int vappendf_helper(bstr b, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	int ret = bstr_vappendf(b, fmt, args);
+	va_end(args);
+	return ret;
+}
+
+// Test for bstr_appendf and single-pass formatting
+static unit_result test_bstr_appendf(void)
+{
+	bstr b = bstr_from_cstr("GET ");
+	UT_ASSERT(b != NULL);
+
+	UT_ASSERT(bstr_appendf(b, "/%s?id=%d", "items", 42) == BSTR_OK);
+	UT_ASSERT(strcmp((char *)b->data, "GET /items?id=42") == 0);
+	UT_ASSERT_EQ(16, b->slen);
+
+	// Output larger than the spare capacity takes the second pass
+	UT_ASSERT(bstr_appendf(b, " %0200d", 7) == BSTR_OK);
+	UT_ASSERT_EQ(217, b->slen);
+	UT_ASSERT(b->data[216] == '7' && b->data[217] == '\0');
+	UT_ASSERT(strncmp((char *)b->data, "GET /items?id=42 000", 20) == 0);
+
+	UT_ASSERT(vappendf_helper(b, "%c%c", '!', '?') == BSTR_OK);
+	UT_ASSERT(strcmp((char *)b->data + 217, "!?") == 0);
+
+	// Formatting replaces the contents and reuses the buffer
+	unsigned char *data = b->data;
+	UT_ASSERT(bstr_format(b, "%s-%u", "v", 3u) == BSTR_OK);
+	UT_ASSERT(strcmp((char *)b->data, "v-3") == 0 && b->slen == 3);
+	UT_ASSERT(b->data == data);
+
+	// Reformatting into a buffer with room takes a single pass
+	UT_ASSERT(bstr_format(b, "%0100d", 1) == BSTR_OK);
+	UT_ASSERT(bstr_format(b, "v-%d", 3) == BSTR_OK);
+	vsnprintf_calls = 0;
+	UT_ASSERT(bstr_format(b, "%s-%u", "w", 4u) == BSTR_OK);
+	UT_ASSERT(strcmp((char *)b->data, "w-4") == 0 && b->slen == 3);
+	UT_ASSERT_EQ(1, vsnprintf_calls);
+	UT_ASSERT(bstr_format(b, "%s-%u", "v", 3u) == BSTR_OK);
+
+#ifdef __GLIBC__
+	// An encoding error in the C locale leaves the contents alone
+	UT_ASSERT(bstr_format(b, "lost%lc", (wint_t)0x20ac) == BSTR_ERR);
+	UT_ASSERT(strcmp((char *)b->data, "v-3") == 0 && b->slen == 3);
+	UT_ASSERT(bstr_appendf(b, "lost%lc", (wint_t)0x20ac) == BSTR_ERR);
+	UT_ASSERT(strcmp((char *)b->data, "v-3") == 0 && b->slen == 3);
+#endif
+
+	UT_ASSERT(bstr_appendf(NULL, "x") == BSTR_ERR);
+	UT_ASSERT(bstr_destroy(b) == BSTR_OK);
+	return UNIT_PASS;
+}
+
+// Test for the typed append functions
+static unit_result test_bstr_append_numbers(void)
+{
+	bstr b = bstr_from_cstr("");
+	UT_ASSERT(b != NULL);
+
+	UT_ASSERT(bstr_append_i64(b, INT64_MIN) == BSTR_OK);
+	UT_ASSERT(bstr_append_char(b, ' ') == BSTR_OK);
+	UT_ASSERT(bstr_append_u64(b, UINT64_MAX) == BSTR_OK);
+	UT_ASSERT(bstr_append_char(b, ' ') == BSTR_OK);
+	UT_ASSERT(bstr_append_hex(b, 0xdeadbeefull) == BSTR_OK);
+	UT_ASSERT(bstr_append_char(b, ' ') == BSTR_OK);
+	UT_ASSERT(bstr_append_i64(b, 0) == BSTR_OK);
+	UT_ASSERT(strcmp((char *)b->data,
+			 "-9223372036854775808 18446744073709551615 deadbeef 0") == 0);
+
+	static const struct {
+		double		v;
+		const char *	s;
+	} shortest[] = {
+		{ 0.1, "0.1" }, { -2.5, "-2.5" }, { 100.0, "100" }, { 1e21, "1e+21" },
+		{ 1e-7, "1e-7" }, { 0.000001, "0.000001" }, { 5e-324, "5e-324" },
+		{ 1.7976931348623157e308, "1.7976931348623157e+308" }, { -0.0, "-0" },
+	};
+	for (size_t i = 0; i < sizeof(shortest) / sizeof(shortest[0]); i++) {
+		UT_ASSERT(bstr_trunc(b, 0) == BSTR_OK);
+		UT_ASSERT(bstr_append_double(b, shortest[i].v) == BSTR_OK);
+		UT_ASSERT(strcmp((char *)b->data, shortest[i].s) == 0);
+	}
+
+	UT_ASSERT(bstr_trunc(b, 0) == BSTR_OK);
+	UT_ASSERT(bstr_append_fixed(b, 2.675, 2) == BSTR_OK);    // 2.67499999...
+	UT_ASSERT(bstr_append_char(b, ' ') == BSTR_OK);
+	UT_ASSERT(bstr_append_fixed(b, 0.125, 2) == BSTR_OK);    // ties go to even
+	UT_ASSERT(bstr_append_char(b, ' ') == BSTR_OK);
+	UT_ASSERT(bstr_append_fixed(b, -0.001, 1) == BSTR_OK);
+	UT_ASSERT(bstr_append_char(b, ' ') == BSTR_OK);
+	UT_ASSERT(bstr_append_fixed(b, 1e300, 0) == BSTR_OK);
+	UT_ASSERT(strncmp((char *)b->data, "2.67 0.12 -0.0 1000000000000000052504", 37) == 0);
+	UT_ASSERT_EQ(15 + 301, b->slen);
+	UT_ASSERT(bstr_append_fixed(b, 1.0, -1) == BSTR_ERR);
+
+	UT_ASSERT(bstr_destroy(b) == BSTR_OK);
+	return UNIT_PASS;
+}
+
+// Test for bstr_rope
+static unit_result test_bstr_rope(void)
+{
+	struct bstr_rope *r = bstr_rope_create();
+	UT_ASSERT(r != NULL);
+	UT_ASSERT(bstr_rope_append_blk(r, "world", 5) == BSTR_OK);
+	UT_ASSERT(bstr_rope_prepend_blk(r, "hello ", 6) == BSTR_OK);
+	UT_ASSERT(bstr_rope_insert_blk(r, 5, ",", 1) == BSTR_OK);
+	UT_ASSERT(bstr_rope_insert_blk(r, 13, "x", 1) == BSTR_ERR);
+
+	bstr flat = bstr_rope_flatten(r);
+	UT_ASSERT(flat != NULL);
+	UT_ASSERT(strcmp((char *)flat->data, "hello, world") == 0);
+	UT_ASSERT(bstr_rope_flatten(r) == flat);
+	UT_ASSERT(bstr_catcstr(flat, "!") == BSTR_ERR);
+
+	// Spans several chunks, with inserts splitting them
+	static char block[3 * BSTR_ROPE_CHUNK + 7];
+	for (int i = 0; i < (int)sizeof(block); i++)
+		block[i] = (char)('a' + i % 26);
+	UT_ASSERT(bstr_rope_append_blk(r, block, sizeof(block)) == BSTR_OK);
+	UT_ASSERT(bstr_rope_insert_blk(r, BSTR_ROPE_CHUNK + 3, "<>", 2) == BSTR_OK);
+	UT_ASSERT_EQ(12 + (int)sizeof(block) + 2, bstr_rope_len(r));
+	flat = bstr_rope_flatten(r);
+	UT_ASSERT(flat != NULL);
+	UT_ASSERT_EQ(bstr_rope_len(r), flat->slen);
+	UT_ASSERT(memcmp(flat->data + BSTR_ROPE_CHUNK + 3, "<>", 2) == 0);
+
+#ifdef BSTR_HAVE_WRITEV
+	int fds[2];
+	UT_ASSERT(pipe(fds) == 0);
+	UT_ASSERT(bstr_rope_write(fds[1], r) == BSTR_OK);
+	close(fds[1]);
+
+	char *buf = malloc(flat->slen + 1);
+	int got = 0;
+	ssize_t n;
+	UT_ASSERT(buf != NULL);
+	while ((n = read(fds[0], buf + got, flat->slen + 1 - got)) > 0)
+		got += (int)n;
+	close(fds[0]);
+	UT_ASSERT_EQ(flat->slen, got);
+	UT_ASSERT(memcmp(buf, flat->data, got) == 0);
+	free(buf);
+#endif
+
+	UT_ASSERT(bstr_rope_destroy(r) == BSTR_OK);
+
+	// A failed allocation leaves the rope as it was
+	struct checked_heap heap = { 0 };
+	struct bstr_allocator checked = { checked_alloc, checked_realloc, checked_free, &heap };
+	const struct bstr_allocator *old = bstr_set_allocator(&checked);
+	r = bstr_rope_create();
+	bstr_set_allocator(old);
+	UT_ASSERT(r != NULL);
+	UT_ASSERT(bstr_rope_append_blk(r, "world", 5) == BSTR_OK);
+	UT_ASSERT(bstr_rope_prepend_blk(r, "hello ", 6) == BSTR_OK);
+	heap.fail_at = heap.calls + 2;
+	UT_ASSERT(bstr_rope_append_blk(r, block, sizeof(block)) == BSTR_ERR);
+	UT_ASSERT_EQ(11, bstr_rope_len(r));
+	heap.fail_at = heap.calls + 2;
+	UT_ASSERT(bstr_rope_prepend_blk(r, block, sizeof(block)) == BSTR_ERR);
+	UT_ASSERT_EQ(11, bstr_rope_len(r));
+	flat = bstr_rope_flatten(r);
+	UT_ASSERT(flat != NULL);
+	UT_ASSERT(strcmp((char *)flat->data, "hello world") == 0);
+
+	// Typing into the middle grows one chunk instead of adding one per key
+	heap.fail_at = 0;
+	UT_ASSERT(bstr_rope_append_blk(r, block, sizeof(block)) == BSTR_OK);
+	size_t before = heap.bytes;
+	int at = 11 + (int)sizeof(block) / 2;
+	for (int i = 0; i < 1000; i++)
+		UT_ASSERT(bstr_rope_insert_blk(r, at + i, "k", 1) == BSTR_OK);
+	// A few bytes per key, plus a node header per chunk when chunks are tiny
+	UT_ASSERT(heap.bytes - before < 8 * 1000 + 2000 / BSTR_ROPE_CHUNK * sizeof(struct bstr_rope_node));
+	flat = bstr_rope_flatten(r);
+	UT_ASSERT(flat != NULL);
+	UT_ASSERT_EQ(11 + (int)sizeof(block) + 1000, flat->slen);
+	UT_ASSERT(flat->data[at + 999] == 'k' && flat->data[at + 1000] == block[at - 11]);
+	UT_ASSERT(memcmp(flat->data + 11, block, at - 11) == 0);
+	UT_ASSERT(bstr_rope_destroy(r) == BSTR_OK);
+	UT_ASSERT_EQ(0, heap.bad_sizes);
+	UT_ASSERT_EQ(0, heap.live);
+	return UNIT_PASS;
+}
+
+// Test for bstr_gap
+static unit_result test_bstr_gap(void)
+{
+	bstr init = bstr_from_cstr("hello world");
+	struct bstr_gap *g = bstr_gap_create(init);
+	UT_ASSERT(g != NULL);
+	UT_ASSERT(bstr_gap_insert_blk(g, 5, ",", 1) == BSTR_OK);
+	UT_ASSERT(bstr_gap_delete(g, 7, 5) == BSTR_OK);
+	UT_ASSERT(bstr_gap_insert_blk(g, 7, "there", 5) == BSTR_OK);
+	UT_ASSERT(bstr_gap_insert_blk(g, 13, "x", 1) == BSTR_ERR);
+	UT_ASSERT_EQ(12, bstr_gap_len(g));
+
+	bstr s = bstr_gap_str(g);
+	UT_ASSERT(s != NULL);
+	UT_ASSERT(strcmp((char *)s->data, "hello, there") == 0);
+	UT_ASSERT(bstr_catcstr(s, "!") == BSTR_ERR);
+
+	// Inserting the buffer's own contents, which forces it to grow
+	for (int i = 0; i < 6; i++) {
+		s = bstr_gap_str(g);
+		UT_ASSERT(bstr_gap_insert(g, 0, s) == BSTR_OK);
+	}
+	UT_ASSERT_EQ(12 * 64, bstr_gap_len(g));
+	UT_ASSERT(bstr_gap_delete(g, 12, INT_MAX) == BSTR_OK);
+
+	bstr out = bstr_gap_release(g);
+	UT_ASSERT(out != NULL);
+	UT_ASSERT(bstr_catcstr(out, "!") == BSTR_OK);
+	UT_ASSERT(strcmp((char *)out->data, "hello, there!") == 0);
+	UT_ASSERT(bstr_destroy(out) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(init) == BSTR_OK);
+	return UNIT_PASS;
+}
+
+#ifdef BSTR_HAVE_INTERN
+static void *share_worker(void *arg)
+{
+	bstr src = arg;
+
+	// Copy, change and drop shares of the same buffer concurrently
+	for (int n = 0; n < 2000; n++) {
+		bstr c = bstr_copy(src);
+		if (!c)
+			return arg;
+		if (n % 3 == 0 && bstr_catcstr(c, "!") != BSTR_OK)
+			return arg;
+		if (c->data[0] != 'p' || bstr_destroy(c) != BSTR_OK)
+			return arg;
+	}
+	return NULL;
+}
+#endif
+
+// Test for copy-on-write sharing
+static unit_result test_bstr_share(void)
+{
+	bstr a = bstr_from_cstr("payload payload payload payload payload");
+	UT_ASSERT(a != NULL);
+	bstr b = bstr_share(a);
+	bstr c = bstr_copy(b);
+	UT_ASSERT(b != NULL && c != NULL);
+	UT_ASSERT_EQ(1, bstr_eq(a, c));
+#ifdef BSTR_HAVE_SHARE
+	UT_ASSERT(b->data == a->data && c->data == a->data);
+#endif
+
+	// The first change gives the changed string its own buffer
+	UT_ASSERT(bstr_toupper(b) == BSTR_OK);
+	UT_ASSERT(strncmp((char *)b->data, "PAYLOAD", 7) == 0);
+	UT_ASSERT(strncmp((char *)a->data, "payload", 7) == 0);
+	UT_ASSERT(bstr_trunc(c, 7) == BSTR_OK);
+	UT_ASSERT(strcmp((char *)c->data, "payload") == 0);
+	UT_ASSERT_EQ(39, a->slen);
+
+	// A direct write after bstr_touch leaves the other owners alone
+	bstr d = bstr_copy(a);
+	UT_ASSERT(d != NULL);
+	UT_ASSERT(bstr_touch(d) == BSTR_OK);
+	UT_ASSERT(d->data != a->data);
+	d->data[0] = 'P';
+	UT_ASSERT(strncmp((char *)a->data, "payload", 7) == 0);
+	UT_ASSERT(strncmp((char *)d->data, "Payload", 7) == 0);
+	UT_ASSERT(bstr_destroy(d) == BSTR_OK);
+
+	// With the other owners gone, the last one grows past the buffer
+	UT_ASSERT(bstr_destroy(b) == BSTR_OK);
+	UT_ASSERT(bstr_destroy(c) == BSTR_OK);
+	UT_ASSERT(bstr_catcstr(a, " and more") == BSTR_OK);
+	UT_ASSERT_EQ(48, a->slen);
+	UT_ASSERT(strcmp((char *)a->data + 39, " and more") == 0);
+
+#ifdef BSTR_HAVE_INTERN
+	pthread_t tid[4];
+	bstr src = bstr_share(a);
+	UT_ASSERT(src != NULL);
+	for (int i = 0; i < 4; i++)
+		UT_ASSERT(pthread_create(&tid[i], NULL, share_worker, src) == 0);
+	for (int i = 0; i < 4; i++) {
+		void *ret;
+		UT_ASSERT(pthread_join(tid[i], &ret) == 0);
+		UT_ASSERT(ret == NULL);
+	}
+	UT_ASSERT_EQ(1, bstr_eq(a, src));
+	UT_ASSERT(bstr_destroy(src) == BSTR_OK);
+#endif
+
+	UT_ASSERT(bstr_destroy(a) == BSTR_OK);
+	return UNIT_PASS;
+}
+
+#ifdef BSTR_HAVE_MMAP
+// The large build defines _DEFAULT_SOURCE so that the hint path is compiled
+#if defined(_DEFAULT_SOURCE) && defined(__GLIBC__) && !defined(BSTR_NO_MADVISE) && !defined(BSTR_HAVE_MADVISE)
+#error "bstr_map_file would send no access hints"
+#endif
+
+static bstr map_contents(const char *path, const void *blk, size_t len)
+{
+	FILE *f = fopen(path, "wb");
+
+	if (!f) return NULL;
+	if (len) fwrite(blk, 1, len, f);
+	fclose(f);
+	return bstr_map_file(path);
+}
+
+#endif
+
+static unit_result test_bstr_map_file(void)
+{
+#ifdef BSTR_HAVE_MMAP
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/test_bstr_map_%d", (int)getpid());
+
+	const char *text = "alpha,beta,,gamma";
+	bstr m = map_contents(path, text, strlen(text));
+	bstr expect = bstr_from_cstr(text);
+	UT_ASSERT(m != NULL && expect != NULL);
+	UT_ASSERT_EQ(17, m->slen);
+	UT_ASSERT_EQ('\0', m->data[m->slen]);
+	UT_ASSERT_EQ(0, bstr_cmp(m, expect));
+	UT_ASSERT(bstr_eq(m, expect));
+	UT_ASSERT_EQ(bstr_hash(expect), bstr_hash(m));
+
+	bstr needle = bstr_from_cstr("gamma");
+	UT_ASSERT_EQ(12, bstr_find(m, 0, needle));
+	int tokens[1 + 2 * 8] = { 0 };
+	UT_ASSERT(bstr_split_cb(m, ',', 0, record_token, tokens) >= 0);
+	UT_ASSERT_EQ(4, tokens[0]);
+	UT_ASSERT_EQ(0, tokens[6]);
+
+	// Mutation fails and leaves the mapping alone; copies are private
+	UT_ASSERT_EQ(BSTR_ERR, bstr_catcstr(m, "x"));
+	UT_ASSERT_EQ(BSTR_ERR, bstr_toupper(m));
+	bstr c = bstr_copy(m);
+	UT_ASSERT(c != NULL && c->data != m->data);
+	UT_ASSERT_EQ(BSTR_OK, bstr_toupper(c));
+	UT_ASSERT_EQ(0, bstr_cmp(m, expect));
+	UT_ASSERT_EQ(BSTR_OK, bstr_destroy(c));
+	UT_ASSERT_EQ(BSTR_OK, bstr_destroy(m));
+
+	// A file ending on a page boundary is still NUL-terminated
+	size_t pg = (size_t)sysconf(_SC_PAGESIZE);
+	char *page = malloc(pg);
+	UT_ASSERT(page != NULL);
+	memset(page, 'p', pg);
+	m = map_contents(path, page, pg);
+	UT_ASSERT(m != NULL);
+	UT_ASSERT_EQ((bstr_len_t)pg, m->slen);
+	UT_ASSERT_EQ('\0', m->data[m->slen]);
+	UT_ASSERT_EQ((bstr_len_t)pg - 1, bstr_rchr(m, 'p', m->slen - 1));
+	UT_ASSERT_EQ(BSTR_OK, bstr_destroy(m));
+	free(page);
+
+	m = map_contents(path, "", 0);
+	UT_ASSERT(m != NULL);
+	UT_ASSERT_EQ(0, m->slen);
+	UT_ASSERT_EQ('\0', m->data[0]);
+	UT_ASSERT_EQ(BSTR_OK, bstr_destroy(m));
+
+	remove(path);
+	UT_ASSERT(bstr_map_file(path) == NULL);
+	UT_ASSERT(bstr_map_file("/") == NULL);
+	UT_ASSERT(bstr_map_file(NULL) == NULL);
+
+	bstr_destroy(needle);
+	bstr_destroy(expect);
+#endif
+	return UNIT_PASS;
+}
+
+static int record_offset(void *parm, bstr_len_t ofs, bstr_len_t len)
+{
+	bstr_len_t *out = parm;
+
+	(void)len;
+	if (out[0] < 4)
+		out[1 + out[0]] = ofs;
+	out[0]++;
+	return BSTR_OK;
+}
+
+// Test for offsets past INT_MAX, over a sparse file so it costs no disk
+static unit_result test_bstr_large_offsets(void)
+{
+#if defined(BSTR_LARGE_STRINGS) && defined(BSTR_HAVE_MMAP)
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/test_bstr_large_%d", (int)getpid());
+
+	bstr_len_t at = (bstr_len_t)INT_MAX + 12346;
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	int ready = fd >= 0 && ftruncate(fd, (off_t)at + 4096) == 0 &&
+		    pwrite(fd, "a,needle,b", 10, (off_t)at) == 10;
+	if (fd >= 0)
+		close(fd);
+	bstr m = ready ? bstr_map_file(path) : NULL;
+	remove(path);
+	if (!m) {
+		// Skipped where the file system or address space is too small
+		printf("    # skipped: cannot map a sparse file past 2 GiB\n");
+		return UNIT_PASS;
+	}
+	UT_ASSERT(m->slen == at + 4096);
+
+	bstr needle = bstr_from_cstr("needle");
+	UT_ASSERT(needle != NULL);
+	bstr_len_t from = (bstr_len_t)INT_MAX - 100;
+	UT_ASSERT(bstr_find(m, from, needle) == at + 2);
+	UT_ASSERT(bstr_rchr(m, ',', m->slen - 1) == at + 8);
+
+	struct bstr_pattern *pat = bstr_pattern_compile(needle);
+	UT_ASSERT(pat != NULL);
+	UT_ASSERT(bstr_pattern_find(pat, m, from) == at + 2);
+	UT_ASSERT(bstr_pattern_count(pat, m, from) == 1);
+	bstr_pattern_destroy(pat);
+
+	bstr_len_t tokens[5] = { 0 };
+	UT_ASSERT(bstr_split_cb(m, ',', from, record_offset, tokens) >= 0);
+	UT_ASSERT(tokens[0] == 3);
+	UT_ASSERT(tokens[1] == from);
+	UT_ASSERT(tokens[2] == at + 2);
+	UT_ASSERT(tokens[3] == at + 9);
+
+	bstr_destroy(needle);
+	UT_ASSERT(bstr_destroy(m) == BSTR_OK);
+#endif
+	return UNIT_PASS;
+}
+
 // Property Tests
 
 // Property: Creating a bstr from a C string should preserve the
@@ -708,6 +2032,698 @@ static prop_result prop_bstr_join(void *env)
 	return PROP_PASS;
 }
 
+// Reference implementation of the original byte-by-byte bstr_find
+static int naive_find(const bstr b1, int pos, const bstr b2)
+{
+	int lf = b1->slen - b2->slen + 1;
+
+	for (int i = pos; i < lf; i++)
+		if (b2->data[0] == b1->data[i] &&
+		    memcmp(b1->data + i, b2->data, b2->slen) == 0)
+			return i;
+	return BSTR_ERR;
+}
+
+// Property: bstr_find agrees with the byte-by-byte search at every SIMD level
+static prop_result prop_bstr_find(void *env)
+{
+	(void)env; // Unused parameter
+
+	static const char alphabet[] = "ab";
+	int hlen = rand() % 300;
+	int nlen = 1 + rand() % 6;
+	char *hs = malloc(hlen + 1);
+	char *ns = malloc(nlen + 1);
+	if (!hs || !ns) {
+		free(hs);
+		free(ns);
+		return PROP_FAIL;
+	}
+
+	// A two-letter alphabet produces lots of partial matches
+	for (int i = 0; i < hlen; i++)
+		hs[i] = alphabet[rand() % 2];
+	for (int i = 0; i < nlen; i++)
+		ns[i] = alphabet[rand() % 2];
+	hs[hlen] = ns[nlen] = '\0';
+
+	bstr h = bstr_from_cstr(hs);
+	bstr n = bstr_from_cstr(ns);
+	free(hs);
+	free(ns);
+	if (!h || !n) {
+		bstr_destroy(h);
+		bstr_destroy(n);
+		return PROP_FAIL;
+	}
+
+	prop_result result = PROP_PASS;
+	int old = bstr_set_simd_level(BSTR_SIMD_AVX2);
+	for (int level = BSTR_SIMD_NONE; level <= BSTR_SIMD_AVX2; level++) {
+		bstr_set_simd_level(level);
+		for (int pos = 0; pos <= hlen; pos += 1 + rand() % 7)
+			if (bstr_find(h, pos, n) != naive_find(h, pos, n))
+				result = PROP_FAIL;
+	}
+	bstr_set_simd_level(old);
+
+	bstr_destroy(h);
+	bstr_destroy(n);
+	return result;
+}
+
+// Property: a compiled pattern finds the same positions as bstr_find
+static prop_result prop_bstr_pattern_find(void *env)
+{
+	(void)env; // Unused parameter
+
+	char hs[256], ns[16];
+	int hlen = rand() % 256;
+	int nlen = 1 + rand() % 16;
+
+	for (int i = 0; i < hlen; i++)
+		hs[i] = "ab"[rand() % 2];
+	for (int i = 0; i < nlen; i++)
+		ns[i] = "ab"[rand() % 2];
+
+	bstr h = blk_to_bstr(hs, hlen);
+	bstr n = blk_to_bstr(ns, nlen);
+	struct bstr_pattern *pat = bstr_pattern_compile(n);
+	if (!h || !n || !pat) {
+		bstr_destroy(h);
+		bstr_destroy(n);
+		bstr_pattern_destroy(pat);
+		return PROP_FAIL;
+	}
+
+	prop_result result = PROP_PASS;
+	for (int pos = 0; pos <= hlen; pos++)
+		if (bstr_pattern_find(pat, h, pos) != bstr_find(h, pos, n))
+			result = PROP_FAIL;
+
+	bstr_destroy(h);
+	bstr_destroy(n);
+	bstr_pattern_destroy(pat);
+	return result;
+}
+
+static int count_ac_match(void *parm, int idx, bstr_len_t ofs)
+{
+	int *counts = parm;
+
+	(void)ofs;
+	counts[idx]++;
+	return BSTR_OK;
+}
+
+// Property: the automaton reports as many matches per needle as bstr_find
+static prop_result prop_bstr_ac_search(void *env)
+{
+	(void)env; // Unused parameter
+
+	char hs[200];
+	int hlen = rand() % 200;
+	for (int i = 0; i < hlen; i++)
+		hs[i] = "abc"[rand() % 3];
+
+	bstr h = blk_to_bstr(hs, hlen);
+	bstr_list *needles = bstr_list_create();
+	if (!h || !needles || bstr_list_alloc(needles, 8) != BSTR_OK) {
+		bstr_destroy(h);
+		bstr_list_destroy(needles);
+		return PROP_FAIL;
+	}
+	for (int i = 0; i < 8; i++) {
+		char ns[5];
+		int nlen = 1 + rand() % 5;
+		for (int j = 0; j < nlen; j++)
+			ns[j] = "abc"[rand() % 3];
+		needles->entry[needles->qty++] = blk_to_bstr(ns, nlen);
+	}
+
+	struct bstr_ac *ac = bstr_ac_compile(needles);
+	int counts[8] = { 0 };
+	prop_result result = PROP_FAIL;
+	if (ac && bstr_ac_search(ac, h, 0, count_ac_match, counts) >= 0) {
+		result = PROP_PASS;
+		for (int i = 0; i < 8; i++) {
+			int expected = 0;
+			for (int p = bstr_find(h, 0, needles->entry[i]); p >= 0;
+			     p = bstr_find(h, p + 1, needles->entry[i]))
+				expected++;
+			if (counts[i] != expected)
+				result = PROP_FAIL;
+		}
+	}
+
+	bstr_ac_destroy(ac);
+	bstr_list_destroy(needles);
+	bstr_destroy(h);
+	return result;
+}
+
+// Property: bstr_split_cb yields the same tokens at every SIMD level
+static prop_result prop_bstr_split_cb(void *env)
+{
+	(void)env; // Unused parameter
+
+	static int expected[1 + 2 * 1024], actual[1 + 2 * 1024];
+	char buf[1000];
+	int len = rand() % 1000;
+	int pos = len ? rand() % len : 0;
+
+	for (int i = 0; i < len; i++)
+		buf[i] = (rand() % 4) ? 'x' : ',';
+
+	bstr str = blk_to_bstr(buf, len);
+	if (!str)
+		return PROP_FAIL;
+
+	// Tokens computed by hand
+	expected[0] = 0;
+	int start = pos;
+	for (int i = pos; i <= len; i++) {
+		if (i == len || buf[i] == ',') {
+			record_token(expected, start, i - start);
+			start = i + 1;
+		}
+	}
+
+	prop_result result = PROP_PASS;
+	int old = bstr_set_simd_level(BSTR_SIMD_AVX2);
+	for (int level = BSTR_SIMD_NONE; level <= BSTR_SIMD_AVX2; level++) {
+		bstr_set_simd_level(level);
+		actual[0] = 0;
+		if (bstr_split_cb(str, ',', pos, record_token, actual) < 0 ||
+		    memcmp(expected, actual, (1 + 2 * expected[0]) * sizeof(int)) != 0)
+			result = PROP_FAIL;
+	}
+	bstr_set_simd_level(old);
+
+	bstr_destroy(str);
+	return result;
+}
+
+// Property: bstr_spn, bstr_cspn and bstr_splits_cb agree with memchr over
+// the set at every SIMD level
+static prop_result prop_bstr_charset(void *env)
+{
+	(void)env; // Unused parameter
+
+	static int expected[1 + 2 * 600], actual[1 + 2 * 600];
+	unsigned char buf[600], set[12];
+	int len = rand() % 600;
+	int nset = 1 + rand() % 12;
+
+	for (int i = 0; i < nset; i++)
+		set[i] = (unsigned char)rand();
+	for (int i = 0; i < len; i++)
+		buf[i] = (rand() % 3) ? set[rand() % nset] : (unsigned char)rand();
+
+	bstr str = blk_to_bstr(buf, len);
+	bstr accept = blk_to_bstr(set, nset);
+	if (!str || !accept) {
+		bstr_destroy(str);
+		bstr_destroy(accept);
+		return PROP_FAIL;
+	}
+
+	int spn = 0, cspn = 0;
+	while (spn < len && memchr(set, buf[spn], nset))
+		spn++;
+	while (cspn < len && !memchr(set, buf[cspn], nset))
+		cspn++;
+	expected[0] = 0;
+	for (int i = 0, start = 0; i <= len; i++) {
+		if (i == len || memchr(set, buf[i], nset)) {
+			record_token(expected, start, i - start);
+			start = i + 1;
+		}
+	}
+
+	prop_result result = PROP_PASS;
+	int old = bstr_set_simd_level(BSTR_SIMD_AVX2);
+	for (int level = BSTR_SIMD_NONE; level <= BSTR_SIMD_AVX2; level++) {
+		bstr_set_simd_level(level);
+		actual[0] = 0;
+		if (bstr_spn(str, accept) != spn || bstr_cspn(str, accept) != cspn ||
+		    bstr_splits_cb(str, accept, 0, record_token, actual) < 0 ||
+		    memcmp(expected, actual, (1 + 2 * expected[0]) * sizeof(int)) != 0)
+			result = PROP_FAIL;
+	}
+	bstr_set_simd_level(old);
+
+	bstr_destroy(str);
+	bstr_destroy(accept);
+	return result;
+}
+
+// Property: bstr_split_str_cb matches a naive left-to-right scan
+static prop_result prop_bstr_split_str_cb(void *env)
+{
+	(void)env; // Unused parameter
+
+	static int expected[1 + 2 * 400], actual[1 + 2 * 400];
+	char hs[400], ss[6];
+	int hlen = rand() % 400;
+	int slen = 2 + rand() % 5;
+
+	for (int i = 0; i < hlen; i++)
+		hs[i] = "ab"[rand() % 2];
+	for (int i = 0; i < slen; i++)
+		ss[i] = "ab"[rand() % 2];
+
+	bstr str = blk_to_bstr(hs, hlen);
+	bstr sep = blk_to_bstr(ss, slen);
+	if (!str || !sep) {
+		bstr_destroy(str);
+		bstr_destroy(sep);
+		return PROP_FAIL;
+	}
+
+	expected[0] = 0;
+	int start = 0;
+	for (int i = 0; i + slen <= hlen;) {
+		if (memcmp(hs + i, ss, slen) == 0) {
+			record_token(expected, start, i - start);
+			i += slen;
+			start = i;
+		} else {
+			i++;
+		}
+	}
+	record_token(expected, start, hlen - start);
+
+	actual[0] = 0;
+	prop_result result = PROP_PASS;
+	if (bstr_split_str_cb(str, sep, 0, record_token, actual) < 0 ||
+	    memcmp(expected, actual, (1 + 2 * expected[0]) * sizeof(int)) != 0)
+		result = PROP_FAIL;
+
+	bstr_destroy(str);
+	bstr_destroy(sep);
+	return result;
+}
+
+// Property: bstr_split_view yields the same fields as bstr_split
+static prop_result prop_bstr_split_view(void *env)
+{
+	(void)env; // Unused parameter
+
+	char buf[300];
+	int len = rand() % 300;
+	for (int i = 0; i < len; i++)
+		buf[i] = "a,b"[rand() % 3];
+
+	bstr str = blk_to_bstr(buf, len);
+	struct bstr_list *list = bstr_split(str, ',');
+	struct bstr_view_list *views = bstr_split_view(str, ',');
+	prop_result result = PROP_PASS;
+
+	if (!str || !list || !views || list->qty != views->qty) {
+		result = PROP_FAIL;
+	} else {
+		for (int i = 0; i < list->qty; i++)
+			if (bstr_view_cmp(bstr_view_of(list->entry[i]), views->entry[i]) != 0)
+				result = PROP_FAIL;
+	}
+
+	bstr_view_list_destroy(views);
+	bstr_list_destroy(list);
+	bstr_destroy(str);
+	return result;
+}
+
+// Property: case mapping and case-insensitive comparison agree with
+// tolower()/toupper() at every SIMD level
+static prop_result prop_bstr_case(void *env)
+{
+	(void)env; // Unused parameter
+
+	unsigned char s[200], t[200], lo[200], up[200];
+	int len = rand() % 200;
+	for (int i = 0; i < len; i++) {
+		s[i] = (unsigned char)(rand() % 8 ? 0x20 + rand() % 0x60 : rand() % 256);
+		t[i] = (unsigned char)(rand() % 2 ? tolower(s[i]) : toupper(s[i]));
+		lo[i] = (unsigned char)tolower(s[i]);
+		up[i] = (unsigned char)toupper(s[i]);
+	}
+	if (len && rand() % 2)
+		t[rand() % len] ^= (unsigned char)(1 << rand() % 8);
+
+	int diff = 0;
+	for (int i = 0; i < len && !diff; i++)
+		diff = tolower(s[i]) - tolower(t[i]);
+
+	prop_result result = PROP_PASS;
+	int saved = bstr_simd_level();
+	for (int level = BSTR_SIMD_NONE; level <= BSTR_SIMD_AVX2; level++) {
+		bstr_set_simd_level(level);
+		bstr a = blk_to_bstr(s, len);
+		bstr b = blk_to_bstr(t, len);
+		bstr c = blk_to_bstr(s, len);
+		if (!a || !b || !c || bstr_icmp(a, b) != diff || bstr_incmp(a, b, len) != diff ||
+		    bstr_tolower(a) != BSTR_OK || memcmp(a->data, lo, len) != 0 ||
+		    bstr_toupper(c) != BSTR_OK || memcmp(c->data, up, len) != 0)
+			result = PROP_FAIL;
+		bstr_destroy(a);
+		bstr_destroy(b);
+		bstr_destroy(c);
+	}
+	bstr_set_simd_level(saved);
+	return result;
+}
+
+// Property: bstr_cmp and bstr_ncmp match a bytewise reference at every
+// SIMD level
+static prop_result prop_bstr_cmp(void *env)
+{
+	(void)env; // Unused parameter
+
+	unsigned char s[150], t[150];
+	int slen = rand() % 150;
+	int tlen = rand() % 4 ? slen : rand() % 150;
+	for (int i = 0; i < 150; i++)
+		s[i] = t[i] = (unsigned char)(rand() % 256);
+	if (rand() % 2)
+		t[rand() % 150] = (unsigned char)(rand() % 256);
+
+	int n = rand() % 160;
+	int min = slen < tlen ? slen : tlen;
+	int diff = 0, ndiff = 0;
+	for (int i = 0; i < min && !diff; i++) {
+		diff = s[i] - t[i];
+		if (i < n)
+			ndiff = diff;
+	}
+	if (!diff)
+		diff = (slen > tlen) - (tlen > slen);
+	if (!ndiff && n > min)
+		ndiff = (slen > tlen) - (tlen > slen);
+
+	prop_result result = PROP_PASS;
+	int saved = bstr_simd_level();
+	bstr a = blk_to_bstr(s, slen);
+	bstr b = blk_to_bstr(t, tlen);
+	for (int level = BSTR_SIMD_NONE; level <= BSTR_SIMD_AVX2; level++) {
+		bstr_set_simd_level(level);
+		if (!a || !b || bstr_cmp(a, b) != diff || bstr_ncmp(a, b, n) != ndiff ||
+		    bstr_eq(a, b) != (diff == 0))
+			result = PROP_FAIL;
+	}
+	bstr_set_simd_level(saved);
+	bstr_destroy(a);
+	bstr_destroy(b);
+	return result;
+}
+
+// Property: the long-input hash gives the same value at every SIMD level,
+// and a one-bit change alters it
+static prop_result prop_bstr_hash(void *env)
+{
+	(void)env; // Unused parameter
+
+	static unsigned char buf[4096];
+	int len = rand() % 4096;
+	uint64_t seed = (uint64_t)rand() << 32 | (uint64_t)rand();
+	for (int i = 0; i < len; i++)
+		buf[i] = (unsigned char)rand();
+
+	int saved = bstr_simd_level();
+	bstr_set_simd_level(BSTR_SIMD_NONE);
+	uint64_t h = bstr_hash_blk(buf, len, seed);
+	bstr_set_simd_level(saved);
+
+	prop_result result = PROP_PASS;
+	if (bstr_hash_blk(buf, len, seed) != h)
+		result = PROP_FAIL;
+	if (len > 0) {
+		buf[rand() % len] ^= (unsigned char)(1 << rand() % 8);
+		if (bstr_hash_blk(buf, len, seed) == h)
+			result = PROP_FAIL;
+	}
+	return result;
+}
+
+// Property: a bstr_map under random puts and removes agrees with a
+// direct-indexed reference table
+static prop_result prop_bstr_map(void *env)
+{
+	(void)env; // Unused parameter
+
+	enum { KEYS = 600 };
+	static int ref[KEYS];
+	char name[16];
+	prop_result result = PROP_PASS;
+	int saved = bstr_simd_level();
+
+	bstr_set_simd_level(rand() % 3);
+	struct bstr_map *m = bstr_map_create();
+	if (!m) {
+		bstr_set_simd_level(saved);
+		return PROP_FAIL;
+	}
+	memset(ref, 0, sizeof(ref));
+
+	int ops = rand() % 3000;
+	for (int n = 0; n < ops && result == PROP_PASS; n++) {
+		int k = rand() % KEYS;
+		int len = sprintf(name, "key%d", k);
+		bstr key = blk_to_bstr(name, len);
+		if (!key) {
+			result = PROP_FAIL;
+			break;
+		}
+		if (rand() % 3) {
+			if (bstr_map_put(m, key, (void *)(size_t)(n + 1)) != BSTR_OK)
+				result = PROP_FAIL;
+			ref[k] = n + 1;
+		} else {
+			if ((bstr_map_remove(m, key) == BSTR_OK) != (ref[k] != 0))
+				result = PROP_FAIL;
+			ref[k] = 0;
+		}
+		bstr_destroy(key);
+	}
+
+	int live = 0;
+	for (int k = 0; k < KEYS; k++) {
+		int len = sprintf(name, "key%d", k);
+		void **v = bstr_map_get_blk(m, name, len);
+		if (ref[k] ? (!v || (size_t)*v != (size_t)ref[k]) : v != NULL)
+			result = PROP_FAIL;
+		live += ref[k] != 0;
+	}
+	if (m->size != live)
+		result = PROP_FAIL;
+
+	bstr_map_destroy(m);
+	bstr_set_simd_level(saved);
+	return result;
+}
+
+// Property: bstr_append_double reads back as the same double, and
+// bstr_append_fixed matches printf("%.*f")
+static prop_result prop_bstr_append_double(void *env)
+{
+	(void)env; // Unused parameter
+
+	uint64_t u = (uint64_t)rand() << 62 ^ (uint64_t)rand() << 31 ^ (uint64_t)rand();
+	double v;
+	memcpy(&v, &u, sizeof(v));
+	if (rand() % 2)
+		v = (double)(rand() % 2000000 - 1000000) / (1 << rand() % 24);
+
+	bstr b = bstr_from_cstr("x=");
+	if (!b || bstr_append_double(b, v) != BSTR_OK) {
+		bstr_destroy(b);
+		return PROP_FAIL;
+	}
+
+	prop_result result = PROP_PASS;
+	double r = strtod((char *)b->data + 2, NULL);
+	if (v == v && memcmp(&r, &v, sizeof(v)) != 0)
+		result = PROP_FAIL;
+
+	char ref[400];
+	int prec = rand() % 20;
+	snprintf(ref, sizeof(ref), "x=%.*f", prec, v);
+	if (bstr_trunc(b, 2) != BSTR_OK || bstr_append_fixed(b, v, prec) != BSTR_OK ||
+	    strcmp((char *)b->data, ref) != 0)
+		result = PROP_FAIL;
+
+	bstr_destroy(b);
+	return result;
+}
+
+// Property: random appends, prepends and inserts on a rope agree with
+// the same edits applied to a bstr
+static prop_result prop_bstr_rope(void *env)
+{
+	(void)env; // Unused parameter
+
+	static char piece[8192];
+	struct bstr_rope *r = bstr_rope_create();
+	bstr ref = bstr_from_cstr("");
+	prop_result result = PROP_PASS;
+	if (!r || !ref)
+		return PROP_FAIL;
+
+	for (int step = rand() % 200; step > 0; step--) {
+		int len = rand() % 4 ? rand() % 40 : rand() % (int)sizeof(piece);
+		for (int i = 0; i < len; i++)
+			piece[i] = (char)rand();
+		bstr b = blk_to_bstr(piece, len);
+		int pos = rand() % (ref->slen + 1);
+		switch (rand() % 3) {
+		case 0:
+			bstr_rope_append(r, b);
+			bstr_concat(ref, b);
+			break;
+		case 1:
+			bstr_rope_prepend(r, b);
+			bstr_insert(ref, 0, b, ' ');
+			break;
+		default:
+			bstr_rope_insert(r, pos, b);
+			bstr_insert(ref, pos, b, ' ');
+			break;
+		}
+		bstr_destroy(b);
+		if (rand() % 20 == 0) {
+			bstr flat = bstr_rope_flatten(r);
+			if (!flat || bstr_eq(flat, ref) != 1)
+				result = PROP_FAIL;
+		}
+	}
+
+	bstr flat = bstr_rope_flatten(r);
+	if (!flat || bstr_eq(flat, ref) != 1 || bstr_rope_len(r) != ref->slen)
+		result = PROP_FAIL;
+	bstr_destroy(ref);
+	bstr_rope_destroy(r);
+	return result;
+}
+
+// Property: random clustered inserts and deletes on a gap buffer agree
+// with the same edits applied to a bstr
+static prop_result prop_bstr_gap(void *env)
+{
+	(void)env; // Unused parameter
+
+	char piece[64];
+	bstr ref = bstr_from_cstr("");
+	struct bstr_gap *g = bstr_gap_create(ref);
+	prop_result result = PROP_PASS;
+	if (!ref || !g)
+		return PROP_FAIL;
+
+	int cursor = 0;
+	for (int step = rand() % 300; step > 0; step--) {
+		// Mostly stay near the previous edit
+		if (rand() % 8 == 0)
+			cursor = rand() % (ref->slen + 1);
+		else
+			cursor += rand() % 5 - 2;
+		if (cursor < 0)
+			cursor = 0;
+		if (cursor > ref->slen)
+			cursor = ref->slen;
+
+		if (rand() % 3) {
+			int len = rand() % (int)sizeof(piece);
+			for (int i = 0; i < len; i++)
+				piece[i] = (char)rand();
+			bstr b = blk_to_bstr(piece, len);
+			bstr_gap_insert(g, cursor, b);
+			bstr_insert(ref, cursor, b, ' ');
+			bstr_destroy(b);
+		} else {
+			int len = rand() % 16;
+			bstr tail = bstr_mid(ref, cursor + len, ref->slen);
+			bstr_trunc(ref, cursor);
+			bstr_concat(ref, tail);
+			bstr_destroy(tail);
+			bstr_gap_delete(g, cursor, len);
+		}
+		if (rand() % 30 == 0 && bstr_eq(bstr_gap_str(g), ref) != 1)
+			result = PROP_FAIL;
+	}
+
+	if (bstr_gap_len(g) != ref->slen || bstr_eq(bstr_gap_str(g), ref) != 1)
+		result = PROP_FAIL;
+	bstr_destroy(ref);
+	bstr_gap_destroy(g);
+	return result;
+}
+
+// Property: strings copied from one shared buffer and then changed at
+// random never see each other's changes
+static prop_result prop_bstr_share(void *env)
+{
+	(void)env; // Unused parameter
+
+	enum { N = 6 };
+	bstr s[N], ref[N];
+	char text[48];
+	int len = rand() % (int)sizeof(text);
+	for (int i = 0; i < len; i++)
+		text[i] = (char)('a' + rand() % 26);
+
+	s[0] = blk_to_bstr(text, len);
+	ref[0] = blk_to_bstr(text, len);
+	for (int i = 1; i < N; i++) {
+		s[i] = rand() % 2 ? bstr_share(s[rand() % i]) : bstr_copy(s[rand() % i]);
+		ref[i] = bstr_copy(ref[0]);
+	}
+
+	for (int step = 0; step < 40; step++) {
+		int i = rand() % N;
+		switch (rand() % 5) {
+		case 0:
+			bstr_catcstr(s[i], "xy");
+			bstr_catcstr(ref[i], "xy");
+			break;
+		case 1:
+			bstr_toupper(s[i]);
+			bstr_toupper(ref[i]);
+			break;
+		case 2: {
+			int n = rand() % 50;
+			bstr_trunc(s[i], n);
+			bstr_trunc(ref[i], n);
+			break;
+		}
+		case 3: {
+			// Replace with a fresh share of another string
+			int j = rand() % N;
+			bstr c = bstr_share(s[j]);
+			bstr r = bstr_copy(ref[j]);
+			bstr_destroy(s[i]);
+			bstr_destroy(ref[i]);
+			s[i] = c;
+			ref[i] = r;
+			break;
+		}
+		default: {
+			int j = rand() % N;
+			bstr_assign(s[i], s[j]);
+			bstr_assign(ref[i], ref[j]);
+			break;
+		}
+		}
+	}
+
+	prop_result result = PROP_PASS;
+	for (int i = 0; i < N; i++) {
+		if (bstr_eq(s[i], ref[i]) != 1 || s[i]->data[s[i]->slen] != '\0')
+			result = PROP_FAIL;
+		bstr_destroy(s[i]);
+		bstr_destroy(ref[i]);
+	}
+	return result;
+}
+
 // Define the property tests using the macros
 PROP_TEST(prop_bstr_from_cstr_test, prop_bstr_from_cstr);
 PROP_TEST(prop_bstr_copy_test, prop_bstr_copy);
@@ -719,6 +2735,21 @@ PROP_TEST(prop_bstr_insert_test, prop_bstr_insert);
 PROP_TEST(prop_bstr_cmp_icmp_test, prop_bstr_cmp_icmp);
 PROP_TEST(prop_bstr_split_splits_test, prop_bstr_split_splits);
 PROP_TEST(prop_bstr_join_test, prop_bstr_join);
+PROP_TEST(prop_bstr_find_test, prop_bstr_find);
+PROP_TEST(prop_bstr_pattern_find_test, prop_bstr_pattern_find);
+PROP_TEST(prop_bstr_ac_search_test, prop_bstr_ac_search);
+PROP_TEST(prop_bstr_split_cb_test, prop_bstr_split_cb);
+PROP_TEST(prop_bstr_charset_test, prop_bstr_charset);
+PROP_TEST(prop_bstr_split_str_cb_test, prop_bstr_split_str_cb);
+PROP_TEST(prop_bstr_split_view_test, prop_bstr_split_view);
+PROP_TEST(prop_bstr_case_test, prop_bstr_case);
+PROP_TEST(prop_bstr_cmp_test, prop_bstr_cmp);
+PROP_TEST(prop_bstr_hash_test, prop_bstr_hash);
+PROP_TEST(prop_bstr_map_test, prop_bstr_map);
+PROP_TEST(prop_bstr_append_double_test, prop_bstr_append_double);
+PROP_TEST(prop_bstr_rope_test, prop_bstr_rope);
+PROP_TEST(prop_bstr_gap_test, prop_bstr_gap);
+PROP_TEST(prop_bstr_share_test, prop_bstr_share);
 
 // Define the unit tests using the macros
 UNIT_TEST(test_bstr_create_and_destroy_test, test_bstr_create_and_destroy);
@@ -735,6 +2766,31 @@ UNIT_TEST(test_bstr_split_test, test_bstr_split);
 UNIT_TEST(test_bstr_splits_test, test_bstr_splits);
 UNIT_TEST(test_bstr_split_str_test, test_bstr_split_str);
 UNIT_TEST(test_bstr_join_test, test_bstr_join);
+UNIT_TEST(test_bstr_sso_test, test_bstr_sso);
+UNIT_TEST(test_bstr_single_block_test, test_bstr_single_block);
+UNIT_TEST(test_bstr_arena_test, test_bstr_arena);
+UNIT_TEST(test_bstr_pool_test, test_bstr_pool);
+UNIT_TEST(test_bstr_find_test, test_bstr_find);
+UNIT_TEST(test_bstr_pattern_test, test_bstr_pattern);
+UNIT_TEST(test_bstr_ac_test, test_bstr_ac);
+UNIT_TEST(test_bstr_split_offsets_test, test_bstr_split_offsets);
+UNIT_TEST(test_bstr_charset_test, test_bstr_charset);
+UNIT_TEST(test_bstr_pattern_split_test, test_bstr_pattern_split);
+UNIT_TEST(test_bstr_view_test, test_bstr_view);
+UNIT_TEST(test_bstr_packed_test, test_bstr_packed);
+UNIT_TEST(test_bstr_join_into_test, test_bstr_join_into);
+UNIT_TEST(test_bstr_toupper_test, test_bstr_toupper);
+UNIT_TEST(test_bstr_cmp_binary_test, test_bstr_cmp_binary);
+UNIT_TEST(test_bstr_hash_test, test_bstr_hash);
+UNIT_TEST(test_bstr_map_test, test_bstr_map);
+UNIT_TEST(test_bstr_intern_test, test_bstr_intern);
+UNIT_TEST(test_bstr_appendf_test, test_bstr_appendf);
+UNIT_TEST(test_bstr_append_numbers_test, test_bstr_append_numbers);
+UNIT_TEST(test_bstr_rope_test, test_bstr_rope);
+UNIT_TEST(test_bstr_gap_test, test_bstr_gap);
+UNIT_TEST(test_bstr_share_test, test_bstr_share);
+UNIT_TEST(test_bstr_map_file_test, test_bstr_map_file);
+UNIT_TEST(test_bstr_large_offsets_test, test_bstr_large_offsets);
 
 // Main function to run all tests
 int main(void)
@@ -752,7 +2808,32 @@ int main(void)
 		test_bstr_split_test,
 		test_bstr_splits_test,
 		test_bstr_split_str_test,
-		test_bstr_join_test
+		test_bstr_join_test,
+		test_bstr_sso_test,
+		test_bstr_single_block_test,
+		test_bstr_arena_test,
+		test_bstr_pool_test,
+		test_bstr_find_test,
+		test_bstr_pattern_test,
+		test_bstr_ac_test,
+		test_bstr_split_offsets_test,
+		test_bstr_charset_test,
+		test_bstr_pattern_split_test,
+		test_bstr_view_test,
+		test_bstr_packed_test,
+		test_bstr_join_into_test,
+		test_bstr_toupper_test,
+		test_bstr_cmp_binary_test,
+		test_bstr_hash_test,
+		test_bstr_map_test,
+		test_bstr_intern_test,
+		test_bstr_appendf_test,
+		test_bstr_append_numbers_test,
+		test_bstr_rope_test,
+		test_bstr_gap_test,
+		test_bstr_share_test,
+		test_bstr_map_file_test,
+		test_bstr_large_offsets_test
 		);
 
 	RUN_PROP_TESTS(
@@ -765,7 +2846,22 @@ int main(void)
 		prop_bstr_insert_test,
 		prop_bstr_cmp_icmp_test,
 		prop_bstr_split_splits_test,
-		prop_bstr_join_test
+		prop_bstr_join_test,
+		prop_bstr_find_test,
+		prop_bstr_pattern_find_test,
+		prop_bstr_ac_search_test,
+		prop_bstr_split_cb_test,
+		prop_bstr_charset_test,
+		prop_bstr_split_str_cb_test,
+		prop_bstr_split_view_test,
+		prop_bstr_case_test,
+		prop_bstr_cmp_test,
+		prop_bstr_hash_test,
+		prop_bstr_map_test,
+		prop_bstr_append_double_test,
+		prop_bstr_rope_test,
+		prop_bstr_gap_test,
+		prop_bstr_share_test
 		);
 
 	uptest_summary(); // Print the unified summary